@@ -14,8 +14,10 @@ You can compile and run this example on Linux with:
 #include <wasi.h>
 #include <wasm.h>
 #include <wasmtime.h>
-#include <host/poll.h>
-#include <host/socket.h>
+#include <host/driver/epoll.h>
+#include <host/driver/module_cache.h>
+#include <host/driver/poll.h>
+#include <host/driver/socket.h>
 #include <host/wasmtime_utils.h>
 
 static void exit_with_error(const char *message, wasmtime_error_t *error,
@@ -29,9 +31,11 @@ int main(int argc, const char **argv) {
   }
 
   // Set up our context
-  wasm_engine_t *engine = wasm_engine_new();
+  wasm_engine_t *engine = wasm_engine_new_with_config(host_engine_config_new());
   assert(engine != NULL);
-  wasmtime_store_t *store = wasmtime_store_new(engine, NULL, NULL);
+  host_context_t hctx;
+  host_context_init(&hctx);
+  wasmtime_store_t *store = wasmtime_store_new(engine, &hctx, NULL);
   assert(store != NULL);
   wasmtime_context_t *context = wasmtime_store_context(store);
 
@@ -41,29 +45,11 @@ int main(int argc, const char **argv) {
   if (error != NULL)
     exit_with_error("failed to link wasi", error, NULL);
 
-  // Load our input file to parse it next
-  wasm_byte_vec_t wasm;
-  FILE *file = fopen(argv[1], "rb");
-  if (!file) {
-    printf("> Error loading file!\n");
-    exit(1);
-  }
-  fseek(file, 0L, SEEK_END);
-  size_t file_size = ftell(file);
-  wasm_byte_vec_new_uninitialized(&wasm, file_size);
-  fseek(file, 0L, SEEK_SET);
-  if (fread(wasm.data, file_size, 1, file) != 1) {
-    printf("> Error loading module!\n");
-    exit(1);
-  }
-  fclose(file);
-
-  // Compile our modules
+  // Load our module, preferably from its precompiled artifact.
   wasmtime_module_t *module = NULL;
-  error = wasmtime_module_new(engine, (uint8_t *)wasm.data, wasm.size, &module);
-  if (!module)
+  error = host_module_load(engine, argv[1], true, &module);
+  if (error != NULL)
     exit_with_error("failed to compile module", error, NULL);
-  wasm_byte_vec_delete(&wasm);
 
   // Instantiate wasi
   wasi_config_t *wasi_config = wasi_config_new();
@@ -80,11 +66,15 @@ int main(int argc, const char **argv) {
     exit_with_error("failed to instantiate WASI", error, NULL);
 
   // Link host functions
-  error = host_socket_init(linker, context, "host_socket");
+  error = host_socket_init(linker, "host_socket");
+  if (error != NULL)
+    exit_with_error("failed to export host function", error, NULL);
+
+  error = host_poll_init(linker, "host_poll");
   if (error != NULL)
     exit_with_error("failed to export host function", error, NULL);
 
-  error = host_poll_init(linker, context, "host_poll");
+  error = host_epoll_init(linker, "host_epoll");
   if (error != NULL)
     exit_with_error("failed to export host function", error, NULL);
 
@@ -106,6 +96,7 @@ int main(int argc, const char **argv) {
   // Clean up after ourselves at this point
   host_socket_delete();
   host_poll_delete();
+  host_epoll_delete();
   wasmtime_linker_delete(linker);
   wasmtime_module_delete(module);
   wasmtime_store_delete(store);
@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <buf_pool.h>
 #include <host/errno.h>
 #include <limits.h>
 #include <stdbool.h>
@@ -18,9 +19,13 @@ int main(void) {
   uint32_t nclients = 0;
   struct wasio_pollfd *wfd = (struct wasio_pollfd*)malloc(sizeof(struct wasio_pollfd)*max_clients);
   uint8_t **buffers = (uint8_t**)malloc(sizeof(uint8_t*)*max_clients);
+  // Every client holds at most one buffer, which goes back to the pool
+  // once the echo is done.
+  buf_pool_t pool;
+  assert(buf_pool_new(max_clients, &pool) == BUF_POOL_OK);
   for (uint32_t i = 0; i < max_clients; i++)
     buffers[i] = NULL;
-  struct wasio_event ev;
+  struct wasio_event *ev = WASIO_EVENT_INITIALISER(max_clients);
   wasio_fd_t sockfd, clientfd;
   assert(wasio_init(wfd, max_clients) == WASIO_OK);
   //printf("Setting up listener..\n");
@@ -31,13 +36,14 @@ int main(void) {
   bool keep_going = true;
   while (keep_going) {
     uint32_t nevents = 0;
-    wasio_result_t ans = wasio_poll(wfd, &ev, max_clients, &nevents, 1000);
+    wasio_result_t ans = wasio_poll(wfd, ev, max_clients, &nevents, 1000);
     if (ans != WASIO_OK) {
       //printf("Poll failed: error(%d): %s\n", (int)host_errno, host_strerror(host_errno));
       break;
     }
 
-    WASIO_EVENT_FOREACH(wfd, &ev, nevents, vfd, {
+    WASIO_EVENT_FOREACH(wfd, ev, nevents, vfd, revents, {
+        (void)revents;
         printf("vfd: %d\n", (int)vfd);
         if (vfd == sockfd) {
           //printf("Attempting to accept new client...\n");
@@ -50,7 +56,8 @@ int main(void) {
           assert(wasio_notify_recv(wfd, sockfd) == WASIO_OK);
         } else if (buffers[vfd] == NULL) { // Ready to receive
           uint32_t nrecv = 0;
-          buffers[vfd] = (uint8_t*)malloc(sizeof(uint8_t)*buffer_size);
+          buffers[vfd] = (uint8_t*)buf_pool_acquire(pool, buffer_size);
+          assert(buffers[vfd] != NULL);
           ans = wasio_recv(wfd, vfd, buffers[vfd], buffer_size, &nrecv);
           if (ans != WASIO_OK) {
             abort();
@@ -72,6 +79,8 @@ int main(void) {
               assert(wasio_notify_send(wfd, vfd) == WASIO_OK); // TODO(dhil): remember nrecv - nsent
               continue;
             }
+            buf_pool_release(pool, buffers[vfd]);
+            buffers[vfd] = NULL;
             wasio_close(wfd, vfd);
           }
         } else { // Ready to send
@@ -79,7 +88,7 @@ int main(void) {
           if (ans != WASIO_OK) {
             abort();
           }
-          free(buffers[vfd]);
+          buf_pool_release(pool, buffers[vfd]);
           buffers[vfd] = NULL;
           wasio_close(wfd, vfd);
           nclients--;
@@ -123,6 +132,10 @@ int main(void) {
   wasio_close(wfd, sockfd);
   wasio_finalize(wfd);
   free(wfd);
+  free(ev);
+  for (uint32_t i = 0; i < max_clients; i++)
+    if (buffers[i] != NULL) buf_pool_release(pool, buffers[i]);
   free(buffers);
+  buf_pool_delete(pool);
   return 0;
 }
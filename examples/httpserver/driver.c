@@ -7,40 +7,286 @@ You can compile and run this example on Linux with:
    clang-19 driver.c -I ../../wasmtime/crates/c-api/include -I ../../wasmtime/crates/c-api/wasm-c-api/include ../../wasmtime/target/release/libwasmtime.a -lpthread -ldl -lm -o driver
 */
 
+#define _GNU_SOURCE // for pthread_setaffinity_np
 #include <assert.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
 #include <wasi.h>
 #include <wasm.h>
 #include <wasmtime.h>
+#include <host/driver/epoll.h>
+#include <host/driver/module_cache.h>
 #include <host/driver/poll.h>
+#include <host/driver/ring.h>
 #include <host/driver/socket.h>
 #include <host/wasmtime_utils.h>
 
+static void log_error(const char *message, wasmtime_error_t *error,
+                      wasm_trap_t *trap);
 static void exit_with_error(const char *message, wasmtime_error_t *error,
                             wasm_trap_t *trap);
 
-int main(int argc, const char **argv) {
+// A worker owns a store and an instance of the module. The engine,
+// module, and linker are shared between all workers. Each instance
+// opens its own listener; with more than one worker the listeners
+// share the port through SO_REUSEPORT, and the kernel spreads incoming
+// connections across them.
+struct worker {
+  pthread_t thread;
+  uint32_t id;
+  int cpu; // CPU to pin the worker to, or -1.
+  wasm_engine_t *engine;
+  const wasmtime_linker_t *linker;
+  const wasmtime_module_t *module;
+  // Only used in isolation mode.
+  const wasmtime_instance_pre_t *instance_pre;
+};
 
-  if (argc < 2) {
-    printf("usage: %s <file.wasm>\n", argv[0]);
+static void pin_worker(const struct worker *w) {
+  if (w->cpu < 0) return;
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(w->cpu, &cpus);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus) != 0)
+    fprintf(stderr, "warning: failed to pin worker %u to CPU %d\n", w->id, w->cpu);
+}
+
+// Creates a store with a WASI context, and `hctx` as its data.
+static wasmtime_store_t* new_store(wasm_engine_t *engine, host_context_t *hctx) {
+  host_context_init(hctx);
+  wasmtime_store_t *store = wasmtime_store_new(engine, hctx, NULL);
+  assert(store != NULL);
+  wasmtime_context_t *context = wasmtime_store_context(store);
+
+  // Instantiate wasi
+  wasi_config_t *wasi_config = wasi_config_new();
+  assert(wasi_config);
+  wasi_config_inherit_argv(wasi_config);
+  wasi_config_inherit_env(wasi_config);
+  wasi_config_inherit_stdin(wasi_config);
+  wasi_config_inherit_stdout(wasi_config);
+  wasi_config_inherit_stderr(wasi_config);
+
+  wasmtime_error_t *error = wasmtime_context_set_wasi(context, wasi_config);
+  if (error != NULL)
+    exit_with_error("failed to instantiate WASI", error, NULL);
+  return store;
+}
+
+static void* run_worker(void *arg) {
+  struct worker *w = (struct worker*)arg;
+  pin_worker(w);
+
+  // Set up the worker's store.
+  host_context_t hctx;
+  wasmtime_store_t *store = new_store(w->engine, &hctx);
+  wasmtime_context_t *context = wasmtime_store_context(store);
+  wasm_trap_t *trap = NULL;
+  wasmtime_error_t *error = NULL;
+
+  // Instantiate the module
+  // NOTE(dhil): `wasmtime_linker_module` would define the instance in
+  // the linker, which is shared, hence the module is instantiated
+  // directly and its entry point looked up by hand.
+  wasmtime_instance_t instance;
+  error = wasmtime_linker_instantiate(w->linker, context, w->module, &instance, &trap);
+  if (error != NULL || trap != NULL)
+    exit_with_error("failed to instantiate module", error, trap);
+
+  // Run it.
+  wasmtime_extern_t start;
+  if (!wasmtime_instance_export_get(context, &instance, "_start", strlen("_start"), &start) || start.kind != WASMTIME_EXTERN_FUNC) {
+    fprintf(stderr, "error: failed to locate _start export for module\n");
     exit(1);
   }
 
+  error = wasmtime_func_call(context, &start.of.func, NULL, 0, NULL, 0, &trap);
+  if (error != NULL || trap != NULL)
+    exit_with_error("error calling default export", error, trap);
+
+  // The instance has quit; take the other workers down with it. Their
+  // instances are blocked in, or will soon call into, the host's wait
+  // primitives, which fail from now on.
+  host_poll_shutdown();
+  host_epoll_shutdown();
+  host_ring_shutdown();
+
+  host_ring_release();
+  wasmtime_store_delete(store);
+  return NULL;
+}
+
+// Isolation mode: the host accepts connections itself and serves each
+// one with a fresh instance of the module, which must export
+// `handle_connection(fd) -> i32`. Instances are created from a
+// pre-linked template and are backed by the pooling allocator, which
+// resets linear memory copy-on-write when an instance is torn down.
+#define ISOLATION_PORT 8080
+#define ISOLATION_POOL_SIZE 1000
+// Per-call send and receive timeout, which bounds how long a silent
+// client can keep the guest blocked inside a single host call.
+#define ISOLATION_IO_TIMEOUT_SECS 5
+// Total time budget for a connection, measured in epoch ticks. Epoch
+// interruption only fires while the guest executes, hence a client that
+// trickles bytes is cut off within the budget plus one I/O timeout.
+#define ISOLATION_EPOCH_TICK_MS 100
+#define ISOLATION_DEADLINE_TICKS 300
+
+static atomic_bool isolated_stop = false;
+
+// Advances the engine epoch until shut down.
+static void* run_epoch_ticker(void *arg) {
+  wasm_engine_t *engine = (wasm_engine_t*)arg;
+  struct timespec tick = { .tv_sec = 0, .tv_nsec = ISOLATION_EPOCH_TICK_MS * 1000000L };
+  while (!atomic_load(&isolated_stop)) {
+    (void)nanosleep(&tick, NULL);
+    wasmtime_engine_increment_epoch(engine);
+  }
+  return NULL;
+}
+
+// Serves `connfd` with a fresh instance. Returns whether the instance
+// requested shut down. A failing instance only takes down its own
+// connection: exhausted pool slots or memory limits, traps (including
+// an expired deadline), and missing exports are logged, and the worker
+// keeps serving.
+static bool isolated_serve(const struct worker *w, int connfd) {
+  host_context_t hctx;
+  wasmtime_store_t *store = new_store(w->engine, &hctx);
+  wasmtime_context_t *context = wasmtime_store_context(store);
+  // The deadline covers instantiation, initialisation, and serving; on
+  // expiry the guest traps and the connection is dropped.
+  wasmtime_context_set_epoch_deadline(context, ISOLATION_DEADLINE_TICKS);
+
+  bool stop = false;
+  wasm_trap_t *trap = NULL;
+  wasmtime_instance_t instance;
+  wasmtime_extern_t item;
+  wasmtime_error_t *error = wasmtime_instance_pre_instantiate(w->instance_pre, context, &instance, &trap);
+  if (error != NULL || trap != NULL) {
+    log_error("failed to instantiate module", error, trap);
+    goto done;
+  }
+
+  // Run the reactor initialiser, if any.
+  if (wasmtime_instance_export_get(context, &instance, "_initialize", strlen("_initialize"), &item) && item.kind == WASMTIME_EXTERN_FUNC) {
+    error = wasmtime_func_call(context, &item.of.func, NULL, 0, NULL, 0, &trap);
+    if (error != NULL || trap != NULL) {
+      log_error("error calling _initialize", error, trap);
+      goto done;
+    }
+  }
+
+  if (!wasmtime_instance_export_get(context, &instance, "handle_connection", strlen("handle_connection"), &item) || item.kind != WASMTIME_EXTERN_FUNC) {
+    log_error("failed to locate handle_connection export for module", NULL, NULL);
+    goto done;
+  }
+
+  wasmtime_val_t arg = { .kind = WASMTIME_I32, .of = { .i32 = connfd } };
+  wasmtime_val_t result;
+  error = wasmtime_func_call(context, &item.of.func, &arg, 1, &result, 1, &trap);
+  if (error != NULL || trap != NULL) {
+    log_error("error calling handle_connection", error, trap);
+    goto done;
+  }
+  stop = result.of.i32 != 0;
+
+done:
+  // Dropping the store returns the instance slot to the pool. Any
+  // ring set up by the instance must not outlive it. The caller closes
+  // the connection.
+  host_ring_release();
+  wasmtime_store_delete(store);
+  return stop;
+}
+
+static void* run_isolated_worker(void *arg) {
+  struct worker *w = (struct worker*)arg;
+  pin_worker(w);
+
+  int listenfd = host_socket_listen(ISOLATION_PORT, 1000);
+  if (listenfd < 0) {
+    perror("listen");
+    exit(1);
+  }
+
+  struct timeval timeout = { .tv_sec = ISOLATION_IO_TIMEOUT_SECS, .tv_usec = 0 };
+  struct pollfd pfd = { .fd = listenfd, .events = POLLIN, .revents = 0 };
+  while (!atomic_load(&isolated_stop)) {
+    // Wake up periodically to observe shut down requests served by
+    // other workers.
+    if (poll(&pfd, 1, 1000) <= 0) continue;
+    int connfd = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC);
+    if (connfd < 0) continue;
+    (void)setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    (void)setsockopt(connfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    if (isolated_serve(w, connfd)) atomic_store(&isolated_stop, true);
+    close(connfd);
+  }
+
+  close(listenfd);
+  return NULL;
+}
+
+static void usage(const char *prog) {
+  printf("usage: %s [-t <threads>] [-p] [-i] <file.wasm>\n", prog);
+  printf("  -t <threads>  number of worker threads (default: 1)\n");
+  printf("  -p            pin worker i to the i'th available CPU\n");
+  printf("  -i            isolation mode: serve every connection with a fresh instance\n");
+  exit(1);
+}
+
+int main(int argc, char * const *argv) {
+  uint32_t nworkers = 1;
+  bool pin = false;
+  bool isolated = false;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "t:pi")) != -1) {
+    switch (opt) {
+    case 't': {
+      long n = strtol(optarg, NULL, 10);
+      if (n < 1 || n > CPU_SETSIZE) usage(argv[0]);
+      nworkers = (uint32_t)n;
+    }
+      break;
+    case 'p':
+      pin = true;
+      break;
+    case 'i':
+      isolated = true;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+
+  if (optind >= argc) usage(argv[0]);
+  const char *wasm_file = argv[optind];
+
   // Set up our context
-  wasm_config_t *config = wasm_config_new();
-#if defined DEBUG
-  wasmtime_config_debug_info_set(config, true);
-#endif
-  wasmtime_config_wasm_function_references_set(config, true);
-  wasmtime_config_wasm_exceptions_set(config, true);
-  wasmtime_config_wasm_typed_continuations_set(config, true);
+  wasm_config_t *config = host_engine_config_new();
+  if (isolated) {
+    wasmtime_pooling_allocation_config_t *pooling = wasmtime_pooling_allocation_config_new();
+    wasmtime_pooling_allocation_config_total_core_instances_set(pooling, ISOLATION_POOL_SIZE);
+    wasmtime_pooling_allocation_config_total_memories_set(pooling, ISOLATION_POOL_SIZE);
+    wasmtime_pooling_allocation_config_total_tables_set(pooling, ISOLATION_POOL_SIZE);
+    wasmtime_pooling_allocation_strategy_set(config, pooling);
+    wasmtime_pooling_allocation_config_delete(pooling);
+    wasmtime_config_memory_init_cow_set(config, true);
+    wasmtime_config_epoch_interruption_set(config, true);
+  }
   wasm_engine_t *engine = wasm_engine_new_with_config(config);
   assert(engine != NULL);
-  wasmtime_store_t *store = wasmtime_store_new(engine, NULL, NULL);
-  assert(store != NULL);
-  wasmtime_context_t *context = wasmtime_store_context(store);
 
   // Create a linker with WASI functions defined
   wasmtime_linker_t *linker = wasmtime_linker_new(engine);
@@ -50,81 +296,103 @@ int main(int argc, const char **argv) {
   if (error != NULL)
     exit_with_error("failed to link wasi", error, NULL);
 
-  // Load our input file to parse it next
-  wasm_byte_vec_t wasm;
-  FILE *file = fopen(argv[1], "rb");
-  if (!file) {
-    printf("> Error loading file!\n");
-    exit(1);
-  }
-  fseek(file, 0L, SEEK_END);
-  size_t file_size = ftell(file);
-  wasm_byte_vec_new_uninitialized(&wasm, file_size);
-  fseek(file, 0L, SEEK_SET);
-  if (fread(wasm.data, file_size, 1, file) != 1) {
-    printf("> Error loading module!\n");
-    exit(1);
-  }
-  fclose(file);
-
-  // Compile our modules
+  // Load our module, preferably from its precompiled artifact.
   wasmtime_module_t *module = NULL;
-  error = wasmtime_module_new(engine, (uint8_t *)wasm.data, wasm.size, &module);
-  if (!module)
-    exit_with_error("failed to compile module", error, NULL);
-  wasm_byte_vec_delete(&wasm);
-
-  // Instantiate wasi
-  wasi_config_t *wasi_config = wasi_config_new();
-  assert(wasi_config);
-  wasi_config_inherit_argv(wasi_config);
-  wasi_config_inherit_env(wasi_config);
-  wasi_config_inherit_stdin(wasi_config);
-  wasi_config_inherit_stdout(wasi_config);
-  wasi_config_inherit_stderr(wasi_config);
-
-  wasm_trap_t *trap = NULL;
-  error = wasmtime_context_set_wasi(context, wasi_config);
+  error = host_module_load(engine, wasm_file, true, &module);
   if (error != NULL)
-    exit_with_error("failed to instantiate WASI", error, NULL);
+    exit_with_error("failed to compile module", error, NULL);
 
   // Link host functions
-  error = host_socket_init(linker, context, "host_socket");
+  error = host_socket_init(linker, "host_socket");
   if (error != NULL)
     exit_with_error("failed to export host function", error, NULL);
 
-  error = host_poll_init(linker, context, "host_poll");
+  error = host_poll_init(linker, "host_poll");
   if (error != NULL)
     exit_with_error("failed to export host function", error, NULL);
 
-  // Instantiate the module
-  error = wasmtime_linker_module(linker, context, "", 0, module);
+  error = host_epoll_init(linker, "host_epoll");
   if (error != NULL)
-    exit_with_error("failed to instantiate module", error, NULL);
+    exit_with_error("failed to export host function", error, NULL);
 
-  // Run it.
-  wasmtime_func_t func;
-  error = wasmtime_linker_get_default(linker, context, "", 0, &func);
+  error = host_ring_init(linker, "host_ring");
   if (error != NULL)
-    exit_with_error("failed to locate default export for module", error, NULL);
+    exit_with_error("failed to export host function", error, NULL);
 
-  error = wasmtime_func_call(context, &func, NULL, 0, NULL, 0, &trap);
-  if (error != NULL || trap != NULL)
-    exit_with_error("error calling default export", error, trap);
+  // Pre-link the module once; instantiating the template skips import
+  // resolution and type checking.
+  wasmtime_instance_pre_t *instance_pre = NULL;
+  if (isolated) {
+    error = wasmtime_linker_instantiate_pre(linker, module, &instance_pre);
+    if (error != NULL)
+      exit_with_error("failed to pre-link module", error, NULL);
+  }
+
+  // Assign CPUs round-robin from those available to the process.
+  int cpus[CPU_SETSIZE];
+  int ncpus = 0;
+  if (pin) {
+    cpu_set_t available;
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &available) != 0) {
+      perror("sched_getaffinity");
+      exit(1);
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &available)) cpus[ncpus++] = cpu;
+    }
+  }
+
+  struct worker *workers = (struct worker*)malloc(sizeof(struct worker)*nworkers);
+  assert(workers != NULL);
+  for (uint32_t i = 0; i < nworkers; i++) {
+    workers[i] = (struct worker){
+      .id = i,
+      .cpu = ncpus > 0 ? cpus[i % (uint32_t)ncpus] : -1,
+      .engine = engine,
+      .linker = linker,
+      .module = module,
+      .instance_pre = instance_pre
+    };
+  }
+
+  pthread_t ticker;
+  if (isolated && pthread_create(&ticker, NULL, run_epoch_ticker, engine) != 0) {
+    perror("pthread_create");
+    exit(1);
+  }
+
+  host_socket_set_reuseport(nworkers > 1);
+
+  // Run the workers. The first worker runs on the main thread.
+  for (uint32_t i = 1; i < nworkers; i++) {
+    if (pthread_create(&workers[i].thread, NULL, isolated ? run_isolated_worker : run_worker, &workers[i]) != 0) {
+      perror("pthread_create");
+      exit(1);
+    }
+  }
+  (void)(isolated ? run_isolated_worker : run_worker)(&workers[0]);
+  for (uint32_t i = 1; i < nworkers; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+  if (isolated) pthread_join(ticker, NULL);
 
   // Clean up after ourselves at this point
+  free(workers);
+  if (instance_pre != NULL) wasmtime_instance_pre_delete(instance_pre);
   host_socket_delete();
   host_poll_delete();
+  host_epoll_delete();
+  host_ring_delete();
   wasmtime_linker_delete(linker);
   wasmtime_module_delete(module);
-  wasmtime_store_delete(store);
   wasm_engine_delete(engine); // deletes config too.
   return 0;
 }
 
-static void exit_with_error(const char *message, wasmtime_error_t *error,
-                            wasm_trap_t *trap) {
+static void log_error(const char *message, wasmtime_error_t *error,
+                      wasm_trap_t *trap) {
   fprintf(stderr, "error: %s\n", message);
+  if (error == NULL && trap == NULL) return;
   wasm_byte_vec_t error_message;
   if (error != NULL) {
     wasmtime_error_message(error, &error_message);
@@ -135,5 +403,10 @@ static void exit_with_error(const char *message, wasmtime_error_t *error,
   }
   fprintf(stderr, "%.*s\n", (int)error_message.size, error_message.data);
   wasm_byte_vec_delete(&error_message);
+}
+
+static void exit_with_error(const char *message, wasmtime_error_t *error,
+                            wasm_trap_t *trap) {
+  log_error(message, error, trap);
   exit(1);
 }
@@ -17,7 +17,11 @@
 #define conn_logv(...) {}
 #endif
 
-static int make_response(uint8_t *buffer, uint32_t buflen, const char *httpcode, const uint8_t *body, uint32_t content_length) {
+// Writes the status line and headers of a response whose body is
+// `content_length` bytes long. The body itself is not written, which
+// lets callers send it from where it already lives (e.g. with a
+// vectored send).
+static int make_response_header(uint8_t *buffer, uint32_t buflen, const char *httpcode, uint32_t content_length) {
   static const char *daysOfWeek[] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
   static const char *months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
 
@@ -38,11 +42,26 @@ static int make_response(uint8_t *buffer, uint32_t buflen, const char *httpcode,
   response_length += snprintf((char*)buffer + response_length, buflen - response_length,
                               "Content-Type: text/plain\r\n");
   response_length += snprintf((char*)buffer + response_length, buflen - response_length, "\r\n");
+
+  if (response_length >= buflen) {
+    return -1;
+  }
+
+  return response_length;
+}
+
+static int make_response(uint8_t *buffer, uint32_t buflen, const char *httpcode, const uint8_t *body, uint32_t content_length) {
+  int header_length = make_response_header(buffer, buflen, httpcode, content_length);
+  if (header_length < 0) {
+    return -1;
+  }
+
+  uint32_t response_length = (uint32_t)header_length;
   if (content_length > 0) {
     response_length += snprintf((char*)buffer + response_length, buflen - response_length, "%s", body);
   }
 
-  if (response_length < 0 || response_length >= buflen) {
+  if (response_length >= buflen) {
     return -1;
   }
 
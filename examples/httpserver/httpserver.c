@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <buf_pool.h>
 #include <host/errno.h>
 #include <host/poll.h>
 #include <host/socket.h>
@@ -40,6 +41,7 @@
 static const uint32_t buffer_size = 1 << 16;
 static const uint32_t max_headers = 100;
 static const uint32_t max_clients = MAX_CONNECTIONS - 1;
+static buf_pool_t bufs;
 static uint32_t clients = 0;
 
 
@@ -162,8 +164,7 @@ static wasio_result_t w_accept(struct wasio_pollfd *wfd, wasio_fd_t fd, uint32_t
   return WASIO_OK;
 }
 
-static void* handle_connection(wasio_fd_t clientfd) {
-  char reqbuf[buffer_size];
+static void* serve_connection(wasio_fd_t clientfd, char *reqbuf) {
   const char *method;
   size_t method_len;
   const char *path;
@@ -176,7 +177,7 @@ static void* handle_connection(wasio_fd_t clientfd) {
     size_t prevbuflen = 0, buflen = 0;
     size_t num_headers = sizeof(headers) / sizeof(headers[0]);
     while (true) {
-      ans = w_recv(&wfd, clientfd, (uint8_t*)reqbuf+buflen, sizeof(reqbuf) - buflen); // TODO(dhil): recv may be partial
+      ans = w_recv(&wfd, clientfd, (uint8_t*)reqbuf+buflen, buffer_size - buflen); // TODO(dhil): recv may be partial
       //printf("[handle_connection(%d)] bytes recv'd: %d\n", clientfd, ans);
       /* printf("[handle_connection(%d)] request:\n%s\n", clientfd, reqbuf); */
       if (ans == 0) return NULL;
@@ -188,7 +189,7 @@ static void* handle_connection(wasio_fd_t clientfd) {
       prevbuflen = buflen;
       buflen += ans;
 
-      ans = phr_parse_request(reqbuf, sizeof(reqbuf) - buflen, &method, &method_len, &path, &path_len,
+      ans = phr_parse_request(reqbuf, buffer_size - buflen, &method, &method_len, &path, &path_len,
                               &minor_version, headers, &num_headers, prevbuflen);
       if (ans > 0) {
         debug_println("handle_connection", clientfd, "Http parse OK");
@@ -240,6 +241,15 @@ static void* handle_connection(wasio_fd_t clientfd) {
   return NULL;
 }
 
+static void* handle_connection(wasio_fd_t clientfd) {
+  // The request buffer is pooled rather than on the fiber's stack.
+  char *reqbuf = (char*)buf_pool_acquire(bufs, buffer_size);
+  if (reqbuf == NULL) return NULL;
+  void *ans = serve_connection(clientfd, reqbuf);
+  buf_pool_release(bufs, reqbuf);
+  return ans;
+}
+
 void* listener(wasio_fd_t sockfd) {
   wasio_fd_t mysock = sockfd;
   while (true) {
@@ -305,6 +315,7 @@ static bool handle_request(struct wasio_pollfd *wfd, struct fiber_queue *rearq,
 
 int main(void) {
   fiber_init();
+  assert(buf_pool_new(max_clients, &bufs) == BUF_POOL_OK);
   // Setup fiber queues.
   frontq = fq_new(MAX_CONNECTIONS);
   rearq = fq_new(MAX_CONNECTIONS);
@@ -346,9 +357,10 @@ int main(void) {
       if (!keep_going) break;
     }
     if (!keep_going) break;
-    // Poll I/O
+    // Poll I/O. Do not block if there are fibers waiting to run.
     uint32_t nevents;
-    assert(wasio_poll(&wfd, &ev, MAX_CONNECTIONS, &nevents, 100) == WASIO_OK);
+    int32_t timeout = rearq->length > 0 ? 0 : 100;
+    assert(wasio_poll(&wfd, &ev, MAX_CONNECTIONS, &nevents, timeout) == WASIO_OK);
     debug_println("main", servfd, "Poll OK");
     if (nevents > 0) {
       for (uint32_t i = 0; i < wfd.length; i++) {
@@ -390,6 +402,7 @@ int main(void) {
   free(frontq);
   free(rearq);
   wasio_finalize(&wfd);
+  buf_pool_delete(bufs);
   fiber_finalize();
 
   return 0;
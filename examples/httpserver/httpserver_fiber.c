@@ -1,4 +1,5 @@
 #include <fiber.h>
+#include <fiber_local.h>
 #include <host/errno.h>
 #include <host/poll.h>
 #include <host/socket.h>
@@ -18,6 +19,7 @@
 struct fiber_closure {
   fiber_t fiber;
   int32_t fd;
+  void *local; // fiber-local storage
 };
 
 static int32_t timeout = 3 * 10 * 1000; // 30 secs
@@ -26,44 +28,44 @@ static bool end_server = false;
 static struct fiber_closure fibers[MAX_CONNECTIONS];
 static struct pollfd fds[MAX_CONNECTIONS];
 
-// NOTE(dhil): The following variables ought to be local to
+// NOTE(dhil): The per-connection state ought to be local to
 // `handle_connection`, however, due to the bad interaction between
-// stack switching and the shadow stack it is currently necessary to
-// hoist them to the global scope.
+// stack switching and the shadow stack it cannot live on the fiber's
+// stack. Instead it is fiber-local storage, which is installed
+// whenever the fiber is resumed. Thus a partially received request
+// survives a yield, and nothing needs clearing between requests.
 #define BUFFER_SIZE 8192
 #define MAX_HEADERS 100
-static uint8_t reqbuf[BUFFER_SIZE], resbuf[BUFFER_SIZE];
-static const char *method;
-static size_t method_len;
-static const char *path;
-static size_t path_len;
-static int minor_version;
-static struct phr_header headers[MAX_HEADERS];
-
-static inline void reset_globals(void) {
-  method = NULL;
-  path = NULL;
-  path_len = 0;
-  minor_version = 0;
-  memset(headers, 0, sizeof(struct phr_header)*MAX_HEADERS);
-  memset(reqbuf, '\0', sizeof(uint8_t)*BUFFER_SIZE);
-  memset(resbuf, '\0', sizeof(uint8_t)*BUFFER_SIZE);
-}
+struct connection {
+  size_t buffered; // valid bytes in `reqbuf`
+  uint8_t reqbuf[BUFFER_SIZE], resbuf[BUFFER_SIZE];
+  const char *method;
+  size_t method_len;
+  const char *path;
+  size_t path_len;
+  int minor_version;
+  struct phr_header headers[MAX_HEADERS];
+};
 
 static void* handle_connection(int32_t fd) {
-  // Receive incoming data
+  struct connection *c = (struct connection*)fiber_local();
   while (true) {
+    // Receive until the request head is complete. The previous request
+    // may have left a pipelined one in the buffer.
     int32_t rc = 0;
+    size_t prevbuflen = 0, num_headers;
     while (true) {
-      // NOTE(dhil): Since the data is global shared we reset
-      // everything on entry.
-      reset_globals();
-      rc = host_recv(fd, (uint8_t*)reqbuf, BUFFER_SIZE, &host_errno);
+      num_headers = MAX_HEADERS;
+      rc = phr_parse_request((const char*)c->reqbuf, c->buffered, &c->method, &c->method_len, &c->path, &c->path_len,
+                             &c->minor_version, c->headers, &num_headers, prevbuflen);
+      if (rc != -2 || c->buffered == BUFFER_SIZE) break;
+      prevbuflen = c->buffered;
+      int32_t n = host_recv(fd, c->reqbuf + c->buffered, BUFFER_SIZE - c->buffered, &host_errno);
       // Was the connection closed by the client?
-      if (rc == 0) {
+      if (n == 0) {
         conn_log("  [handle_connection(%" PRIi32 ")] Connection closed\n", fd);
         return NULL;
-      } else if (rc < 0) {
+      } else if (n < 0) {
         if (host_errno != HOST_EAGAIN) {
           conn_log("  [handle_connection(%" PRIi32 ")] recv() failed\n", fd);
           return NULL;
@@ -72,44 +74,40 @@ static void* handle_connection(int32_t fd) {
         fd = (int32_t)(intptr_t)fiber_yield(NULL);
         conn_logv("  [handle_connection(%" PRIi32 ")] continued with %" PRIi32 "\n", fd, fd);
         if (fd == FIBER_KILL_SIGNAL) return NULL;
+        c = (struct connection*)fiber_local();
       } else {
-        break;
+        conn_logv("  [handle_connection(%" PRIi32 ")] received %" PRIi32 " bytes\n", fd, n);
+        c->buffered += (size_t)n;
       }
     }
 
-    // Otherwise we must have received data
-    conn_logv("  [handle_connection(%" PRIi32 ")] received %" PRIi32 " bytes\n", fd, rc);
-
-    // Parse http request
-    size_t prevbuflen = 0, buflen = 0;
-    size_t num_headers = sizeof(headers) / sizeof(headers[0]);
-    conn_log("  [handle_connection(%" PRIi32 ")] parsing request...", fd);
-    rc = phr_parse_request((const char*)reqbuf, sizeof(reqbuf) - buflen, &method, &method_len, &path, &path_len,
-                           &minor_version, headers, &num_headers, prevbuflen);
+    // Otherwise we must have received a request
+    conn_log("  [handle_connection(%" PRIi32 ")] parsed request...", fd);
+    int32_t reqlen = rc;
     if (num_headers <= 0) {
       conn_log(" no headers!");
       return NULL;
     }
 
     if (rc > 0) {
-      if (path_len == 1 && strncmp(path, "/", 1) == 0) {
+      if (c->path_len == 1 && strncmp(c->path, "/", 1) == 0) {
         conn_log(" request OK / \n");
-        rc = response_ok((uint8_t*)resbuf, BUFFER_SIZE, (uint8_t*)response_body, (uint32_t)strlen(response_body)); // OK
-      } else if (path_len == strlen("/quit") && strncmp(path, "/quit", strlen("/quit")) == 0) {
+        rc = response_ok(c->resbuf, BUFFER_SIZE, (uint8_t*)response_body, (uint32_t)strlen(response_body)); // OK
+      } else if (c->path_len == strlen("/quit") && strncmp(c->path, "/quit", strlen("/quit")) == 0) {
         conn_log(" request OK /quit\n");
-        rc = response_ok((uint8_t*)resbuf, BUFFER_SIZE, (uint8_t*)"OK bye...\n", (uint32_t)strlen("OK bye...\n")); // Quit
+        rc = response_ok(c->resbuf, BUFFER_SIZE, (uint8_t*)"OK bye...\n", (uint32_t)strlen("OK bye...\n")); // Quit
         end_server = true;
       } else {
         conn_log(" request Not Found\n");
-        rc = response_notfound((uint8_t*)resbuf, BUFFER_SIZE, NULL, 0); // Not found
+        rc = response_notfound(c->resbuf, BUFFER_SIZE, NULL, 0); // Not found
       }
     } else if (rc == -1) { // Parse failure
       conn_log(" request parse failure\n");
-      rc = response_badrequest((uint8_t*)resbuf, BUFFER_SIZE, NULL, 0); // Parse error
+      rc = response_badrequest(c->resbuf, BUFFER_SIZE, NULL, 0); // Parse error
     } else { // Partial parse
       conn_log(" partial request parse\n");
       wassert(rc == -2);
-      rc = response_toolarge((uint8_t*)resbuf, BUFFER_SIZE, NULL, 0);
+      rc = response_toolarge(c->resbuf, BUFFER_SIZE, NULL, 0);
     }
 
     if (rc == -1) {
@@ -118,11 +116,19 @@ static void* handle_connection(int32_t fd) {
     }
 
     // Send the response
-    rc = host_send(fd, (uint8_t*)resbuf, rc, &host_errno);
+    rc = host_send(fd, c->resbuf, rc, &host_errno);
     if (rc < 0) {
       conn_log("  [handle_connection(%" PRIi32 ")] send() failed\n", fd);
     }
     if (end_server) return NULL;
+
+    // Keep whatever followed the request; bodies are not supported.
+    if (reqlen > 0 && (size_t)reqlen < c->buffered) {
+      memmove(c->reqbuf, c->reqbuf + reqlen, c->buffered - (size_t)reqlen);
+      c->buffered -= (size_t)reqlen;
+    } else {
+      c->buffered = 0;
+    }
   }
 
   return NULL;
@@ -169,9 +175,15 @@ static void* listener(int32_t fd) {
       } else {
         // Add the new connection to the poll structure.
         conn_log("  [listener(%" PRIi32 ")] new incoming connection: %" PRIi32 "\n", fd, new_fd);
+        void *local = fiber_local_new(sizeof(struct connection));
+        if (local == NULL) {
+          conn_log("  [listener(%" PRIi32 ")] out of memory, dropping %" PRIi32 "\n", fd, new_fd);
+          host_close(new_fd, &host_errno);
+          continue;
+        }
         fds[nfds].fd = new_fd;
         fds[nfds].events = HOST_POLLIN;
-        fibers[nfds] = (struct fiber_closure){ .fiber = fiber_alloc((fiber_entry_point_t)(void*)handle_connection), .fd = new_fd };
+        fibers[nfds] = (struct fiber_closure){ .fiber = fiber_alloc((fiber_entry_point_t)(void*)handle_connection), .fd = new_fd, .local = local };
         nfds++;
       }
       conn_logv("  [listener(%" PRIi32 ")] connections: %" PRIu32 "\n", fd, nfds);
@@ -185,6 +197,7 @@ static bool handle_command(uint32_t i, struct fiber_closure clo, void *payload _
   case FIBER_OK:
     conn_logv("[handle_command] fiber(%" PRIi32 ") finished\n", clo.fd);
     fiber_free(clo.fiber);
+    fiber_local_delete(clo.local);
     host_close(clo.fd, &host_errno);
     fds[i].fd = -1;
     nfds--;
@@ -197,6 +210,7 @@ static bool handle_command(uint32_t i, struct fiber_closure clo, void *payload _
   default:
     conn_logv("[handle_command] fiber(%" PRIi32 ") error\n", clo.fd);
     fiber_free(clo.fiber);
+    fiber_local_delete(clo.local);
     host_close(clo.fd, &host_errno);
     fds[i].fd = -1;
     nfds--;
@@ -227,7 +241,7 @@ int main(void) {
 
   // Allocate fiber for listener
   fiber_t listener_fiber = fiber_alloc((fiber_entry_point_t)(void*)listener);
-  fibers[0] = (struct fiber_closure){ .fiber = listener_fiber, .fd = listen_fd };
+  fibers[0] = (struct fiber_closure){ .fiber = listener_fiber, .fd = listen_fd, .local = NULL };
 
   printf("[main] ready...\n");
 
@@ -253,6 +267,7 @@ int main(void) {
       if (fds[i].revents & HOST_POLLHUP) {
         conn_log("  [main] connection %" PRIi32 " hung up\n", fds[i].fd);
         fiber_free(fibers[i].fiber);
+        fiber_local_delete(fibers[i].local);
         fibers[i].fd = -1;
         fds[i].fd = -1;
         compress_pollfd = true;
@@ -269,6 +284,7 @@ int main(void) {
       // Resume fiber.
       conn_log("[main] descriptor %" PRIi32 " is readable.. resuming fiber\n", fds[i].fd);
       fiber_result_t status = FIBER_ERROR;
+      fiber_local_install(fibers[i].local);
       void *ans = fiber_resume(fibers[i].fiber, (void*)(intptr_t)fibers[i].fd, &status);
       compress_pollfd = handle_command(i, fibers[i], ans, status) || compress_pollfd;
       if (compress_pollfd) fds[i].fd = -1;
@@ -296,8 +312,10 @@ int main(void) {
 
     fiber_result_t status = FIBER_ERROR;
     conn_logv("[main] killing %" PRIu32 " -> %" PRIi32 "\n", i, fibers[i].fd);
+    fiber_local_install(fibers[i].local);
     (void)fiber_resume(fibers[i].fiber, (void*)(intptr_t)FIBER_KILL_SIGNAL, &status);
     wassert(status == FIBER_OK);
+    fiber_local_delete(fibers[i].local);
     host_close(fds[i].fd, &host_errno);
     nfds--;
   }
@@ -0,0 +1,81 @@
+// An HTTP server for the driver's isolation mode: the host accepts
+// connections and hands each one to a fresh instance of this module,
+// which serves the connection to completion and is then discarded.
+// The connection is owned by the host, which closes it once
+// `handle_connection` returns.
+
+#include <assert.h>
+#include <host/errno.h>
+#include <host/socket.h>
+#include <http_utils.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <wasm_utils.h>
+
+#include <picohttpparser.h>
+
+#define BUFFER_SIZE 4096
+#define MAX_HEADERS 100
+
+// Serves requests on `fd` until the client hangs up. Returns nonzero
+// if the server ought to shut down.
+__wasm_export__("handle_connection")
+int32_t handle_connection(int32_t fd) {
+  uint8_t reqbuf[BUFFER_SIZE], resbuf[BUFFER_SIZE];
+  const char *method;
+  size_t method_len;
+  const char *path;
+  size_t path_len;
+  int minor_version;
+  struct phr_header headers[MAX_HEADERS];
+  bool end_server = false;
+
+  while (!end_server) {
+    // Receive incoming data
+    int32_t rc = host_recv(fd, reqbuf, sizeof(reqbuf), &host_errno);
+    if (rc <= 0) {
+      conn_log("  [handle_connection(%d)] connection closed\n", fd);
+      break;
+    }
+    conn_logv("  [handle_connection(%d)] received %d bytes\n", fd, rc);
+
+    // Parse http request
+    size_t num_headers = sizeof(headers) / sizeof(headers[0]);
+    rc = phr_parse_request((const char*)reqbuf, (size_t)rc, &method, &method_len, &path, &path_len,
+                           &minor_version, headers, &num_headers, 0);
+
+    if (rc > 0) {
+      if (path_len == 1 && strncmp(path, "/", 1) == 0) {
+        rc = response_ok(resbuf, BUFFER_SIZE, (uint8_t*)response_body, (uint32_t)strlen(response_body)); // OK
+      } else if (path_len == strlen("/quit") && strncmp(path, "/quit", strlen("/quit")) == 0) {
+        rc = response_ok(resbuf, BUFFER_SIZE, (uint8_t*)"OK bye...\n", (uint32_t)strlen("OK bye...\n")); // Quit
+        end_server = true;
+      } else {
+        rc = response_notfound(resbuf, BUFFER_SIZE, NULL, 0); // Not found
+      }
+    } else if (rc == -1) { // Parse failure
+      rc = response_badrequest(resbuf, BUFFER_SIZE, NULL, 0); // Parse error
+    } else { // Partial parse
+      assert(rc == -2);
+      rc = response_toolarge(resbuf, BUFFER_SIZE, NULL, 0);
+    }
+
+    if (rc == -1) {
+      conn_log("  [handle_connection(%d)] response generation failed\n", fd);
+      break;
+    }
+
+    // Send the response
+    if (host_send(fd, resbuf, (uint32_t)rc, &host_errno) < 0) {
+      conn_log("  [handle_connection(%d)] send() failed\n", fd);
+      break;
+    }
+  }
+
+  return end_server ? 1 : 0;
+}
+
+#undef BUFFER_SIZE
+#undef MAX_HEADERS
@@ -1,4 +1,5 @@
 #include <fiber.h>
+#include <fiber_local.h>
 #include <host/errno.h>
 #include <http_utils.h>
 #include <inttypes.h>
@@ -17,52 +18,59 @@
 struct fiber_closure {
   fiber_t fiber;
   int32_t fd;
+  void *local; // fiber-local storage
 };
 
 static int32_t timeout = 3 * 10 * 1000; // 30 secs
 static bool end_server = false;
+// Indexed by vfd; an unused entry has `fd == -1`.
 static struct fiber_closure fibers[MAX_CONNECTIONS];
 static struct wasio_pollfd wfd;
-WASIO_STATIC_INITIALIZER(wfd, MAX_CONNECTIONS);
+static struct wasio_event *events = NULL;
+static wasio_fd_t listen_fd = -1;
 
-// NOTE(dhil): The following variables ought to be local to
+// NOTE(dhil): The per-connection state ought to be local to
 // `handle_connection`, however, due to the bad interaction between
-// stack switching and the shadow stack it is currently necessary to
-// hoist them to the global scope.
+// stack switching and the shadow stack it cannot live on the fiber's
+// stack. Instead it is fiber-local storage, which is installed
+// whenever the fiber is resumed. Thus a partially received request
+// survives a yield, and nothing needs clearing between requests.
 #define BUFFER_SIZE 8192
 #define MAX_HEADERS 100
-static uint8_t reqbuf[BUFFER_SIZE], resbuf[BUFFER_SIZE];
-static const char *method;
-static size_t method_len;
-static const char *path;
-static size_t path_len;
-static int minor_version;
-static struct phr_header headers[MAX_HEADERS];
-
-static inline void reset_globals(void) {
-  method = NULL;
-  path = NULL;
-  path_len = 0;
-  minor_version = 0;
-  memset(headers, 0, sizeof(struct phr_header)*MAX_HEADERS);
-  memset(reqbuf, '\0', sizeof(uint8_t)*BUFFER_SIZE);
-  memset(resbuf, '\0', sizeof(uint8_t)*BUFFER_SIZE);
-}
+struct connection {
+  size_t buffered; // valid bytes in `reqbuf`
+  uint8_t reqbuf[BUFFER_SIZE], resbuf[BUFFER_SIZE];
+  const char *method;
+  size_t method_len;
+  const char *path;
+  size_t path_len;
+  int minor_version;
+  struct phr_header headers[MAX_HEADERS];
+  const uint8_t *resbody;
+  uint32_t resbody_len;
+  struct wasio_iovec resiov[2];
+};
 
 static uint32_t nbytes = 0;
 static int32_t fd = -1;
 
 static void* handle_connection(int32_t _fd __attribute__((unused))) {
-  wassert(fd > 4);
+  wassert(fd != listen_fd);
   conn_logv("  [handle_connection(%" PRIi32 ") entered\n", fd);
-  // Receive incoming data
+  struct connection *c = (struct connection*)fiber_local();
   while (true) {
-    nbytes = 0;
-    while (nbytes == 0) {
-      // NOTE(dhil): Since the data is global shared we reset
-      // everything on entry.
-      reset_globals();
-      wasio_result_t ans = wasio_recv(&wfd, fd, (uint8_t*)reqbuf, BUFFER_SIZE, &nbytes);
+    // Receive until the request head is complete. The previous request
+    // may have left a pipelined one in the buffer.
+    int32_t rc = 0;
+    size_t prevbuflen = 0, num_headers;
+    while (true) {
+      num_headers = MAX_HEADERS;
+      rc = phr_parse_request((const char*)c->reqbuf, c->buffered, &c->method, &c->method_len, &c->path, &c->path_len,
+                             &c->minor_version, c->headers, &num_headers, prevbuflen);
+      if (rc != -2 || c->buffered == BUFFER_SIZE) break;
+      prevbuflen = c->buffered;
+      nbytes = 0;
+      wasio_result_t ans = wasio_recv(&wfd, fd, c->reqbuf + c->buffered, (uint32_t)(BUFFER_SIZE - c->buffered), &nbytes);
       switch (ans) {
       case WASIO_ECONN:
         // Was the connection closed by the client?
@@ -70,14 +78,16 @@ static void* handle_connection(int32_t _fd __attribute__((unused))) {
         return NULL;
       case WASIO_OK:
         assert(nbytes > 0);
+        conn_logv("  [handle_connection(%" PRIi32 ")] received %" PRIu32 " bytes\n", fd, nbytes);
+        c->buffered += nbytes;
         break;
       case WASIO_EAGAIN:
         conn_logv("  [handle_connection(%" PRIi32 ")] yielding\n", fd);
         _fd = (int32_t)(intptr_t)fiber_yield(NULL);
         conn_logv("  [handle_connection(%" PRIi32 ")] continued with %" PRIi32 "\n", fd, fd);
         if (fd == FIBER_KILL_SIGNAL) return NULL;
-        wassert(fd > 4);
-        nbytes = 0;
+        wassert(fd != listen_fd);
+        c = (struct connection*)fiber_local();
         break;
       default:
         conn_log("  [handle_connection(%" PRIi32 ")] recv() failed\n", fd);
@@ -85,39 +95,41 @@ static void* handle_connection(int32_t _fd __attribute__((unused))) {
       }
     }
 
-    // Otherwise we must have received data
-    conn_logv("  [handle_connection(%" PRIi32 ")] received %" PRIi32 " bytes\n", fd, nbytes);
-
-    // Parse http request
-    size_t prevbuflen = 0, buflen = 0;
-    size_t num_headers = sizeof(headers) / sizeof(headers[0]);
-    conn_log("  [handle_connection(%" PRIi32 ")] parsing request...", fd);
-    int32_t rc = phr_parse_request((const char*)reqbuf, sizeof(reqbuf) - buflen, &method, &method_len, &path, &path_len,
-                                   &minor_version, headers, &num_headers, prevbuflen);
+    // Otherwise we must have received a request
+    conn_log("  [handle_connection(%" PRIi32 ")] parsed request...", fd);
+    int32_t reqlen = rc;
     if (num_headers <= 0) {
       conn_log(" no headers!");
       return NULL;
     }
 
+    // Only the headers are rendered into `resbuf`; the body is sent
+    // straight from where it lives.
+    c->resbody = NULL;
+    c->resbody_len = 0;
     if (rc > 0) {
-      if (path_len == 1 && strncmp(path, "/", 1) == 0) {
+      if (c->path_len == 1 && strncmp(c->path, "/", 1) == 0) {
         conn_log(" request OK / \n");
-        rc = response_ok((uint8_t*)resbuf, BUFFER_SIZE, (uint8_t*)response_body, (uint32_t)strlen(response_body)); // OK
-      } else if (path_len == strlen("/quit") && strncmp(path, "/quit", strlen("/quit")) == 0) {
+        c->resbody = (const uint8_t*)response_body;
+        c->resbody_len = (uint32_t)strlen(response_body);
+        rc = make_response_header(c->resbuf, BUFFER_SIZE, "200 OK", c->resbody_len); // OK
+      } else if (c->path_len == strlen("/quit") && strncmp(c->path, "/quit", strlen("/quit")) == 0) {
         conn_log(" request OK /quit\n");
-        rc = response_ok((uint8_t*)resbuf, BUFFER_SIZE, (uint8_t*)"OK bye...\n", (uint32_t)strlen("OK bye...\n")); // Quit
+        c->resbody = (const uint8_t*)"OK bye...\n";
+        c->resbody_len = (uint32_t)strlen("OK bye...\n");
+        rc = make_response_header(c->resbuf, BUFFER_SIZE, "200 OK", c->resbody_len); // Quit
         end_server = true;
       } else {
         conn_log(" request Not Found\n");
-        rc = response_notfound((uint8_t*)resbuf, BUFFER_SIZE, NULL, 0); // Not found
+        rc = make_response_header(c->resbuf, BUFFER_SIZE, "404 Not Found", 0); // Not found
       }
     } else if (rc == -1) { // Parse failure
       conn_log(" request parse failure\n");
-      rc = response_badrequest((uint8_t*)resbuf, BUFFER_SIZE, NULL, 0); // Parse error
+      rc = make_response_header(c->resbuf, BUFFER_SIZE, "400 Bad Request", 0); // Parse error
     } else { // Partial parse
       conn_log(" partial request parse\n");
       wassert(rc == -2);
-      rc = response_toolarge((uint8_t*)resbuf, BUFFER_SIZE, NULL, 0);
+      rc = make_response_header(c->resbuf, BUFFER_SIZE, "413 Content Too Large", 0);
     }
 
     if (rc == -1) {
@@ -125,12 +137,22 @@ static void* handle_connection(int32_t _fd __attribute__((unused))) {
       return NULL;
     }
 
-    // Send the response
+    // Send the headers and body in one go.
     conn_log("  [handle_connection(%" PRIi32 ")] sending response\n", fd);
-    if (wasio_send(&wfd, fd, (uint8_t*)resbuf, rc, &nbytes) != WASIO_OK) {
+    c->resiov[0] = (struct wasio_iovec){ .buf = c->resbuf, .len = (uint32_t)rc };
+    c->resiov[1] = (struct wasio_iovec){ .buf = (uint8_t*)c->resbody, .len = c->resbody_len };
+    if (wasio_sendv(&wfd, fd, c->resiov, c->resbody_len > 0 ? 2 : 1, &nbytes) != WASIO_OK) {
       conn_log("  [handle_connection(%" PRIi32 ")] send() failed\n", fd);
     }
     if (end_server) return NULL;
+
+    // Keep whatever followed the request; bodies are not supported.
+    if (reqlen > 0 && (size_t)reqlen < c->buffered) {
+      memmove(c->reqbuf, c->reqbuf + reqlen, c->buffered - (size_t)reqlen);
+      c->buffered -= (size_t)reqlen;
+    } else {
+      c->buffered = 0;
+    }
   }
 
   return NULL;
@@ -147,7 +169,7 @@ static void* handle_connection(int32_t _fd __attribute__((unused))) {
 // pointer when stack switching.
 static int32_t new_fd = -1;
 static void* listener(int32_t _fd __attribute__((unused))) {
-  wassert(fd == 4);
+  wassert(fd == listen_fd);
   new_fd = -1;
   while (fd != FIBER_KILL_SIGNAL) {
     while (wfd.length == wfd.capacity) {
@@ -157,7 +179,7 @@ static void* listener(int32_t _fd __attribute__((unused))) {
         conn_logv("  [listener(%" PRIi32 ")] exiting\n", fd);
         return NULL;
       }
-      wassert(fd == 4);
+      wassert(fd == listen_fd);
     }
 
     // Accept all incoming requests
@@ -174,7 +196,7 @@ static void* listener(int32_t _fd __attribute__((unused))) {
           conn_logv("  [listener(%" PRIi32 ")] exiting\n", fd);
           return NULL;
         }
-        wassert(fd == 4);
+        wassert(fd == listen_fd);
         break;
       case WASIO_ERROR:
         conn_log("  [listener(%" PRIi32 ")] accept() failed: %s\n", fd, host_strerror(host_errno));
@@ -184,8 +206,15 @@ static void* listener(int32_t _fd __attribute__((unused))) {
       case WASIO_OK:
         // Add the new connection to the poll structure.
         conn_log("  [listener(%" PRIi32 ")] new incoming connection: %" PRIi32 "\n", fd, new_fd);
-        fibers[wfd.length-1] = (struct fiber_closure){ .fiber = fiber_alloc((fiber_entry_point_t)(void*)handle_connection), .fd = new_fd };
-        assert(new_fd > 4);
+        wassert(new_fd >= 0 && new_fd < MAX_CONNECTIONS);
+        void *local = fiber_local_new(sizeof(struct connection));
+        if (local == NULL) {
+          conn_log("  [listener(%" PRIi32 ")] out of memory, dropping %" PRIi32 "\n", fd, new_fd);
+          (void)wasio_close(&wfd, new_fd);
+          break;
+        }
+        fibers[new_fd] = (struct fiber_closure){ .fiber = fiber_alloc((fiber_entry_point_t)(void*)handle_connection), .fd = new_fd, .local = local };
+        (void)wasio_notify_recv(&wfd, new_fd);
         break;
       default:
         conn_log("  [listener(%" PRIi32 ") unexpected wasio result\n", fd);
@@ -197,141 +226,127 @@ static void* listener(int32_t _fd __attribute__((unused))) {
   return NULL;
 }
 
-static bool handle_command(uint32_t i, struct fiber_closure clo, void *payload __attribute__((unused)), fiber_result_t status) {
+// Drops the fiber serving `vfd`, and closes the vfd.
+static void retire(wasio_fd_t vfd) {
+  fiber_free(fibers[vfd].fiber);
+  fiber_local_delete(fibers[vfd].local);
+  fibers[vfd] = (struct fiber_closure){ .fiber = NULL, .fd = -1, .local = NULL };
+  wasio_result_t ans = wasio_close(&wfd, vfd);
+  wassert(ans == WASIO_OK);
+  (void)ans;
+}
+
+static void handle_command(wasio_fd_t vfd, void *payload __attribute__((unused)), fiber_result_t status) {
   switch (status) {
   case FIBER_OK:
-    conn_logv("[handle_command] fiber(%" PRIi32 ") finished\n", clo.fd);
-    fiber_free(clo.fiber);
-    assert(wasio_close(&wfd, clo.fd) == WASIO_OK);
-    wfd.fds[i].fd = -1;
-    wfd.length--;
-    return true;
+    conn_logv("[handle_command] fiber(%" PRIi32 ") finished\n", vfd);
+    retire(vfd);
+    break;
   case FIBER_YIELD:
-    conn_logv("[handle_command] fiber(%" PRIi32 ") yielded\n", clo.fd);
-    wfd.fds[i].events = WASIO_POLLIN;
-    return false;
+    // Interest is one-shot, hence it is renewed on every yield.
+    conn_logv("[handle_command] fiber(%" PRIi32 ") yielded\n", vfd);
+    (void)wasio_notify_recv(&wfd, vfd);
+    break;
   case FIBER_ERROR:
   default:
-    conn_logv("[handle_command] fiber(%" PRIi32 ") error\n", clo.fd);
-    fiber_free(clo.fiber);
-    assert(wasio_close(&wfd, clo.fd) == WASIO_OK);
-    wfd.fds[i].fd = -1;
-    wfd.length--;
+    conn_logv("[handle_command] fiber(%" PRIi32 ") error\n", vfd);
+    retire(vfd);
     end_server = true;
-    return true;
+    break;
   }
 }
 
-static uint32_t pollfd_size = 0;
-static bool compress_pollfd = false;
 int main(void) {
   fiber_init();
-  //assert(wasio_init(&wfd, MAX_CONNECTIONS) == WASIO_OK);
-
-  // Initialise poll structure
-  for (uint32_t i = 0; i < wfd.capacity; i++) {
-    wfd.fds[i] = (struct pollfd){ .fd = -1, .events = 0, .revents = 0 };
+  if (wasio_init(&wfd, MAX_CONNECTIONS) != WASIO_OK) {
+    conn_log("wasio_init() failed\n");
+    exit(-1);
   }
+  events = WASIO_EVENT_INITIALISER(MAX_CONNECTIONS);
+  wassert(events != NULL);
+  for (uint32_t i = 0; i < MAX_CONNECTIONS; i++)
+    fibers[i] = (struct fiber_closure){ .fiber = NULL, .fd = -1, .local = NULL };
 
   // Set up listener
   wassert(wfd.length == 0);
-  const int32_t backlog = MAX_CONNECTIONS * 2;
-  wasio_fd_t listen_fd = -1;
-  wasio_result_t ans = wasio_listen(&wfd, &listen_fd, 8080, backlog);
+  // Responses are small, so disable Nagle's algorithm; and only wake
+  // up for connections which have sent their request.
+  const struct wasio_listen_opts opts = {
+    .backlog = MAX_CONNECTIONS * 2,
+    .defer_accept = 1,
+    .nodelay = 1
+  };
+  wasio_result_t ans = wasio_listen_ex(&wfd, &listen_fd, 8080, &opts);
   if (ans != WASIO_OK) {
     conn_log("socket() failed\n");
     exit(-1);
   }
   wassert(wfd.length == 1);
-  conn_logv("[main] listener is bound to socket %" PRIi32 "\n", listen_fd);
+  conn_logv("[main] listener is bound to vfd %" PRIi32 "\n", listen_fd);
+  (void)wasio_notify_recv(&wfd, listen_fd);
 
   // Allocate fiber for listener
   fiber_t listener_fiber = fiber_alloc((fiber_entry_point_t)(void*)listener);
-  fibers[0] = (struct fiber_closure){ .fiber = listener_fiber, .fd = listen_fd };
+  fibers[listen_fd] = (struct fiber_closure){ .fiber = listener_fiber, .fd = listen_fd, .local = NULL };
 
   printf("[main] ready...\n");
 
   // Request loop
   while (!end_server) {
-    compress_pollfd = false;
     conn_log("[main] waiting on poll()...\n");
     uint32_t nready = 0;
-    ans = wasio_poll(&wfd, &nready, timeout);
-    switch (ans) {
-    case WASIO_OK: {
-      if (nready == 0) {
-        conn_log("[main] poll timed out... shutting down\n");
-        end_server = true;
-        break;
-      }
-      pollfd_size = wfd.length;
-      conn_logv("[main] pollfd_size = %" PRIu32 "\n", pollfd_size);
-      for (uint32_t i = 0; i < pollfd_size; i++) {
-        if (wfd.fds[i].revents == 0) continue;
+    ans = wasio_poll(&wfd, events, MAX_CONNECTIONS, &nready, timeout);
+    if (ans != WASIO_OK) {
+      conn_log("  [main] poll() failed\n");
+      continue;
+    }
+    if (nready == 0) {
+      conn_log("[main] poll timed out... shutting down\n");
+      end_server = true;
+      break;
+    }
+    WASIO_EVENT_FOREACH(&wfd, events, nready, vfd, revents, {
+        if (fibers[vfd].fd == -1) continue;
 
-        if (wfd.fds[i].revents & WASIO_POLLHUP) {
-          conn_log("  [main] connection %" PRIi32 " hung up\n", wfd.fds[i].fd);
-          fiber_free(fibers[i].fiber);
-          fibers[i].fd = -1;
-          wfd.fds[i].fd = -1;
-          wfd.length--;
-          compress_pollfd = true;
+        if ((revents & WASIO_POLLHUP) != 0 && vfd != listen_fd) {
+          conn_log("  [main] connection %" PRIi32 " hung up\n", vfd);
+          retire(vfd);
           continue;
         }
 
-        if ((wfd.fds[i].revents & WASIO_POLLIN) == 0) {
-          conn_log("  [main] error! revents = %d\n", wfd.fds[i].revents);
+        if ((revents & WASIO_POLLIN) == 0) {
+          conn_log("  [main] error! revents = %" PRIu32 "\n", revents);
           end_server = true;
           break;
         }
 
         // Resume fiber.
-        conn_log("[main] descriptor %" PRIi32 " is readable.. resuming fiber %" PRIu32 "\n", wfd.fds[i].fd, i);
+        conn_log("[main] vfd %" PRIi32 " is readable.. resuming its fiber\n", vfd);
         fiber_result_t status = FIBER_ERROR;
-        fd = wfd.fds[i].fd;
-        assert(fd >= 4);
-        void *ans = fiber_resume(fibers[i].fiber, (void*)(intptr_t)wfd.fds[i].fd, &status);
-        compress_pollfd = handle_command(i, fibers[i], ans, status) || compress_pollfd;
-        if (compress_pollfd) wfd.fds[i].fd = -1;
-      }
-
-      if (compress_pollfd) {
-        for (uint32_t i = 0; i < wfd.length; i++) {
-          if (wfd.fds[i].fd == -1) {
-            for (uint32_t j = i; j < wfd.length-1; j++) {
-              wfd.fds[j].fd = wfd.fds[j+1].fd;
-              fibers[j] = fibers[j+1];
-            }
-            i--;
-            wfd.length--;
-          }
-        }
-      }
-      break;
-    }
-    default:
-      conn_log("  [main] poll() failed\n");
-      break;
-    }
+        fd = vfd;
+        fiber_local_install(fibers[vfd].local);
+        void *res = fiber_resume(fibers[vfd].fiber, (void*)(intptr_t)vfd, &status);
+        handle_command(vfd, res, status);
+      });
   }
 
   // Clean up
   conn_logv("[main] wfd.length = %u\n", wfd.length);
   wassert(0 < wfd.length && wfd.length <= MAX_CONNECTIONS);
-  for (uint32_t i = 0; i < wfd.length; i++) {
-    if (wfd.fds[i].fd == -1) continue;
+  for (wasio_fd_t i = 0; i < MAX_CONNECTIONS; i++) {
+    if (fibers[i].fd == -1) continue;
 
     fiber_result_t status = FIBER_ERROR;
-    conn_logv("[main] killing %" PRIu32 " -> %" PRIi32 "\n", i, fibers[i].fd);
+    conn_logv("[main] killing %" PRIi32 "\n", i);
     fd = FIBER_KILL_SIGNAL;
+    fiber_local_install(fibers[i].local);
     (void)fiber_resume(fibers[i].fiber, (void*)(intptr_t)FIBER_KILL_SIGNAL, &status);
     wassert(status == FIBER_OK);
-    wasio_result_t ans = wasio_close(&wfd, wfd.fds[i].fd);
-    wassert(ans == WASIO_OK);
-    (void)ans;
-    wfd.length--;
+    retire(i);
   }
   wassert(wfd.length == 0);
+  free(events);
+  wasio_finalize(&wfd);
   fiber_finalize();
 
   return 0;
@@ -0,0 +1,128 @@
+/*
+Driver for the reverse proxy example. It runs a single instance of
+the proxy module, which listens on port 8080 and forwards to the
+upstream named by PROXY_UPSTREAM (see proxy.c).
+
+   PROXY_UPSTREAM=127.0.0.1:8081 ./proxy_driver proxy_asyncify.wasm
+*/
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wasi.h>
+#include <wasm.h>
+#include <wasmtime.h>
+#include <host/driver/epoll.h>
+#include <host/driver/module_cache.h>
+#include <host/driver/poll.h>
+#include <host/driver/ring.h>
+#include <host/driver/socket.h>
+#include <host/wasmtime_utils.h>
+
+static void exit_with_error(const char *message, wasmtime_error_t *error,
+                            wasm_trap_t *trap);
+
+int main(int argc, const char **argv) {
+
+  if (argc < 2) {
+    printf("usage: %s <file.wasm>\n", argv[0]);
+    exit(1);
+  }
+
+  // Set up our context
+  wasm_engine_t *engine = wasm_engine_new_with_config(host_engine_config_new());
+  assert(engine != NULL);
+  host_context_t hctx;
+  host_context_init(&hctx);
+  wasmtime_store_t *store = wasmtime_store_new(engine, &hctx, NULL);
+  assert(store != NULL);
+  wasmtime_context_t *context = wasmtime_store_context(store);
+
+  // Create a linker with WASI functions defined
+  wasmtime_linker_t *linker = wasmtime_linker_new(engine);
+  wasmtime_error_t *error = wasmtime_linker_define_wasi(linker);
+  if (error != NULL)
+    exit_with_error("failed to link wasi", error, NULL);
+
+  // Load our module, preferably from its precompiled artifact.
+  wasmtime_module_t *module = NULL;
+  error = host_module_load(engine, argv[1], true, &module);
+  if (error != NULL)
+    exit_with_error("failed to compile module", error, NULL);
+
+  // Instantiate wasi. The environment carries the upstream address.
+  wasi_config_t *wasi_config = wasi_config_new();
+  assert(wasi_config);
+  wasi_config_inherit_argv(wasi_config);
+  wasi_config_inherit_env(wasi_config);
+  wasi_config_inherit_stdin(wasi_config);
+  wasi_config_inherit_stdout(wasi_config);
+  wasi_config_inherit_stderr(wasi_config);
+
+  wasm_trap_t *trap = NULL;
+  error = wasmtime_context_set_wasi(context, wasi_config);
+  if (error != NULL)
+    exit_with_error("failed to instantiate WASI", error, NULL);
+
+  // Link host functions
+  error = host_socket_init(linker, "host_socket");
+  if (error != NULL)
+    exit_with_error("failed to export host function", error, NULL);
+
+  error = host_poll_init(linker, "host_poll");
+  if (error != NULL)
+    exit_with_error("failed to export host function", error, NULL);
+
+  error = host_epoll_init(linker, "host_epoll");
+  if (error != NULL)
+    exit_with_error("failed to export host function", error, NULL);
+
+  // Only used by builds with -DWAEIO_COMPLETION_RING=1.
+  error = host_ring_init(linker, "host_ring");
+  if (error != NULL)
+    exit_with_error("failed to export host function", error, NULL);
+
+  // Instantiate the module
+  error = wasmtime_linker_module(linker, context, "", 0, module);
+  if (error != NULL)
+    exit_with_error("failed to instantiate module", error, NULL);
+
+  // Run it.
+  wasmtime_func_t func;
+  error = wasmtime_linker_get_default(linker, context, "", 0, &func);
+  if (error != NULL)
+    exit_with_error("failed to locate default export for module", error, NULL);
+
+  error = wasmtime_func_call(context, &func, NULL, 0, NULL, 0, &trap);
+  if (error != NULL || trap != NULL)
+    exit_with_error("error calling default export", error, trap);
+
+  // Clean up after ourselves at this point
+  host_ring_release();
+  host_socket_delete();
+  host_poll_delete();
+  host_epoll_delete();
+  host_ring_delete();
+  wasmtime_linker_delete(linker);
+  wasmtime_module_delete(module);
+  wasmtime_store_delete(store);
+  wasm_engine_delete(engine);
+  return 0;
+}
+
+static void exit_with_error(const char *message, wasmtime_error_t *error,
+                            wasm_trap_t *trap) {
+  fprintf(stderr, "error: %s\n", message);
+  wasm_byte_vec_t error_message;
+  if (error != NULL) {
+    wasmtime_error_message(error, &error_message);
+    wasmtime_error_delete(error);
+  } else {
+    wasm_trap_message(trap, &error_message);
+    wasm_trap_delete(trap);
+  }
+  fprintf(stderr, "%.*s\n", (int)error_message.size, error_message.data);
+  wasm_byte_vec_delete(&error_message);
+  exit(1);
+}
@@ -0,0 +1,352 @@
+// A reverse proxy on top of waeio. Every client connection is served
+// by its own fiber, which forwards HTTP/1.1 requests to a single
+// upstream and relays the responses back. Upstream connections are
+// kept alive and reused across requests and clients.
+//
+// The upstream is read from the environment variable PROXY_UPSTREAM
+// as <ipv4 address>:<port>, and defaults to 127.0.0.1:8081.
+#include <http_utils.h>
+#include <inttypes.h>
+#include <picohttpparser.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <waeio.h>
+#include <wasio.h>
+
+#define BUFFER_SIZE 8192
+#define MAX_HEADERS 100
+#define IDLE_TIMEOUT_MS (30 * 1000)
+
+static char upstream_addr[16] = "127.0.0.1";
+static int32_t upstream_port = 8081;
+
+// NOTE(dhil): The per-connection state lives on the heap rather than
+// the fiber stack, as large stack frames interact badly with stack
+// switching and the shadow stack (cf. the httpserver examples).
+struct session {
+  wasio_fd_t client;
+  wasio_fd_t upstream;
+  // Whether `upstream` came out of the pool.
+  bool reused;
+  uint8_t reqbuf[BUFFER_SIZE];
+  uint8_t resbuf[BUFFER_SIZE];
+  struct phr_header headers[MAX_HEADERS];
+};
+
+// A parsed request or response head.
+struct message {
+  int headlen;
+  // Length of the body, if it is delimited by Content-Length.
+  bool has_length;
+  uint64_t length;
+  bool chunked;
+  bool close;
+  // Whether the request may safely be sent twice (RFC 9110, 9.2.2).
+  bool idempotent;
+};
+
+static bool header_is(const struct phr_header *h, const char *name) {
+  size_t len = strlen(name);
+  return h->name_len == len && strncasecmp(h->name, name, len) == 0;
+}
+
+static bool value_contains(const struct phr_header *h, const char *token) {
+  size_t len = strlen(token);
+  for (size_t i = 0; i + len <= h->value_len; i++) {
+    if (strncasecmp(h->value + i, token, len) == 0) return true;
+  }
+  return false;
+}
+
+// Extracts the framing of a message from its headers.
+static bool scan_headers(const struct phr_header *headers, size_t num_headers, int minor_version, struct message *msg) {
+  msg->has_length = false;
+  msg->length = 0;
+  msg->chunked = false;
+  // HTTP/1.0 closes by default.
+  msg->close = minor_version == 0;
+  for (size_t i = 0; i < num_headers; i++) {
+    const struct phr_header *h = &headers[i];
+    if (header_is(h, "Content-Length")) {
+      uint64_t n = 0;
+      for (size_t j = 0; j < h->value_len; j++) {
+        char c = h->value[j];
+        if (c < '0' || c > '9' || n > UINT32_MAX) return false;
+        n = n * 10 + (uint64_t)(c - '0');
+      }
+      msg->has_length = true;
+      msg->length = n;
+    } else if (header_is(h, "Transfer-Encoding")) {
+      msg->chunked = true;
+    } else if (header_is(h, "Connection")) {
+      if (value_contains(h, "close")) msg->close = true;
+      else if (value_contains(h, "keep-alive")) msg->close = false;
+    }
+  }
+  return true;
+}
+
+static int send_all(wasio_fd_t vfd, uint8_t *buf, size_t len) {
+  while (len > 0) {
+    int n = waeio_send(vfd, buf, (uint32_t)len);
+    if (n <= 0) return -1;
+    buf += n;
+    len -= (size_t)n;
+  }
+  return 0;
+}
+
+// Moves `len` bytes from `in` to `out` through `buf`.
+static int relay(wasio_fd_t in, wasio_fd_t out, uint8_t *buf, uint64_t len) {
+  while (len > 0) {
+    uint32_t want = len < BUFFER_SIZE ? (uint32_t)len : BUFFER_SIZE;
+    int n = waeio_recv(in, buf, want);
+    if (n <= 0) return -1;
+    if (send_all(out, buf, (size_t)n) != 0) return -1;
+    len -= (uint64_t)n;
+  }
+  return 0;
+}
+
+static bool method_is(const char *method, size_t method_len, const char *name) {
+  return method_len == strlen(name) && strncmp(method, name, method_len) == 0;
+}
+
+static bool is_idempotent(const char *method, size_t method_len) {
+  static const char *const idempotent[] = { "GET", "HEAD", "OPTIONS", "TRACE", "PUT", "DELETE" };
+  for (size_t i = 0; i < sizeof(idempotent) / sizeof(idempotent[0]); i++) {
+    if (method_is(method, method_len, idempotent[i])) return true;
+  }
+  return false;
+}
+
+static void reply_error(struct session *s, const char *httpcode) {
+  int len = make_response_header(s->resbuf, BUFFER_SIZE, httpcode, 0);
+  if (len > 0) (void)send_all(s->client, s->resbuf, (size_t)len);
+}
+
+static void drop_upstream(struct session *s) {
+  if (s->upstream < 0) return;
+  (void)waeio_close(s->upstream);
+  s->upstream = -1;
+}
+
+// Forwards the buffered part of the request, and streams the remainder
+// of its body from the client.
+static int forward_request(struct session *s, size_t buffered, uint64_t total) {
+  size_t head = total < buffered ? (size_t)total : buffered;
+  if (send_all(s->upstream, s->reqbuf, head) != 0) return -1;
+  return relay(s->client, s->upstream, s->resbuf, total - head);
+}
+
+// Receives the response head from upstream into `resbuf`. Returns the
+// number of bytes buffered, or -1.
+static int read_response_head(struct session *s, int *minor_version, int *status, size_t *num_headers, int *headlen) {
+  size_t got = 0, prevlen = 0;
+  while (true) {
+    int n = waeio_recv(s->upstream, s->resbuf + got, BUFFER_SIZE - got);
+    if (n <= 0) return -1;
+    prevlen = got;
+    got += (size_t)n;
+    const char *msg;
+    size_t msg_len;
+    *num_headers = MAX_HEADERS;
+    *headlen = phr_parse_response((const char*)s->resbuf, got, minor_version, status, &msg, &msg_len,
+                                  s->headers, num_headers, prevlen);
+    if (*headlen > 0) return (int)got;
+    if (*headlen == -1 || got == BUFFER_SIZE) return -1;
+  }
+}
+
+// Proxies a single exchange. The request head occupies the first
+// `headlen` bytes of `reqbuf`, of which `buffered` bytes are valid.
+// Returns false if the client connection must be closed.
+static bool proxy_exchange(struct session *s, size_t buffered, const struct message *req, bool head_only) {
+  uint64_t total = (uint64_t)req->headlen + req->length;
+
+  // A pooled connection may have been closed by the upstream whilst it
+  // was idle. If nothing came back, retry once on a fresh connection,
+  // provided the request is idempotent, as the upstream may have
+  // processed it before the connection broke, and can be replayed from
+  // the buffer.
+  int minor_version = 1, status = 0, headlen = -1, got = -1;
+  size_t num_headers = 0;
+  for (int attempt = 0; attempt < 2 && got < 0; attempt++) {
+    if (attempt == 0) {
+      if (waeio_upstream_acquire(upstream_addr, upstream_port, &s->upstream, &s->reused) != 0) {
+        s->upstream = -1;
+        break;
+      }
+    } else {
+      if (!s->reused || !req->idempotent || total > buffered) break;
+      if (waeio_connect(upstream_addr, upstream_port, &s->upstream) != 0) {
+        s->upstream = -1;
+        break;
+      }
+      s->reused = false;
+    }
+    if (forward_request(s, buffered, total) == 0)
+      got = read_response_head(s, &minor_version, &status, &num_headers, &headlen);
+    if (got < 0) drop_upstream(s);
+  }
+
+  if (got < 0) {
+    reply_error(s, "502 Bad Gateway");
+    return false;
+  }
+
+  struct message res;
+  if (!scan_headers(s->headers, num_headers, minor_version, &res)) {
+    drop_upstream(s);
+    reply_error(s, "502 Bad Gateway");
+    return false;
+  }
+
+  // Determine the length of the response body.
+  bool until_close = false;
+  uint64_t length = 0;
+  if (head_only || status == 204 || status == 304 || (status >= 100 && status < 200)) {
+    length = 0;
+  } else if (res.has_length && !res.chunked) {
+    length = res.length;
+  } else {
+    // NOTE(dhil): Chunked responses are not decoded; relay them
+    // verbatim until the upstream closes the connection.
+    until_close = true;
+  }
+
+  if (until_close) {
+    bool ok = send_all(s->client, s->resbuf, (size_t)got) == 0;
+    while (ok) {
+      int n = waeio_recv(s->upstream, s->resbuf, BUFFER_SIZE);
+      if (n <= 0) break;
+      ok = send_all(s->client, s->resbuf, (size_t)n) == 0;
+    }
+    drop_upstream(s);
+    return false;
+  }
+
+  // Anything the upstream sends past the response is a protocol
+  // violation; drop it along with the connection.
+  uint64_t restotal = (uint64_t)headlen + length;
+  size_t head = restotal < (uint64_t)got ? (size_t)restotal : (size_t)got;
+  bool reusable = !res.close && restotal >= (uint64_t)got;
+  if (send_all(s->client, s->resbuf, head) != 0
+      || relay(s->upstream, s->client, s->resbuf, restotal - head) != 0) {
+    drop_upstream(s);
+    return false;
+  }
+
+  if (reusable) {
+    (void)waeio_upstream_release(upstream_addr, upstream_port, s->upstream);
+    s->upstream = -1;
+  } else {
+    drop_upstream(s);
+  }
+  return true;
+}
+
+static void* serve(wasio_fd_t *arg) {
+  // NOTE(dhil): `waeio_async` passes the vfd itself in place of the
+  // argument pointer.
+  wasio_fd_t client = (wasio_fd_t)(intptr_t)arg;
+  // The session is released by waeio once `serve` returns.
+  struct session *s = (struct session*)waeio_fiber_local(sizeof(struct session));
+  if (s == NULL) {
+    (void)waeio_close(client);
+    return NULL;
+  }
+  s->client = client;
+  s->upstream = -1;
+  conn_logv("  [serve(%" PRIi32 ")] entered\n", client);
+
+  size_t buffered = 0;
+  while (true) {
+    // Receive until the request head is complete. Pipelined bytes
+    // from the previous request may already be buffered.
+    const char *method, *path;
+    size_t method_len, path_len, num_headers, prevlen = 0;
+    int minor_version, headlen;
+    while (true) {
+      num_headers = MAX_HEADERS;
+      headlen = phr_parse_request((const char*)s->reqbuf, buffered, &method, &method_len, &path, &path_len,
+                                  &minor_version, s->headers, &num_headers, prevlen);
+      if (headlen != -2) break;
+      if (buffered == BUFFER_SIZE) {
+        reply_error(s, "431 Request Header Fields Too Large");
+        goto done;
+      }
+      int n = waeio_recv(client, s->reqbuf + buffered, BUFFER_SIZE - buffered);
+      if (n <= 0) goto done;
+      prevlen = buffered;
+      buffered += (size_t)n;
+    }
+
+    struct message req;
+    if (headlen == -1 || !scan_headers(s->headers, num_headers, minor_version, &req)) {
+      reply_error(s, "400 Bad Request");
+      goto done;
+    }
+    if (req.chunked) {
+      reply_error(s, "501 Not Implemented");
+      goto done;
+    }
+    req.headlen = headlen;
+    req.idempotent = is_idempotent(method, method_len);
+    bool head_only = method_len == 4 && strncmp(method, "HEAD", 4) == 0;
+
+    if (!proxy_exchange(s, buffered, &req, head_only)) goto done;
+
+    // Keep the pipelined remainder, if any.
+    uint64_t total = (uint64_t)headlen + req.length;
+    if (total < buffered) {
+      memmove(s->reqbuf, s->reqbuf + total, buffered - (size_t)total);
+      buffered -= (size_t)total;
+    } else {
+      buffered = 0;
+    }
+
+    if (req.close) break;
+  }
+
+ done:
+  conn_logv("  [serve(%" PRIi32 ")] closing\n", client);
+  drop_upstream(s);
+  (void)waeio_close(client);
+  return NULL;
+}
+
+static void* listener(wasio_fd_t *servsock) {
+  wasio_fd_t conn;
+  while (waeio_accept(*servsock, &conn) == 0) {
+    if (waeio_async(serve, conn) < 0) break;
+  }
+  return NULL;
+}
+
+// Parses <ipv4 address>:<port>.
+static int parse_upstream(const char *spec) {
+  const char *colon = strrchr(spec, ':');
+  if (colon == NULL || (size_t)(colon - spec) >= sizeof(upstream_addr)) return -1;
+  long port = strtol(colon + 1, NULL, 10);
+  if (port <= 0 || port > 65535) return -1;
+  memcpy(upstream_addr, spec, (size_t)(colon - spec));
+  upstream_addr[colon - spec] = '\0';
+  upstream_port = (int32_t)port;
+  return 0;
+}
+
+int main(void) {
+  const char *spec = getenv("PROXY_UPSTREAM");
+  if (spec != NULL && parse_upstream(spec) != 0) {
+    fprintf(stderr, "error: PROXY_UPSTREAM must be of the form <ipv4 address>:<port>\n");
+    return 1;
+  }
+  // Reclaim the fibers of clients and upstreams which stall.
+  waeio_set_idle_timeout(IDLE_TIMEOUT_MS);
+  return waeio_main(listener);
+}
@@ -0,0 +1,124 @@
+/*
+A loopback stand-in for the proxy's upstream. It is a native program
+which answers every HTTP/1.1 request with a fixed response, and keeps
+connections alive unless asked not to.
+
+   ./proxy_upstream [port]   (default: 8081)
+*/
+
+#define _GNU_SOURCE // for accept4 and memmem
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define MAX_CLIENTS 1024
+#define BUFFER_SIZE 8192
+
+static const char response[] =
+  "HTTP/1.1 200 OK\r\n"
+  "Content-Length: 13\r\n"
+  "Content-Type: text/plain\r\n"
+  "\r\n"
+  "Hello World!\n";
+
+struct client {
+  size_t buffered;
+  char buf[BUFFER_SIZE];
+};
+
+static struct pollfd fds[MAX_CLIENTS + 1];
+static struct client clients[MAX_CLIENTS + 1];
+static nfds_t nfds = 0;
+
+static void drop(nfds_t i) {
+  close(fds[i].fd);
+  fds[i] = fds[--nfds];
+  clients[i] = clients[nfds];
+}
+
+static bool send_all(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    buf += n;
+    len -= (size_t)n;
+  }
+  return true;
+}
+
+// Answers every complete request head in the client's buffer. Request
+// bodies are not supported. Returns false if the connection is done.
+static bool serve(struct client *c, int fd) {
+  char *end;
+  while ((end = memmem(c->buf, c->buffered, "\r\n\r\n", 4)) != NULL) {
+    size_t headlen = (size_t)(end - c->buf) + 4;
+    bool close_after = memmem(c->buf, headlen, "Connection: close", strlen("Connection: close")) != NULL;
+    if (!send_all(fd, response, sizeof(response) - 1)) return false;
+    memmove(c->buf, c->buf + headlen, c->buffered - headlen);
+    c->buffered -= headlen;
+    if (close_after) return false;
+  }
+  return c->buffered < BUFFER_SIZE;
+}
+
+int main(int argc, char **argv) {
+  int port = argc > 1 ? atoi(argv[1]) : 8081;
+
+  int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+  int opt = 1;
+  if (sockfd < 0 || setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) != 0) {
+    perror("socket");
+    return 1;
+  }
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+  if (bind(sockfd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(sockfd, 1000) != 0) {
+    perror("bind");
+    return 1;
+  }
+  fds[nfds++] = (struct pollfd){ .fd = sockfd, .events = POLLIN };
+  printf("upstream listening on 127.0.0.1:%d\n", port);
+  fflush(stdout);
+
+  while (true) {
+    if (poll(fds, nfds, -1) < 0) {
+      if (errno == EINTR) continue;
+      perror("poll");
+      return 1;
+    }
+
+    if (fds[0].revents & POLLIN) {
+      int fd = accept4(sockfd, NULL, 0, SOCK_CLOEXEC);
+      if (fd >= 0 && nfds <= MAX_CLIENTS) {
+        clients[nfds].buffered = 0;
+        fds[nfds++] = (struct pollfd){ .fd = fd, .events = POLLIN };
+      } else if (fd >= 0) {
+        close(fd);
+      }
+    }
+
+    // Walk backwards, as dropping a client moves the last entry.
+    for (nfds_t i = nfds - 1; i > 0; i--) {
+      if (fds[i].revents == 0) continue;
+      struct client *c = &clients[i];
+      ssize_t n = recv(fds[i].fd, c->buf + c->buffered, BUFFER_SIZE - c->buffered, 0);
+      if (n <= 0) {
+        drop(i);
+        continue;
+      }
+      c->buffered += (size_t)n;
+      if (!serve(c, fds[i].fd)) drop(i);
+    }
+  }
+}
@@ -0,0 +1,53 @@
+// Pool of reference-counted I/O buffers in power-of-two size classes
+#ifndef WAEIO_BUF_POOL_H
+#define WAEIO_BUF_POOL_H
+
+#include <stdint.h>
+
+typedef enum buf_pool_return_code {
+  BUF_POOL_OK = 0,
+  BUF_POOL_MEM_ERR = -1,
+} buf_pool_result_t;
+
+typedef struct buf_pool* buf_pool_t;
+
+// The size classes are the powers of two from 2^BUF_POOL_MIN_SHIFT to
+// 2^BUF_POOL_MAX_SHIFT bytes. Larger buffers bypass the pool.
+#define BUF_POOL_MIN_SHIFT 6
+#define BUF_POOL_MAX_SHIFT 16
+#define BUF_POOL_NCLASSES (BUF_POOL_MAX_SHIFT - BUF_POOL_MIN_SHIFT + 1)
+
+struct buf_pool_stats {
+  uint32_t size;       // capacity of the buffers in this class
+  uint32_t idle;       // buffers held for reuse
+  int32_t in_use;      // buffers handed out less buffers returned
+  int32_t high_water;  // the peak of `in_use`
+  uint64_t acquired;   // buffers handed out in total
+  uint64_t misses;     // of which had to be allocated afresh
+};
+
+// Creates a pool which retains at most `cap` idle buffers per size
+// class; surplus buffers are freed on release.
+extern buf_pool_result_t buf_pool_new(uint32_t cap, buf_pool_t /* out */ *pool);
+// Frees the idle buffers. Buffers still out on loan are not touched.
+extern void buf_pool_delete(buf_pool_t pool);
+
+// Hands out a buffer of at least `size` bytes holding one reference,
+// or returns NULL on allocation failure. Its contents are undefined.
+extern void* buf_pool_acquire(buf_pool_t pool, uint32_t size);
+// The number of usable bytes in `buf`.
+extern uint32_t buf_pool_capacity(const void *buf);
+// Adds a reference to `buf`, e.g. to share it with another fiber.
+extern void buf_pool_retain(void *buf);
+// Drops a reference to `buf`; the last one returns it to `pool`, or
+// frees it if `pool` is NULL. A pool must only be used by one thread
+// at a time, but buffers may be released into a different pool than
+// the one they were acquired from, on any thread. Hence `in_use` is
+// net of buffers moving between pools; its sum over the pools is
+// exact.
+extern void buf_pool_release(buf_pool_t pool, void *buf);
+
+// Fills in the accounting of every size class, smallest first.
+extern void buf_pool_stats(buf_pool_t pool, struct buf_pool_stats /* out */ stats[BUF_POOL_NCLASSES]);
+
+#endif
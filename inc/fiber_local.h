@@ -0,0 +1,25 @@
+// Fiber-local storage layered over fiber-c
+#ifndef WAEIO_FIBER_LOCAL_H
+#define WAEIO_FIBER_LOCAL_H
+
+#include <stddef.h>
+
+// Fiber-local storage lives on the heap, hence pointers into it remain
+// valid across stack switches, unlike pointers into the fiber's own
+// stack frames (cf. the shadow stack). fiber-c has no notion of the
+// running fiber, so whoever resumes a fiber installs its storage first.
+
+// Allocates `size` bytes of zeroed storage, or returns NULL.
+extern void* fiber_local_new(size_t size);
+// Deleting NULL is a no-op.
+extern void fiber_local_delete(void *local);
+// The size `local` was allocated with.
+extern size_t fiber_local_size(const void *local);
+
+// Installs `local` as the storage of the fiber about to be resumed on
+// the calling thread. NULL denotes a fiber without storage.
+extern void fiber_local_install(void *local);
+// Returns the storage of the running fiber, or NULL if it has none.
+extern void* fiber_local(void);
+
+#endif
@@ -0,0 +1,35 @@
+// Pool of reusable fibers layered over fiber-c
+#ifndef WAEIO_FIBER_POOL_H
+#define WAEIO_FIBER_POOL_H
+
+#include <fiber.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef enum fiber_pool_return_code {
+  FIBER_POOL_OK = 0,
+  FIBER_POOL_MEM_ERR = -1,
+} fiber_pool_result_t;
+
+typedef struct fiber_pool* fiber_pool_t;
+
+// Pooled fibers run a trampoline which never returns. Instead, once
+// the entry point returns the fiber yields this value, and awaits its
+// next job. The owner must then release the fiber.
+extern const char fiber_pool_finished_token;
+#define FIBER_POOL_FINISHED ((void*)&fiber_pool_finished_token)
+
+// Creates a pool with `warm` fibers allocated up front, which retains
+// at most `cap` idle fibers; surplus fibers are freed on release.
+extern fiber_pool_result_t fiber_pool_new(uint32_t warm, uint32_t cap, fiber_pool_t /* out */ *pool);
+// Frees the idle fibers. Fibers still out on loan are not touched.
+extern void fiber_pool_delete(fiber_pool_t pool);
+
+// Hands out a fiber which runs `entry(arg)`. The fiber must be resumed
+// with `*start` the first time round; subsequent resumes carry
+// whatever the entry point expects. Returns NULL on allocation failure.
+extern fiber_t fiber_pool_acquire(fiber_pool_t pool, fiber_entry_point_t entry, void *arg, void /* out */ **start);
+// Returns `fiber`, which must just have yielded FIBER_POOL_FINISHED.
+extern void fiber_pool_release(fiber_pool_t pool, fiber_t fiber);
+
+#endif
@@ -1,8 +1,9 @@
-// Compact freelist based on a bitmap
+// Compact freelist based on a two-level bitmap
 #ifndef WAEIO_FREELIST_H
 #define WAEIO_FREELIST_H
 
 #include <limits.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 
@@ -17,9 +18,31 @@ typedef enum freelist_return_code {
 typedef struct freelist* freelist_t;
 
 extern freelist_result_t freelist_new(uint32_t freespace /* must be positive */, freelist_t /* out */ *freelist);
+// Hands out the lowest free entry, or with rotation enabled the first
+// free entry after the one handed out last, wrapping around.
 extern freelist_result_t freelist_next(freelist_t freelist, uint32_t /* out */ *entry);
 extern freelist_result_t freelist_reclaim(freelist_t freelist, uint32_t entry);
+// Growing adds free entries; shrinking drops the entries beyond the
+// new size. On failure the freelist is left unchanged.
 extern freelist_result_t freelist_resize(freelist_t *freelist, uint32_t freespace);
+// Rotation spreads reuse over the entries, such that a reclaimed entry
+// is not handed out again straight away. It is off by default.
+extern void freelist_rotate(freelist_t freelist, bool rotate);
 extern void freelist_delete(freelist_t freelist);
 
+// A concurrent freelist of fixed size. Any number of threads may hand
+// out and reclaim entries at once without taking a lock: an entry is
+// claimed by atomically clearing its bit, and each thread starts its
+// search from the word it last used, such that threads mostly work on
+// different words. Entries are handed out in no particular order.
+typedef struct freelist_atomic* freelist_atomic_t;
+
+extern freelist_result_t freelist_atomic_new(uint32_t freespace /* must be positive */, freelist_atomic_t /* out */ *freelist);
+extern freelist_result_t freelist_atomic_next(freelist_atomic_t freelist, uint32_t /* out */ *entry);
+// Whatever the reclaiming thread wrote before reclaiming `entry` is
+// visible to the thread which is handed it out next.
+extern freelist_result_t freelist_atomic_reclaim(freelist_atomic_t freelist, uint32_t entry);
+// Must not race with any other operation on `freelist`.
+extern void freelist_atomic_delete(freelist_atomic_t freelist);
+
 #endif
@@ -0,0 +1,13 @@
+// Host epoll bindings
+#ifndef WAEIO_HOST_DRIVER_EPOLL_H
+#define WAEIO_HOST_DRIVER_EPOLL_H
+
+#include <wasmtime.h>
+
+wasmtime_error_t* host_epoll_init(wasmtime_linker_t *linker, const char *export_module);
+// Makes current and future calls to `host_epoll_wait` fail with EINTR, such
+// that the calling instances shut down.
+void host_epoll_shutdown(void);
+void host_epoll_delete(void);
+
+#endif
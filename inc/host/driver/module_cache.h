@@ -0,0 +1,22 @@
+// Precompiled module cache
+#ifndef WAEIO_HOST_DRIVER_MODULE_CACHE_H
+#define WAEIO_HOST_DRIVER_MODULE_CACHE_H
+
+#include <stdbool.h>
+#include <wasm.h>
+#include <wasmtime.h>
+
+// Returns the engine configuration shared by the drivers and the
+// precompiler. Precompiled artifacts are only compatible with engines
+// configured identically.
+wasm_config_t* host_engine_config_new(void);
+
+// Loads the module at `path`. A `.cwasm` path is deserialized
+// directly. Otherwise the precompiled artifact `<path>.cwasm` is used
+// if the content hash recorded in `<path>.cwasm.hash` matches that of
+// `path`; on a mismatch, or if the artifact is missing or
+// incompatible, the module is compiled and, if `update` is true, the
+// artifact and its hash are (re)written.
+wasmtime_error_t* host_module_load(wasm_engine_t *engine, const char *path, bool update, wasmtime_module_t **module);
+
+#endif
@@ -4,7 +4,10 @@
 
 #include <wasmtime.h>
 
-wasmtime_error_t* host_poll_init(wasmtime_linker_t *linker, wasmtime_context_t *context, const char *export_module);
+wasmtime_error_t* host_poll_init(wasmtime_linker_t *linker, const char *export_module);
+// Makes current and future calls to `host_poll` fail with EINTR, such
+// that the calling instances shut down.
+void host_poll_shutdown(void);
 void host_poll_delete(void);
 
 #endif
@@ -0,0 +1,15 @@
+// Host shared ring bindings
+#ifndef WAEIO_HOST_DRIVER_RING_H
+#define WAEIO_HOST_DRIVER_RING_H
+
+#include <wasmtime.h>
+
+wasmtime_error_t* host_ring_init(wasmtime_linker_t *linker, const char *export_module);
+// Makes current and future calls to `host_ring_enter` fail with EINTR,
+// such that the calling instances shut down.
+void host_ring_shutdown(void);
+// Stops the calling thread's ring thread, if any.
+void host_ring_release(void);
+void host_ring_delete(void);
+
+#endif
@@ -2,9 +2,20 @@
 #ifndef WAEIO_HOST_DRIVER_SOCKET_H
 #define WAEIO_HOST_DRIVER_SOCKET_H
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <wasmtime.h>
 
-wasmtime_error_t* host_socket_init(wasmtime_linker_t *linker, wasmtime_context_t *context, const char *export_module);
+wasmtime_error_t* host_socket_init(wasmtime_linker_t *linker, const char *export_module);
 void host_socket_delete(void);
 
+// Makes subsequently opened listeners share their port through
+// SO_REUSEPORT. Drivers which run several workers, each with its own
+// listener, must enable it before starting them.
+void host_socket_set_reuseport(bool enable);
+
+// Opens a nonblocking listener on `port`, as `host_listen` does for
+// the guest. Returns -1 and sets errno on failure.
+int host_socket_listen(int32_t port, int32_t backlog);
+
 #endif
@@ -0,0 +1,87 @@
+// Guest interface to the host's shared submission/completion rings.
+#ifndef WAEIO_HOST_RING_H
+#define WAEIO_HOST_RING_H
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <wasm_utils.h>
+
+// Operation codes understood by the host ring thread.
+#define HOST_RING_OP_ACCEPT 0
+#define HOST_RING_OP_RECV 1
+#define HOST_RING_OP_SEND 2
+#define HOST_RING_OP_CLOSE 3
+// Waits for readiness; `len` holds the poll events of interest, and
+// the result is the ready events.
+#define HOST_RING_OP_POLL 4
+// Abandons the operation on `fd` whose user data is `user_data`, which
+// then completes with -ECANCELED unless it has completed already. The
+// cancellation itself produces no completion.
+#define HOST_RING_OP_CANCEL 5
+
+// Submission entry. `buf` and `len` describe a region of linear
+// memory; they are ignored by accept and close.
+struct host_ring_sqe {
+  uint32_t opcode;
+  int32_t fd;
+  uint8_t *buf;
+  uint32_t len;
+  uint64_t user_data;
+};
+
+static_assert(sizeof(struct host_ring_sqe) == 24, "size of struct host_ring_sqe");
+static_assert(offsetof(struct host_ring_sqe, buf) == 8, "offset of buf");
+static_assert(offsetof(struct host_ring_sqe, user_data) == 16, "offset of user_data");
+
+// Completion entry. `res` is the result of the underlying system call,
+// or the negated host errno on failure.
+struct host_ring_cqe {
+  uint64_t user_data;
+  int32_t res;
+  uint32_t flags;
+};
+
+static_assert(sizeof(struct host_ring_cqe) == 16, "size of struct host_ring_cqe");
+static_assert(offsetof(struct host_ring_cqe, res) == 8, "offset of res");
+
+// The ring header lives in linear memory. The guest produces
+// submissions at `sq_tail` and consumes completions at `cq_head`; the
+// host consumes submissions at `sq_head` and produces completions at
+// `cq_tail`. Indices are free-running and wrap modulo `entries`, which
+// must be a power of two. The host does not buffer completions: it
+// leaves submissions whose completions might not fit in the completion
+// ring on the submission ring, and `host_ring_enter` then fails with
+// EBUSY.
+struct host_ring {
+  uint32_t sq_head;
+  uint32_t sq_tail;
+  uint32_t cq_head;
+  uint32_t cq_tail;
+  uint32_t entries;
+  struct host_ring_sqe *sqes;
+  struct host_ring_cqe *cqes;
+};
+
+static_assert(sizeof(struct host_ring) == 28, "size of struct host_ring");
+static_assert(offsetof(struct host_ring, entries) == 16, "offset of entries");
+static_assert(offsetof(struct host_ring, sqes) == 20, "offset of sqes");
+static_assert(offsetof(struct host_ring, cqes) == 24, "offset of cqes");
+
+// Hands `ring` to a host thread, which executes submissions
+// asynchronously of the guest.
+extern
+__wasm_import__("host_ring", "setup")
+int32_t host_ring_setup(struct host_ring *ring, int32_t*);
+
+// Notifies the host of new submissions, and waits until at least
+// `min_complete` completions are available or `timeout` milliseconds
+// have passed (negative means forever). Returns the number of
+// available completions. The host executes submissions, and posts
+// completions, whilst the guest runs; submissions made since the last
+// call are only picked up by the next one.
+extern
+__wasm_import__("host_ring", "enter")
+int32_t host_ring_enter(uint32_t min_complete, int32_t timeout, int32_t*);
+
+#endif
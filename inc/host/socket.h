@@ -4,14 +4,63 @@
 #include <stdint.h>
 #include <wasm_utils.h>
 
+// Listener options as consumed by `host_listen_ex`. A zero field
+// leaves the option at the system default. `nodelay`, `sndbuf`, and
+// `rcvbuf` are inherited by accepted connections.
+struct host_listen_opts {
+  int32_t backlog;
+  int32_t defer_accept; // seconds
+  int32_t fastopen;     // queue length
+  uint32_t nodelay;
+  int32_t sndbuf;
+  int32_t rcvbuf;
+};
+
+// Option names for `host_setsockopt`.
+#define HOST_SOCKOPT_NODELAY 1
+#define HOST_SOCKOPT_DEFER_ACCEPT 2
+#define HOST_SOCKOPT_FASTOPEN 3
+#define HOST_SOCKOPT_SNDBUF 4
+#define HOST_SOCKOPT_RCVBUF 5
+
+// An I/O vector as consumed by `host_sendv` and `host_recvv`.
+struct host_iovec {
+  uint8_t *buf;
+  uint32_t len;
+};
+
 extern
 __wasm_import__("host_socket", "listen")
 int32_t host_listen(int32_t, int32_t, int32_t*);
 
+extern
+__wasm_import__("host_socket", "listen_ex")
+int32_t host_listen_ex(int32_t, const struct host_listen_opts*, int32_t*);
+
+extern
+__wasm_import__("host_socket", "setsockopt")
+int32_t host_setsockopt(int32_t, int32_t, int32_t, int32_t*);
+
+// Starts a nonblocking connect to `addr`:`port`. The fd is returned
+// even if the connection is still in progress, in which case the
+// errno is set to EINPROGRESS.
+extern
+__wasm_import__("host_socket", "connect")
+int32_t host_connect(const char*, uint32_t, int32_t, int32_t*);
+
+// Reports the outcome of a connect once the fd is writable.
+extern
+__wasm_import__("host_socket", "connect_result")
+int32_t host_connect_result(int32_t, int32_t*);
+
 extern
 __wasm_import__("host_socket", "accept")
 int32_t host_accept(int32_t, int32_t*);
 
+extern
+__wasm_import__("host_socket", "accept_many")
+int32_t host_accept_many(int32_t, int32_t*, uint32_t, int32_t*);
+
 extern
 __wasm_import__("host_socket", "recv")
 int32_t host_recv(int32_t, uint8_t*, uint32_t, int32_t*);
@@ -20,6 +69,30 @@ extern
 __wasm_import__("host_socket", "send")
 int32_t host_send(int32_t, uint8_t*, uint32_t, int32_t*);
 
+extern
+__wasm_import__("host_socket", "recvv")
+int32_t host_recvv(int32_t, const struct host_iovec*, uint32_t, int32_t*);
+
+extern
+__wasm_import__("host_socket", "sendv")
+int32_t host_sendv(int32_t, const struct host_iovec*, uint32_t, int32_t*);
+
+extern
+__wasm_import__("host_socket", "open")
+int32_t host_open(const char*, uint32_t, int32_t*);
+
+extern
+__wasm_import__("host_socket", "pipe")
+int32_t host_pipe(int32_t* /* [2] */, int32_t*);
+
+extern
+__wasm_import__("host_socket", "sendfile")
+int32_t host_sendfile(int32_t, int32_t, int64_t, uint32_t, int32_t*);
+
+extern
+__wasm_import__("host_socket", "splice")
+int32_t host_splice(int32_t, int32_t, uint32_t, int32_t*);
+
 extern
 __wasm_import__("host_socket", "close")
 int32_t host_close(int32_t, int32_t*);
@@ -5,17 +5,59 @@
 #include <assert.h>
 #include <errno.h>
 #include <limits.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
 #include <wasm.h>
 #include <wasmtime.h>
 
 #include <stdio.h>
 
+// Host bindings are defined via the following macros, such that they
+// can be instantiated either with wasmtime's checked calling
+// convention, where every argument is boxed as a `wasmtime_val_t`, or
+// with its unchecked raw-value convention, where arguments and results
+// share a single `wasmtime_val_raw_t` buffer. Debug builds use the
+// former to validate the kinds of all arguments; release builds use
+// the latter to cut the fixed cost of every hostcall.
+//
+//  DEFINE_BINDING(NAME)        -- binding prototype
+//  BINDING_ARITY(NARGS, NRES)  -- validates the arity
+//  ARG_I32(i), ARG_U32(i), ARG_I64(i) -- reads the i'th argument
+//  RETURN_I32(v)               -- returns a single i32 result
+//  LINK_HOST_FN(name, sig, fn) -- defines the host function in the linker
+//
+// Host functions are defined on the linker rather than in a particular
+// store, such that a single linker can instantiate the same module in
+// several stores, e.g. one per worker thread.
+#if defined DEBUG
 #define DEFINE_BINDING(NAME) static wasm_trap_t* NAME(void *env __attribute__((unused)), \
                                                       wasmtime_caller_t *caller __attribute__((unused)), \
                                                       const wasmtime_val_t *args __attribute__((unused)), size_t nargs __attribute__((unused)), \
                                                       wasmtime_val_t *results, size_t nresults __attribute__((unused)))
+#define BINDING_ARITY(NARGS, NRESULTS) { assert(nargs == (NARGS)); assert(nresults == (NRESULTS)); }
+#define ARG_I32(i) int32_t_of_wasmtime_val_t(args[(i)])
+#define ARG_U32(i) uint32_t_of_wasmtime_val_t(args[(i)])
+#define ARG_I64(i) int64_t_of_wasmtime_val_t(args[(i)])
+#define RETURN_I32(v) return result1(results, wasmtime_val_t_of_int32_t((int32_t)(v)))
+#define DEFINE_HOST_FN wasmtime_linker_define_func
+#else
+#define DEFINE_BINDING(NAME) static wasm_trap_t* NAME(void *env __attribute__((unused)), \
+                                                      wasmtime_caller_t *caller __attribute__((unused)), \
+                                                      wasmtime_val_raw_t *args_and_results, \
+                                                      size_t nargs_and_results __attribute__((unused)))
+// NOTE(dhil): The arity is enforced by the type check performed when
+// linking the module.
+#define BINDING_ARITY(NARGS, NRESULTS) {}
+#define ARG_I32(i) (args_and_results[(i)].i32)
+#define ARG_U32(i) ((uint32_t)args_and_results[(i)].i32)
+#define ARG_I64(i) (args_and_results[(i)].i64)
+// NOTE(dhil): The result overwrites the first argument, so it must be
+// evaluated before the store.
+#define RETURN_I32(v) { int32_t _result = (int32_t)(v); args_and_results[0].i32 = _result; return NULL; }
+#define DEFINE_HOST_FN wasmtime_linker_define_func_unchecked
+#endif
 
 __attribute__((unused))
 static inline wasm_trap_t* result1(wasmtime_val_t *results, wasmtime_val_t arg) {
@@ -28,18 +70,64 @@ static inline wasm_trap_t* result0(wasmtime_val_t *results __attribute__((unused
   return NULL;
 }
 
+// Per-instance host state. The driver installs it as the data of the
+// store that hosts the instance, such that bindings can reach it
+// without any lookups.
+typedef struct host_context {
+  bool memory_resolved;
+  wasmtime_memory_t memory;
+  uint8_t *memory_base;
+  size_t memory_size;
+} host_context_t;
+
+__attribute__((unused))
+static inline void host_context_init(host_context_t *hctx) {
+  memset(hctx, 0, sizeof(host_context_t));
+}
+
+// Returns the base of the caller's linear memory, or NULL if the
+// instance does not export a memory. The "memory" export is resolved
+// once per instance; afterwards the cached base pointer is only
+// reloaded if the memory size has changed, i.e. after `memory.grow`.
+__attribute__((unused))
+static inline uint8_t* host_context_memory(wasmtime_caller_t *caller) {
+  wasmtime_context_t *context = wasmtime_caller_context(caller);
+  host_context_t *hctx = (host_context_t*)wasmtime_context_get_data(context);
+  assert(hctx != NULL);
+  if (!hctx->memory_resolved) {
+    wasmtime_extern_t memory_extern;
+    if (!wasmtime_caller_export_get(caller, "memory", strlen("memory"), &memory_extern))
+      return NULL;
+    assert(memory_extern.kind == WASMTIME_EXTERN_MEMORY);
+    hctx->memory = memory_extern.of.memory;
+    hctx->memory_resolved = true;
+  } else {
+    size_t size = wasmtime_memory_data_size(context, &hctx->memory);
+    if (size == hctx->memory_size) return hctx->memory_base;
+  }
+  hctx->memory_base = wasmtime_memory_data(context, &hctx->memory);
+  hctx->memory_size = wasmtime_memory_data_size(context, &hctx->memory);
+  return hctx->memory_base;
+}
+
+// Returns the size of the caller's linear memory as of the last call
+// to `host_context_memory`.
+__attribute__((unused))
+static inline size_t host_context_memory_size(wasmtime_caller_t *caller) {
+  host_context_t *hctx = (host_context_t*)wasmtime_context_get_data(wasmtime_caller_context(caller));
+  return hctx->memory_size;
+}
+
 #define LOAD_MEMORY(memptr, host_fn_name) \
   { \
-    wasmtime_extern_t memory_extern; \
-    if (!wasmtime_caller_export_get(caller, "memory", strlen("memory"), &memory_extern)) \
+    memptr = host_context_memory(caller); \
+    if (memptr == NULL) \
       return wasmtime_trap_new("[" host_fn_name "] cannot load memory", strlen("[" host_fn_name "] cannot load memory")); \
-    assert(memory_extern.kind == WASMTIME_EXTERN_MEMORY); \
-    memptr = wasmtime_memory_data(wasmtime_caller_context(caller), &memory_extern.of.memory); \
   }
 
-#define LINK_HOST_FN(name, ex) \
+#define LINK_HOST_FN(name, sig, fn) \
   { \
-    error = wasmtime_linker_define(linker, context, export_module, strlen(export_module), name, strlen(name), &ex); \
+    error = DEFINE_HOST_FN(linker, export_module, strlen(export_module), name, strlen(name), (sig), (fn), NULL, NULL); \
     if (error != NULL) return error; \
   }
 
@@ -59,7 +147,7 @@ static inline void memory_write_u32(uint8_t *mem, uint32_t u32) {
     assert(INT32_MIN <= err && err <= INT32_MAX); \
     uint8_t *mem; \
     LOAD_MEMORY(mem, host_fn_name); \
-    uint32_t offset = uint32_t_of_wasmtime_val_t(args[args_offset]); \
+    uint32_t offset = ARG_U32(args_offset); \
     memory_write_u32(mem+offset, (uint32_t)err); \
   }
 
@@ -104,6 +192,70 @@ static inline wasm_functype_t* wasm_functype_new_4_1(
   return wasm_functype_new(&params, &results);
 }
 
+__attribute__((unused))
+static inline wasm_functype_t* wasm_functype_new_5_1(
+  wasm_valtype_t* p1, wasm_valtype_t* p2, wasm_valtype_t* p3, wasm_valtype_t* p4,
+  wasm_valtype_t* p5,
+  wasm_valtype_t* r
+) {
+  wasm_valtype_t* ps[5] = {p1, p2, p3, p4, p5};
+  wasm_valtype_t* rs[1] = {r};
+  wasm_valtype_vec_t params, results;
+  wasm_valtype_vec_new(&params, 5, ps);
+  wasm_valtype_vec_new(&results, 1, rs);
+  return wasm_functype_new(&params, &results);
+}
+
+__attribute__((unused))
+static inline wasm_functype_t* wasm_functype_new_6_1(
+  wasm_valtype_t* p1, wasm_valtype_t* p2, wasm_valtype_t* p3, wasm_valtype_t* p4,
+  wasm_valtype_t* p5, wasm_valtype_t* p6,
+  wasm_valtype_t* r
+) {
+  wasm_valtype_t* ps[6] = {p1, p2, p3, p4, p5, p6};
+  wasm_valtype_t* rs[1] = {r};
+  wasm_valtype_vec_t params, results;
+  wasm_valtype_vec_new(&params, 6, ps);
+  wasm_valtype_vec_new(&results, 1, rs);
+  return wasm_functype_new(&params, &results);
+}
+
+// Host calls which may block for long wait in slices of at most
+// HOST_WAIT_SLICE_MS milliseconds, such that they observe shut down
+// requests issued by other threads, e.g. `host_poll_shutdown`.
+#define HOST_WAIT_SLICE_MS 1000
+
+// Returns the time on CLOCK_MONOTONIC at which a wait for `timeout`
+// milliseconds is due. Meaningless if `timeout` is negative.
+__attribute__((unused))
+static inline struct timespec host_wait_deadline(int32_t timeout) {
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  if (timeout < 0) return deadline;
+  deadline.tv_sec += timeout / 1000;
+  deadline.tv_nsec += (long)(timeout % 1000) * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+  return deadline;
+}
+
+// Returns the length in milliseconds of the next slice of a wait for
+// `timeout` milliseconds (negative means forever) which is due at
+// `deadline`, or zero once the deadline has passed.
+__attribute__((unused))
+static inline int host_wait_slice(int32_t timeout, const struct timespec *deadline) {
+  if (timeout < 0) return HOST_WAIT_SLICE_MS;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  int64_t remaining_ns = (int64_t)(deadline->tv_sec - now.tv_sec) * 1000000000L + (deadline->tv_nsec - now.tv_nsec);
+  if (remaining_ns <= 0) return 0;
+  // Round up, lest the wait ends just short of its deadline.
+  int64_t remaining = (remaining_ns + 999999) / 1000000;
+  return remaining < HOST_WAIT_SLICE_MS ? (int)remaining : HOST_WAIT_SLICE_MS;
+}
+
 #define NEW_WASM_I32 wasm_valtype_new(WASM_I32)
 #define NEW_WASM_I64 wasm_valtype_new(WASM_I64)
 
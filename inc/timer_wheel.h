@@ -0,0 +1,45 @@
+// Hierarchical timer wheel with intrusive timers
+#ifndef WAEIO_TIMER_WHEEL_H
+#define WAEIO_TIMER_WHEEL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum timer_wheel_return_code {
+  TIMER_WHEEL_OK = 0,
+  TIMER_WHEEL_MEM_ERR = -1,
+} timer_wheel_result_t;
+
+// A timer is embedded in its owner, and must stay put whilst armed.
+// Time is measured in ticks; the wheel is oblivious to their unit.
+struct timer {
+  struct timer *next;
+  struct timer **pprev; // NULL whilst disarmed
+  uint64_t deadline;
+  uint32_t slot;
+};
+
+typedef struct timer_wheel* timer_wheel_t;
+
+extern timer_wheel_result_t timer_wheel_new(uint64_t now, timer_wheel_t /* out */ *wheel);
+extern void timer_wheel_delete(timer_wheel_t wheel);
+
+// Arms `timer` to expire at `deadline`. A deadline in the past expires
+// on the next advance. Arming an armed timer reschedules it.
+extern void timer_wheel_arm(timer_wheel_t wheel, struct timer *timer, uint64_t deadline);
+// Disarming a disarmed timer is a no-op.
+extern void timer_wheel_disarm(timer_wheel_t wheel, struct timer *timer);
+
+// Advances the wheel to `now`. The expired timers are disarmed and
+// linked through their `next` field, in no particular order.
+extern uint32_t timer_wheel_advance(timer_wheel_t wheel, uint64_t now, struct timer /* out */ **expired);
+
+// Yields a lower bound on the next deadline; false if nothing is armed.
+extern bool timer_wheel_next(timer_wheel_t wheel, uint64_t /* out */ *deadline);
+
+static inline bool timer_armed(const struct timer *timer) {
+  return timer->pprev != NULL;
+}
+
+#endif
@@ -1,13 +1,40 @@
 #ifndef WAEIO_H
 #define WAEIO_H
 
+#include <buf_pool.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <wasio.h>
 #include <wasm_utils.h>
 
+// How the scheduler waits for I/O once it runs out of ready fibers.
+enum waeio_poll_policy {
+  // Never block; lowest latency, but pins a core.
+  WAEIO_POLL_BUSY,
+  // Keep polling for a short while after activity, then block.
+  WAEIO_POLL_BALANCED,
+  // Block as soon as there is nothing to run.
+  WAEIO_POLL_POWERSAVE,
+};
+
+struct waeio_poll_config {
+  // Microseconds to poll without blocking after the last activity.
+  uint32_t spin_us;
+  // Upper bound, in milliseconds, on a blocking poll; negative means
+  // unbounded and zero means never block.
+  int32_t max_block_ms;
+};
+
+struct waeio_poll_config waeio_poll_preset(enum waeio_poll_policy policy);
+
+// Runs `main` on the listener socket with the policy chosen by
+// WAEIO_POLL_POLICY (balanced unless overridden).
 __wasm_export__("waeio_main")
 int waeio_main(void* (*main)(wasio_fd_t*));
 
+__wasm_export__("waeio_main_ex")
+int waeio_main_ex(void* (*main)(wasio_fd_t*), const struct waeio_poll_config *config);
+
 __wasm_export__("waeio_async")
 int waeio_async(void *(*proc)(wasio_fd_t*), wasio_fd_t vfd);
 
@@ -20,9 +47,126 @@ int waeio_recv(wasio_fd_t vfd, uint8_t *buf, uint32_t len);
 __wasm_export__("waeio_send")
 int waeio_send(wasio_fd_t vfd, uint8_t *buf, uint32_t len);
 
+// Like `waeio_recv` and `waeio_send`, but give up after `timeout`
+// milliseconds (never if negative) with errno set to ETIMEDOUT. The
+// plain variants apply the idle timeout.
+__wasm_export__("waeio_recv_timeout")
+int waeio_recv_timeout(wasio_fd_t vfd, uint8_t *buf, uint32_t len, int32_t timeout);
+
+__wasm_export__("waeio_send_timeout")
+int waeio_send_timeout(wasio_fd_t vfd, uint8_t *buf, uint32_t len, int32_t timeout);
+
+// Suspends the calling fiber for at least `ms` milliseconds.
+__wasm_export__("waeio_sleep")
+int waeio_sleep(uint32_t ms);
+
+// Returns `size` bytes of storage private to the calling fiber, or
+// NULL if out of memory. The storage is zeroed on the first call, and
+// every later call by the same fiber returns the same storage, which
+// must not grow. It lives on the heap, so it is safe to keep pointers
+// into it across blocking operations, and it is released once the
+// fiber finishes.
+__wasm_export__("waeio_fiber_local")
+void* waeio_fiber_local(uint32_t size);
+
+// Pooled I/O buffers, in power-of-two size classes, which the
+// scheduler recycles. `waeio_buf_acquire` returns a buffer of at least
+// `size` bytes, or NULL if out of memory; its contents are undefined.
+// The caller holds one reference; `waeio_buf_retain` adds one, e.g.
+// before handing the buffer to another fiber, and `waeio_buf_release`
+// drops one. The last release returns the buffer to the pool.
+__wasm_export__("waeio_buf_acquire")
+void* waeio_buf_acquire(uint32_t size);
+
+__wasm_export__("waeio_buf_capacity")
+uint32_t waeio_buf_capacity(const void *buf);
+
+__wasm_export__("waeio_buf_retain")
+void waeio_buf_retain(void *buf);
+
+__wasm_export__("waeio_buf_release")
+void waeio_buf_release(void *buf);
+
+// Fills `stats`, which must have room for BUF_POOL_NCLASSES entries,
+// with the accounting of the scheduler's pool, including its
+// high-water marks. Returns the number of entries.
+__wasm_export__("waeio_buf_stats")
+int waeio_buf_stats(struct buf_pool_stats *stats);
+
+// Sets the deadline, in milliseconds, for a connection to make
+// progress in any blocking operation but accept. Zero disables it.
+__wasm_export__("waeio_set_idle_timeout")
+void waeio_set_idle_timeout(int32_t ms);
+
+// Sets the maximum number of live connections, the listener included.
+// It takes effect at the next `waeio_main`; if it is never set, then
+// the limit is read from the WAEIO_MAX_CONNECTIONS environment
+// variable, and defaults to MAX_CONNECTIONS. The scheduler's tables
+// are sized for the limit at startup, and grow on demand.
+__wasm_export__("waeio_set_max_connections")
+void waeio_set_max_connections(uint32_t n);
+
+__wasm_export__("waeio_sendv")
+int waeio_sendv(wasio_fd_t vfd, const struct wasio_iovec *iov, uint32_t iovcnt);
+
+// Zero-copy transfers: bytes move within the host kernel and never
+// enter linear memory. `waeio_splice` returns 0 at end of file.
+__wasm_export__("waeio_sendfile")
+int waeio_sendfile(wasio_fd_t vfd, wasio_fd_t file_vfd, int64_t offset, uint32_t len);
+
+__wasm_export__("waeio_splice")
+int waeio_splice(wasio_fd_t in_vfd, wasio_fd_t out_vfd, uint32_t len);
+
+// Connects to `addr`:`port`, parking the fiber until the connection
+// is established. `waeio_connect_timeout` gives up after `timeout`
+// milliseconds (never if negative) with errno set to ETIMEDOUT, and
+// closes the half-open connection; `waeio_connect` applies the idle
+// timeout.
+__wasm_export__("waeio_connect")
+int waeio_connect(const char *addr, int32_t port, wasio_fd_t *vfd);
+
+__wasm_export__("waeio_connect_timeout")
+int waeio_connect_timeout(const char *addr, int32_t port, wasio_fd_t *vfd, int32_t timeout);
+
+// Upstream connection pool. `waeio_upstream_acquire` hands out an idle
+// connection to `addr`:`port`, or connects afresh if there is none;
+// `*reused` tells which. `waeio_upstream_release` returns a connection
+// which is fit for reuse; a connection that failed must be closed
+// instead. Idle connections are closed as soon as the peer hangs up on
+// them, and are checked again when handed out. The peer may still
+// close a reused connection just as the first request is sent on it;
+// such a request may be retried on a fresh connection, provided it is
+// idempotent, as the peer may have processed it already.
+__wasm_export__("waeio_upstream_acquire")
+int waeio_upstream_acquire(const char *addr, int32_t port, wasio_fd_t *vfd, bool *reused);
+
+__wasm_export__("waeio_upstream_release")
+int waeio_upstream_release(const char *addr, int32_t port, wasio_fd_t vfd);
+
+__wasm_export__("waeio_open")
+int waeio_open(const char *path, wasio_fd_t *vfd);
+
+__wasm_export__("waeio_pipe")
+int waeio_pipe(wasio_fd_t *rvfd, wasio_fd_t *wvfd);
+
 __wasm_export__("waeio_close")
 int waeio_close(wasio_fd_t vfd);
 
+// Cancels the fiber blocked on `vfd`: its pending operation fails
+// with errno set to ECANCELED, and its deadline, slot, and pollset
+// interest are released at once. A fiber which is not blocked on `vfd`
+// yet is cancelled as soon as it blocks on it. In completion-ring
+// builds the fiber is woken once the host has abandoned the operation,
+// which may have completed in the meantime.
+__wasm_export__("waeio_cancel")
+int waeio_cancel(wasio_fd_t vfd);
+
+// Shuts the scheduler down. Every other fiber is woken with the kill
+// signal, as is any fiber which blocks from then on, and `waeio_main`
+// returns once all of them have run to completion. The cost is in
+// proportion to the live fibers rather than the connection limit. In
+// completion-ring builds fibers blocked on the ring are woken once the
+// host has abandoned their operations.
 __wasm_export__("waeio_cancel_all")
 void waeio_cancel_all(void);
 
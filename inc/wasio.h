@@ -3,7 +3,9 @@
 
 #include <assert.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <wasm_utils.h>
 
 #if WASIO_BACKEND == 1
@@ -22,63 +24,210 @@
 #define WASIO_POLLERR HOST_POLLERR
 #define WASIO_POLLHUP HOST_POLLHUP
 #define WASIO_POLLNVAL HOST_POLLNVAL
+#elif WASIO_BACKEND == 3
+#include <freelist.h>
+#include <host/epoll.h>
+#define WASIO_POLLIN HOST_EPOLLIN
+#define WASIO_POLLPRI HOST_EPOLLPRI
+#define WASIO_POLLOUT HOST_EPOLLOUT
+#define WASIO_POLLERR HOST_EPOLLERR
+#define WASIO_POLLHUP HOST_EPOLLHUP
 #else
 #error "unsupported backend"
 #endif
 
+// Virtual file descriptor.
+typedef int32_t wasio_fd_t;
+
+// A ready event as reported by `wasio_poll`.
+struct wasio_event {
+  wasio_fd_t vfd;
+  uint32_t revents;
+};
+
+static_assert(sizeof(struct wasio_event) == 8, "size of struct wasio_event");
+static_assert(offsetof(struct wasio_event, vfd) == 0, "offset of vfd");
+static_assert(offsetof(struct wasio_event, revents) == 4, "offset of revents");
+
+// A buffer in a vectored send or receive.
+struct wasio_iovec {
+  uint8_t *buf;
+  uint32_t len;
+};
+
+// Listener options for `wasio_listen_ex`. A zero field leaves the
+// option at the system default. `nodelay`, `sndbuf`, and `rcvbuf`
+// carry over to accepted connections.
+struct wasio_listen_opts {
+  int32_t backlog;
+  int32_t defer_accept; // seconds to wait for the first data segment
+  int32_t fastopen;     // TCP Fast Open queue length
+  uint32_t nodelay;     // disable Nagle's algorithm
+  int32_t sndbuf;
+  int32_t rcvbuf;
+};
+
+// Option names for `wasio_setsockopt`.
+enum wasio_sockopt {
+  WASIO_SOCKOPT_NODELAY = 1,
+  WASIO_SOCKOPT_DEFER_ACCEPT = 2,
+  WASIO_SOCKOPT_FASTOPEN = 3,
+  WASIO_SOCKOPT_SNDBUF = 4,
+  WASIO_SOCKOPT_RCVBUF = 5
+};
+
+#define WASIO_EVENT_INITIALISER(max_events) \
+  ((struct wasio_event*)malloc(sizeof(struct wasio_event)*(max_events)))
+
 struct wasio_pollfd;
 
+#if WASIO_BACKEND == 3
+// The epoll backend registers interest once per vfd. The kernel
+// interest set is persistent, whilst `wanted` records the events a
+// vfd is currently waiting for; `wasio_poll` only reports the latter.
+struct wasio_pollfd {
+  uint32_t capacity;
+  uint32_t length;
+  int32_t epfd;
+  freelist_t fl;
+  int32_t *fds;       // vfd -> host fd
+  uint32_t *interest; // vfd -> events registered with the host
+  uint32_t *wanted;   // vfd -> events awaited by the guest
+};
+
+static_assert(sizeof(int) == 4, "size of int");
+static_assert(sizeof(int32_t) == 4, "size of int32_t");
+static_assert(sizeof(struct host_epoll_event) == sizeof(struct wasio_event), "size of struct wasio_event");
+
+#define WASIO_EVENT_FOREACH(wfd, ev, nready, vfd, revents, ...) \
+  for (uint32_t _wasio_i = 0; _wasio_i < (nready); _wasio_i++) { \
+    wasio_fd_t vfd = (ev)[_wasio_i].vfd; \
+    uint32_t revents = (ev)[_wasio_i].revents; \
+    __VA_ARGS__ \
+  }
+#else
+// The entries are packed at the front of `fds`, as poll wants them, and
+// `slots` maps a vfd, which is its host fd, to its entry.
 struct wasio_pollfd {
   uint32_t capacity;
   uint32_t length;
   struct pollfd *fds;
+  uint32_t *slots;  // vfd -> entry in `fds`, or UINT32_MAX
+  uint32_t nslots;
 };
 
+// NOTE(dhil): A table set up this way has a fixed capacity, as its
+// entries are not on the heap; see `wasio_reserve`. The slot index
+// still grows on demand.
 #define WASIO_STATIC_INITIALIZER(wfd, max_conns) \
   static struct pollfd _wasio_fds[max_conns]; \
   static struct wasio_pollfd (wfd) = (struct wasio_pollfd) { \
-    .capacity = (max_conns), .length = 0, .fds = _wasio_fds  \
+    .capacity = (max_conns), .length = 0, .fds = _wasio_fds, .slots = NULL, .nslots = 0 \
   }
 
 static_assert(sizeof(int) == 4, "size of int");
 static_assert(sizeof(int32_t) == 4, "size of int32_t");
 static_assert(sizeof(struct pollfd*) == 4, "pointer width");
-static_assert(sizeof(struct wasio_pollfd) == 12, "size of struct wasio_pollfd");
+static_assert(sizeof(struct wasio_pollfd) == 20, "size of struct wasio_pollfd");
 static_assert(offsetof(struct wasio_pollfd, capacity) == 0, "offset of capacity");
 static_assert(offsetof(struct wasio_pollfd, length) == 4, "offset of length");
 static_assert(offsetof(struct wasio_pollfd, fds) == 8, "offset of fds");
+static_assert(offsetof(struct wasio_pollfd, slots) == 12, "offset of slots");
 
-// Virtual file descriptor.
-typedef int32_t wasio_fd_t;
+// Interest is one-shot: the events delivered for an entry are dropped
+// from its interest, and an entry without interest is disarmed by
+// complementing its fd, which poll skips, until it is re-armed by
+// `wasio_notify_recv` or `wasio_notify_send`. Otherwise poll would
+// report e.g. writability or a hangup on every call.
+static inline void wasio_disarm(struct pollfd *pfd, uint32_t revents) {
+  pfd->events &= (short)~(revents & (WASIO_POLLIN | WASIO_POLLOUT));
+  if ((revents & (WASIO_POLLERR | WASIO_POLLHUP | WASIO_POLLNVAL)) != 0) pfd->events = 0;
+  if (pfd->events == 0 && pfd->fd >= 0) pfd->fd = ~pfd->fd;
+}
+
+// NOTE(dhil): The poll backends do not fill the event array, instead
+// the ready entries are found by scanning the pollfd structure up to
+// the last of them. Like poll itself, this is linear in the number of
+// entries; the epoll backend only visits the ready vfds.
+#define WASIO_EVENT_FOREACH(wfd, ev, nready, vfd, revents, ...) \
+  for (uint32_t _wasio_i = ((void)(ev), 0), _wasio_n = (nready); _wasio_i < (wfd)->length && _wasio_n > 0; _wasio_i++) { \
+    if ((wfd)->fds[_wasio_i].revents == 0) continue; \
+    uint32_t revents = (uint16_t)(wfd)->fds[_wasio_i].revents; \
+    (wfd)->fds[_wasio_i].revents = 0; \
+    _wasio_n--; \
+    wasio_fd_t vfd = (wasio_fd_t)(wfd)->fds[_wasio_i].fd; \
+    wasio_disarm(&(wfd)->fds[_wasio_i], revents); \
+    __VA_ARGS__ \
+  }
+#endif
 
 typedef enum {
   WASIO_OK = 0,
   WASIO_ERROR = 1,
   WASIO_EFULL = 2,
   WASIO_EAGAIN = 3,
-  WASIO_ECONN = 4
+  WASIO_ECONN = 4,
+  WASIO_EINPROGRESS = 5
 } wasio_result_t;
 
 extern
 __wasm_export__("wasio_listen")
 wasio_result_t wasio_listen(struct wasio_pollfd *wfd, wasio_fd_t /* out */ *vfd, int32_t port, int32_t backlog);
 
+// Like `wasio_listen`, but applies `opts` to the listener.
+extern
+__wasm_export__("wasio_listen_ex")
+wasio_result_t wasio_listen_ex(struct wasio_pollfd *wfd, wasio_fd_t /* out */ *vfd, int32_t port, const struct wasio_listen_opts *opts);
+
+// Sets a single option on `vfd`.
+extern
+__wasm_export__("wasio_setsockopt")
+wasio_result_t wasio_setsockopt(struct wasio_pollfd *wfd, wasio_fd_t vfd, enum wasio_sockopt name, int32_t value);
+
 extern
 __wasm_export__("wasio_init")
 wasio_result_t wasio_init(struct wasio_pollfd *wfd, uint32_t capacity);
 
+// Makes room for at least `capacity` vfds in `wfd`, at least doubling
+// the table whenever it has to grow, such that growth is amortised.
+// Operations which create vfds report `WASIO_EFULL` once the table is
+// full rather than growing it themselves. Only tables set up by
+// `wasio_init` can grow.
+extern
+__wasm_export__("wasio_reserve")
+wasio_result_t wasio_reserve(struct wasio_pollfd *wfd, uint32_t capacity);
+
 extern
 __wasm_export__("wasio_finalize")
 void wasio_finalize(struct wasio_pollfd *wfd);
 
 extern
 __wasm_export__("wasio_pool")
-wasio_result_t wasio_poll(struct wasio_pollfd *wfd, uint32_t *nready, int32_t timeout);
+wasio_result_t wasio_poll(struct wasio_pollfd *wfd, struct wasio_event *ev, uint32_t max_events, uint32_t *nready, int32_t timeout);
 
 extern
 __wasm_export__("wasio_accept")
 wasio_result_t wasio_accept(struct wasio_pollfd *wfd, wasio_fd_t vfd, wasio_fd_t *new_conn);
 
+// Accepts up to `max` pending connections in a single hostcall. On
+// success `*naccepted` is positive and the new vfds are stored in
+// `new_conns`.
+extern
+__wasm_export__("wasio_accept_many")
+wasio_result_t wasio_accept_many(struct wasio_pollfd *wfd, wasio_fd_t vfd, wasio_fd_t *new_conns, uint32_t max, uint32_t *naccepted);
+
+// Connects to the IPv4 address `addr` on `port` without blocking. On
+// `WASIO_EINPROGRESS` the vfd is valid, but the connection only
+// completes once the vfd is writable; its outcome is then reported by
+// `wasio_connect_result`.
+extern
+__wasm_export__("wasio_connect")
+wasio_result_t wasio_connect(struct wasio_pollfd *wfd, wasio_fd_t /* out */ *vfd, const char *addr, int32_t port);
+
+extern
+__wasm_export__("wasio_connect_result")
+wasio_result_t wasio_connect_result(struct wasio_pollfd *wfd, wasio_fd_t vfd);
+
 extern
 __wasm_export__("wasio_recv")
 wasio_result_t wasio_recv(struct wasio_pollfd *wfd, wasio_fd_t vfd, uint8_t *buf, uint32_t len, uint32_t *recvlen);
@@ -87,7 +236,57 @@ extern
 __wasm_export__("wasio_send")
 wasio_result_t wasio_send(struct wasio_pollfd *wfd, wasio_fd_t vfd, uint8_t *buf, uint32_t len, uint32_t *sendlen);
 
+// Vectored variants of `wasio_recv` and `wasio_send`: the `iovcnt`
+// buffers of `iov` are transferred in a single hostcall. As with their
+// scalar counterparts, the transfer may be short.
+extern
+__wasm_export__("wasio_recvv")
+wasio_result_t wasio_recvv(struct wasio_pollfd *wfd, wasio_fd_t vfd, const struct wasio_iovec *iov, uint32_t iovcnt, uint32_t *recvlen);
+
+extern
+__wasm_export__("wasio_sendv")
+wasio_result_t wasio_sendv(struct wasio_pollfd *wfd, wasio_fd_t vfd, const struct wasio_iovec *iov, uint32_t iovcnt, uint32_t *sendlen);
+
+// Opens the host file at `path` read-only. The resulting vfd is only
+// meant as a source for `wasio_sendfile`; it is never polled.
+extern
+__wasm_export__("wasio_open")
+wasio_result_t wasio_open(struct wasio_pollfd *wfd, const char *path, wasio_fd_t /* out */ *vfd);
+
+// Creates a nonblocking pipe, e.g. to splice between two sockets.
+extern
+__wasm_export__("wasio_pipe")
+wasio_result_t wasio_pipe(struct wasio_pollfd *wfd, wasio_fd_t /* out */ *rvfd, wasio_fd_t /* out */ *wvfd);
+
+// Sends up to `len` bytes of the file `file_vfd`, starting from
+// `offset`, to `vfd`. The bytes never enter linear memory.
+extern
+__wasm_export__("wasio_sendfile")
+wasio_result_t wasio_sendfile(struct wasio_pollfd *wfd, wasio_fd_t vfd, wasio_fd_t file_vfd, int64_t offset, uint32_t len, uint32_t *sendlen);
+
+// Moves up to `len` bytes from `in_vfd` to `out_vfd` within the host
+// kernel. One of the two must be a pipe end. Returns `WASIO_ECONN` if
+// `in_vfd` has reached end of file.
+extern
+__wasm_export__("wasio_splice")
+wasio_result_t wasio_splice(struct wasio_pollfd *wfd, wasio_fd_t in_vfd, wasio_fd_t out_vfd, uint32_t len, uint32_t *splicelen);
+
 extern
 __wasm_export__("wasio_close")
 wasio_result_t wasio_close(struct wasio_pollfd *wfd, wasio_fd_t vfd);
+
+extern
+__wasm_export__("wasio_notify_recv")
+wasio_result_t wasio_notify_recv(struct wasio_pollfd *wfd, wasio_fd_t vfd);
+
+extern
+__wasm_export__("wasio_notify_send")
+wasio_result_t wasio_notify_send(struct wasio_pollfd *wfd, wasio_fd_t vfd);
+
+// Drops the interest registered by `wasio_notify_recv` and
+// `wasio_notify_send`, e.g. once the waiter has given up. The vfd
+// stays open.
+extern
+__wasm_export__("wasio_notify_clear")
+wasio_result_t wasio_notify_clear(struct wasio_pollfd *wfd, wasio_fd_t vfd);
 #endif
@@ -0,0 +1,150 @@
+// A buffer pool. Every buffer carries a header in front of the data
+// proper, which records its size class and reference count, and links
+// it into the idle list of its class whilst pooled. Recycling the most
+// recently released buffer first keeps the working set warm.
+#include <assert.h>
+#include <buf_pool.h>
+#include <stdalign.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// The class of buffers which bypass the pool.
+#define UNPOOLED BUF_POOL_NCLASSES
+
+struct buf {
+  struct buf *next; // next idle buffer of the same class
+  uint32_t klass;
+  uint32_t size;
+  uint32_t refs;
+  alignas(max_align_t) unsigned char data[];
+};
+
+struct size_class {
+  struct buf *idle;
+  uint32_t nidle;
+  int32_t in_use;
+  int32_t high_water;
+  uint64_t acquired;
+  uint64_t misses;
+};
+
+struct buf_pool {
+  uint32_t cap;
+  struct size_class classes[BUF_POOL_NCLASSES];
+};
+
+static inline struct buf* header(const void *buf) {
+  return (struct buf*)((const unsigned char*)buf - offsetof(struct buf, data));
+}
+
+// The smallest class which fits `size` bytes.
+static inline uint32_t class_of(uint32_t size) {
+  if (size <= (UINT32_C(1) << BUF_POOL_MIN_SHIFT)) return 0;
+  uint32_t shift = 32 - (uint32_t)__builtin_clz(size - 1);
+  return shift > BUF_POOL_MAX_SHIFT ? UNPOOLED : shift - BUF_POOL_MIN_SHIFT;
+}
+
+static struct buf* buf_new(uint32_t klass, uint32_t size) {
+  struct buf *b = (struct buf*)malloc(sizeof(struct buf) + size);
+  if (b == NULL) return NULL;
+  b->next = NULL;
+  b->klass = klass;
+  b->size = size;
+  return b;
+}
+
+buf_pool_result_t buf_pool_new(uint32_t cap, buf_pool_t *pool) {
+  struct buf_pool *bp = (struct buf_pool*)calloc(1, sizeof(struct buf_pool));
+  if (bp == NULL) return BUF_POOL_MEM_ERR;
+  bp->cap = cap;
+  *pool = bp;
+  return BUF_POOL_OK;
+}
+
+void buf_pool_delete(buf_pool_t pool) {
+  for (uint32_t i = 0; i < BUF_POOL_NCLASSES; i++) {
+    struct buf *b = pool->classes[i].idle;
+    while (b != NULL) {
+      struct buf *next = b->next;
+      free(b);
+      b = next;
+    }
+  }
+  free(pool);
+}
+
+void* buf_pool_acquire(buf_pool_t pool, uint32_t size) {
+  uint32_t klass = class_of(size);
+  struct buf *b = NULL;
+  if (klass == UNPOOLED) {
+    b = buf_new(UNPOOLED, size);
+  } else if (pool == NULL) {
+    b = buf_new(klass, UINT32_C(1) << (klass + BUF_POOL_MIN_SHIFT));
+  } else {
+    struct size_class *sc = &pool->classes[klass];
+    if (sc->idle != NULL) {
+      b = sc->idle;
+      sc->idle = b->next;
+      sc->nidle--;
+    } else {
+      b = buf_new(klass, UINT32_C(1) << (klass + BUF_POOL_MIN_SHIFT));
+      if (b == NULL) return NULL;
+      sc->misses++;
+    }
+    sc->acquired++;
+    if (++sc->in_use > sc->high_water) sc->high_water = sc->in_use;
+  }
+  if (b == NULL) return NULL;
+  b->next = NULL;
+  b->refs = 1;
+  return b->data;
+}
+
+uint32_t buf_pool_capacity(const void *buf) {
+  return header(buf)->size;
+}
+
+void buf_pool_retain(void *buf) {
+  struct buf *b = header(buf);
+  assert(__atomic_load_n(&b->refs, __ATOMIC_RELAXED) > 0);
+  __atomic_add_fetch(&b->refs, 1, __ATOMIC_RELAXED);
+}
+
+void buf_pool_release(buf_pool_t pool, void *buf) {
+  struct buf *b = header(buf);
+  assert(__atomic_load_n(&b->refs, __ATOMIC_RELAXED) > 0);
+  // NOTE(dhil): The release ordering publishes our writes to the
+  // buffer to whoever drops the last reference, and the acquire
+  // ordering makes them visible to it before reuse.
+  if (__atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) != 0) return;
+  if (b->klass == UNPOOLED || pool == NULL) {
+    free(b);
+    return;
+  }
+  struct size_class *sc = &pool->classes[b->klass];
+  sc->in_use--;
+  if (sc->nidle < pool->cap) {
+    b->next = sc->idle;
+    sc->idle = b;
+    sc->nidle++;
+  } else {
+    free(b);
+  }
+}
+
+void buf_pool_stats(buf_pool_t pool, struct buf_pool_stats stats[BUF_POOL_NCLASSES]) {
+  for (uint32_t i = 0; i < BUF_POOL_NCLASSES; i++) {
+    const struct size_class *sc = &pool->classes[i];
+    stats[i] = (struct buf_pool_stats){
+      .size = UINT32_C(1) << (i + BUF_POOL_MIN_SHIFT),
+      .idle = sc->nidle,
+      .in_use = sc->in_use,
+      .high_water = sc->high_water,
+      .acquired = sc->acquired,
+      .misses = sc->misses,
+    };
+  }
+}
+
+#undef UNPOOLED
@@ -0,0 +1,41 @@
+// Fiber-local storage. Every block carries its size in a header in
+// front of the storage proper.
+#include <fiber_local.h>
+#include <stdalign.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+struct fiber_local {
+  size_t size;
+  alignas(max_align_t) unsigned char data[];
+};
+
+static _Thread_local void *current = NULL;
+
+static inline struct fiber_local* header(const void *local) {
+  return (struct fiber_local*)((const unsigned char*)local - offsetof(struct fiber_local, data));
+}
+
+void* fiber_local_new(size_t size) {
+  struct fiber_local *fl = (struct fiber_local*)calloc(1, sizeof(struct fiber_local) + size);
+  if (fl == NULL) return NULL;
+  fl->size = size;
+  return fl->data;
+}
+
+void fiber_local_delete(void *local) {
+  if (local == NULL) return;
+  free(header(local));
+}
+
+size_t fiber_local_size(const void *local) {
+  return header(local)->size;
+}
+
+void fiber_local_install(void *local) {
+  current = local;
+}
+
+void* fiber_local(void) {
+  return current;
+}
@@ -0,0 +1,108 @@
+// A fiber pool. fiber-c has no means to restart a fiber, so every
+// pooled fiber runs a trampoline which loops over jobs: it runs the
+// entry point of its current job, and then yields to await the next
+// one. Thus a recycled fiber keeps its stack, which is already
+// allocated and paged in.
+#include <assert.h>
+#include <fiber.h>
+#include <fiber_pool.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+const char fiber_pool_finished_token = 0;
+
+struct pooled_fiber {
+  struct fiber_pool *pool;
+  fiber_t fiber;
+  fiber_entry_point_t entry;
+  void *arg;
+};
+
+struct fiber_pool {
+  uint32_t cap;
+  uint32_t nidle;
+  // The fiber which last yielded FIBER_POOL_FINISHED.
+  struct pooled_fiber *finished;
+  struct pooled_fiber *idle[];
+};
+
+static void* trampoline(void *arg) {
+  struct pooled_fiber *self = (struct pooled_fiber*)arg;
+  while (true) {
+    (void)self->entry(self->arg);
+    self->pool->finished = self;
+    // NOTE(dhil): The owner resumes us with our own descriptor once it
+    // hands us out again.
+    self = (struct pooled_fiber*)fiber_yield(FIBER_POOL_FINISHED);
+  }
+  return NULL;
+}
+
+static struct pooled_fiber* pooled_fiber_new(struct fiber_pool *pool) {
+  struct pooled_fiber *pf = (struct pooled_fiber*)malloc(sizeof(struct pooled_fiber));
+  if (pf == NULL) return NULL;
+  pf->fiber = fiber_alloc(trampoline);
+  if (pf->fiber == NULL) {
+    free(pf);
+    return NULL;
+  }
+  pf->pool = pool;
+  pf->entry = NULL;
+  pf->arg = NULL;
+  return pf;
+}
+
+static void pooled_fiber_delete(struct pooled_fiber *pf) {
+  fiber_free(pf->fiber);
+  free(pf);
+}
+
+fiber_pool_result_t fiber_pool_new(uint32_t warm, uint32_t cap, fiber_pool_t *pool) {
+  if (warm > cap) warm = cap;
+  struct fiber_pool *fp = (struct fiber_pool*)malloc(sizeof(struct fiber_pool) + cap * sizeof(struct pooled_fiber*));
+  if (fp == NULL) return FIBER_POOL_MEM_ERR;
+  fp->cap = cap;
+  fp->nidle = 0;
+  fp->finished = NULL;
+  for (uint32_t i = 0; i < warm; i++) {
+    struct pooled_fiber *pf = pooled_fiber_new(fp);
+    if (pf == NULL) {
+      fiber_pool_delete(fp);
+      return FIBER_POOL_MEM_ERR;
+    }
+    fp->idle[fp->nidle++] = pf;
+  }
+  *pool = fp;
+  return FIBER_POOL_OK;
+}
+
+void fiber_pool_delete(fiber_pool_t pool) {
+  for (uint32_t i = 0; i < pool->nidle; i++)
+    pooled_fiber_delete(pool->idle[i]);
+  free(pool);
+}
+
+fiber_t fiber_pool_acquire(fiber_pool_t pool, fiber_entry_point_t entry, void *arg, void **start) {
+  // Prefer the most recently released fiber, as its stack is most
+  // likely to still be warm.
+  struct pooled_fiber *pf = pool->nidle > 0 ? pool->idle[--pool->nidle] : pooled_fiber_new(pool);
+  if (pf == NULL) return NULL;
+  pf->entry = entry;
+  pf->arg = arg;
+  *start = pf;
+  return pf->fiber;
+}
+
+void fiber_pool_release(fiber_pool_t pool, fiber_t fiber) {
+  struct pooled_fiber *pf = pool->finished;
+  assert(pf != NULL && pf->fiber == fiber);
+  (void)fiber;
+  pool->finished = NULL;
+  pf->entry = NULL;
+  pf->arg = NULL;
+  if (pool->nidle < pool->cap)
+    pool->idle[pool->nidle++] = pf;
+  else
+    pooled_fiber_delete(pf);
+}
@@ -1,114 +1,133 @@
+// A two-level bitmap. A set bit in a leaf word marks a free entry,
+// and a set bit in a summary word marks a leaf word with at least one
+// free entry. Hence finding a free entry inspects one summary word per
+// 4096 entries at worst, and usually just one. Bits past the last
+// entry are always clear, such that they are never handed out.
 // TODO(dhil): Perhaps make this a header only library to enable
 // static allocation of freelists.
 #include <assert.h>
 #include <freelist.h>
-#include <limits.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
-#include <stdio.h>
-
-static const int32_t int_width = 32;
-#if UINT_MAX == UINT32_MAX
-#define MASK_HIGH32(X) X
-#elif UINT_MAX == UINT64_MAX
-#define MASK_HIGH32(X) (X & 0x00000000_FFFFFFFF)
-#else
-#error "unsupported integer type: the bit width of int must be either 32 or 64"
-#endif
+#define WORD_BITS 64
 
 struct freelist {
   uint32_t size; // number of elements managed by the freelist
-  uint32_t len; // length of the bitvector
-  uint32_t vector[];
+  uint32_t nleaves; // number of leaf words
+  uint32_t nsummary; // number of summary words
+  uint32_t cursor; // where the next search starts, if rotating
+  bool rotate;
+  uint64_t words[]; // the leaf words, followed by the summary words
 };
 
-static inline uint32_t calc_vector_len(uint32_t freespace) {
-  return freespace % int_width == 0 ? freespace / int_width : freespace / int_width + 1;
+static inline uint32_t words_for(uint32_t bits) {
+  return bits / WORD_BITS + (bits % WORD_BITS != 0);
+}
+
+static inline uint64_t* summary(freelist_t fl) {
+  return fl->words + fl->nleaves;
+}
+
+static inline void summary_set(freelist_t fl, uint32_t leaf) {
+  summary(fl)[leaf / WORD_BITS] |= UINT64_C(1) << (leaf % WORD_BITS);
+}
+
+static inline void summary_clear(freelist_t fl, uint32_t leaf) {
+  summary(fl)[leaf / WORD_BITS] &= ~(UINT64_C(1) << (leaf % WORD_BITS));
+}
+
+static freelist_t alloc(uint32_t freespace) {
+  uint32_t nleaves = words_for(freespace);
+  uint32_t nsummary = words_for(nleaves);
+  freelist_t fl = (freelist_t)calloc(1, sizeof(struct freelist) + sizeof(uint64_t) * (nleaves + nsummary));
+  if (fl == NULL) return NULL;
+  fl->size = freespace;
+  fl->nleaves = nleaves;
+  fl->nsummary = nsummary;
+  return fl;
+}
+
+// Marks the entries in [`from`, `to`) as free. The summary is left
+// untouched.
+static void set_range(freelist_t fl, uint32_t from, uint32_t to) {
+  for (uint32_t i = from; i < to && i % WORD_BITS != 0; i++)
+    fl->words[i / WORD_BITS] |= UINT64_C(1) << (i % WORD_BITS);
+  uint32_t i = from % WORD_BITS == 0 ? from : (from / WORD_BITS + 1) * WORD_BITS;
+  for (; i + WORD_BITS <= to; i += WORD_BITS)
+    fl->words[i / WORD_BITS] = UINT64_MAX;
+  for (; i < to; i++)
+    fl->words[i / WORD_BITS] |= UINT64_C(1) << (i % WORD_BITS);
 }
 
-/* static void print_freelist(const freelist_t freelist) { */
-/*   for (uint32_t i = 0; i < freelist->len; i++) { */
-/*     printf("0b%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d\n", */
-/*            (freelist->vector[i] & (1 << 31)) >> 31, */
-/*            (freelist->vector[i] & (1 << 30)) >> 30, */
-/*            (freelist->vector[i] & (1 << 29)) >> 29, */
-/*            (freelist->vector[i] & (1 << 28)) >> 28, */
-/*            (freelist->vector[i] & (1 << 27)) >> 27, */
-/*            (freelist->vector[i] & (1 << 26)) >> 26, */
-/*            (freelist->vector[i] & (1 << 25)) >> 25, */
-/*            (freelist->vector[i] & (1 << 24)) >> 24, */
-/*            (freelist->vector[i] & (1 << 23)) >> 23, */
-/*            (freelist->vector[i] & (1 << 22)) >> 22, */
-/*            (freelist->vector[i] & (1 << 21)) >> 21, */
-/*            (freelist->vector[i] & (1 << 20)) >> 20, */
-/*            (freelist->vector[i] & (1 << 19)) >> 19, */
-/*            (freelist->vector[i] & (1 << 18)) >> 18, */
-/*            (freelist->vector[i] & (1 << 17)) >> 17, */
-/*            (freelist->vector[i] & (1 << 16)) >> 16, */
-/*            (freelist->vector[i] & (1 << 15)) >> 15, */
-/*            (freelist->vector[i] & (1 << 14)) >> 14, */
-/*            (freelist->vector[i] & (1 << 13)) >> 13, */
-/*            (freelist->vector[i] & (1 << 12)) >> 12, */
-/*            (freelist->vector[i] & (1 << 11)) >> 11, */
-/*            (freelist->vector[i] & (1 << 10)) >> 10, */
-/*            (freelist->vector[i] & (1 << 9)) >> 9, */
-/*             (freelist->vector[i] & (1 << 8)) >> 8, */
-/*             (freelist->vector[i] & (1 << 7)) >> 7, */
-/*             (freelist->vector[i] & (1 << 6)) >> 6, */
-/*             (freelist->vector[i] & (1 << 5)) >> 5, */
-/*             (freelist->vector[i] & (1 << 4)) >> 4, */
-/*             (freelist->vector[i] & (1 << 3)) >> 3, */
-/*             (freelist->vector[i] & (1 << 2)) >> 2, */
-/*             (freelist->vector[i] & (1 << 1)) >> 1, */
-/*             (freelist->vector[i] & (1))); */
-/*   } */
-/* } */
+static void rebuild_summary(freelist_t fl) {
+  memset(summary(fl), 0, sizeof(uint64_t) * fl->nsummary);
+  for (uint32_t leaf = 0; leaf < fl->nleaves; leaf++)
+    if (fl->words[leaf] != 0) summary_set(fl, leaf);
+}
+
+// Finds the first free entry at or after `start`.
+static bool find_from(freelist_t fl, uint32_t start, uint32_t *entry) {
+  if (start >= fl->size) return false;
+  uint32_t leaf = start / WORD_BITS;
+  uint64_t word = fl->words[leaf] & (UINT64_MAX << (start % WORD_BITS));
+  if (word == 0) {
+    // Consult the summary for the next leaf with a free entry.
+    if (++leaf == fl->nleaves) return false;
+    uint32_t s = leaf / WORD_BITS;
+    uint64_t sword = summary(fl)[s] & (UINT64_MAX << (leaf % WORD_BITS));
+    while (sword == 0) {
+      if (++s == fl->nsummary) return false;
+      sword = summary(fl)[s];
+    }
+    leaf = s * WORD_BITS + (uint32_t)__builtin_ctzll(sword);
+    word = fl->words[leaf];
+    assert(word != 0);
+  }
+  *entry = leaf * WORD_BITS + (uint32_t)__builtin_ctzll(word);
+  return true;
+}
 
 freelist_result_t freelist_new(uint32_t freespace /* must be a positive number */, freelist_t *fl) {
   if (freespace == 0) return FREELIST_SIZE_ERR;
-  uint32_t len = calc_vector_len(freespace);
-  *fl = (freelist_t)malloc(sizeof(struct freelist) + sizeof(uint32_t[len]));
-  if (*fl == NULL) return FREELIST_MEM_ERR;
-  (*fl)->size = freespace;
-  (*fl)->len = len;
-  memset((*fl)->vector, MASK_HIGH32(UINT32_MAX), sizeof(uint32_t) * len); // all ones initialised
+  freelist_t new_fl = alloc(freespace);
+  if (new_fl == NULL) return FREELIST_MEM_ERR;
+  set_range(new_fl, 0, freespace);
+  rebuild_summary(new_fl);
+  *fl = new_fl;
   return FREELIST_OK;
 }
 
 freelist_result_t freelist_next(freelist_t freelist, uint32_t *entry) {
-  /* printf("[freelist_next] %d/%d\n", freelist->len, freelist->size); */
-  for (uint32_t i = 0; i < freelist->len; i++) {
-    int32_t ans = (uint32_t)__builtin_ffs(MASK_HIGH32(freelist->vector[i]));
-    // TODO(dhil): Consider simplifying such that the minimum size is
-    // 32, and the length is a multiple of 32.
-    if (ans > 0 && (ans - (uint32_t)1) < freelist->size) {
-      uint32_t index = ans - 1;
-      freelist->vector[i] &= ~(1 << index);
-      *entry = index + (int_width * i);
-      /* printf("Found index: %d, ans: %d, i: %u, length: %u, size: %u\n", (int)*entry, ans, i, freelist->len, freelist->size); */
-      /* fflush(stdout); */
-      return FREELIST_OK;
-    }
+  uint32_t index;
+  if (!find_from(freelist, freelist->rotate ? freelist->cursor : 0, &index)) {
+    if (!freelist->rotate || freelist->cursor == 0 || !find_from(freelist, 0, &index))
+      return FREELIST_FULL;
   }
-  return FREELIST_FULL;
+  uint32_t leaf = index / WORD_BITS;
+  freelist->words[leaf] &= ~(UINT64_C(1) << (index % WORD_BITS));
+  if (freelist->words[leaf] == 0) summary_clear(freelist, leaf);
+  freelist->cursor = index + 1 < freelist->size ? index + 1 : 0;
+  *entry = index;
+  return FREELIST_OK;
 }
 
 freelist_result_t freelist_reclaim(freelist_t freelist, uint32_t entry) {
-  /* printf("[freelist_reclaim] %d\n", entry); */
-  /* print_freelist(freelist); */
   if (entry >= freelist->size) {
     return FREELIST_OB_ENTRY;
   }
-  uint32_t v_index = entry / int_width;
-  uint32_t b_index = entry - (int_width * v_index);
-  freelist->vector[v_index] |= 1 << b_index;
-  /* printf("[freelist_reclaim] cont'd\n"); */
-  /* print_freelist(freelist); */
+  uint32_t leaf = entry / WORD_BITS;
+  freelist->words[leaf] |= UINT64_C(1) << (entry % WORD_BITS);
+  summary_set(freelist, leaf);
   return FREELIST_OK;
 }
 
+void freelist_rotate(freelist_t freelist, bool rotate) {
+  freelist->rotate = rotate;
+}
+
 void freelist_delete(freelist_t freelist) {
   free(freelist);
   freelist = NULL;
@@ -116,10 +135,23 @@ void freelist_delete(freelist_t freelist) {
 
 freelist_result_t freelist_resize(freelist_t *freelist, uint32_t freespace) {
   if (freespace == 0) return FREELIST_SIZE_ERR;
-  uint32_t new_len = calc_vector_len(freespace);
-  *freelist = (freelist_t)realloc(*freelist, sizeof(struct freelist) + sizeof(uint32_t[new_len]));
-  if (*freelist == NULL) return FREELIST_MEM_ERR;
-  (*freelist)->len = new_len;
-  (*freelist)->size = freespace;
+  freelist_t old = *freelist;
+  freelist_t fl = alloc(freespace);
+  if (fl == NULL) return FREELIST_MEM_ERR;
+  // Entries carry over; new entries are free, and entries beyond the
+  // new size are dropped.
+  memcpy(fl->words, old->words, sizeof(uint64_t) * (old->nleaves < fl->nleaves ? old->nleaves : fl->nleaves));
+  if (freespace > old->size) {
+    set_range(fl, old->size, freespace);
+  } else if (freespace % WORD_BITS != 0) {
+    fl->words[fl->nleaves - 1] &= (UINT64_C(1) << (freespace % WORD_BITS)) - 1;
+  }
+  rebuild_summary(fl);
+  fl->rotate = old->rotate;
+  fl->cursor = old->cursor < freespace ? old->cursor : 0;
+  free(old);
+  *freelist = fl;
   return FREELIST_OK;
 }
+
+#undef WORD_BITS
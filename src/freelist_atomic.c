@@ -0,0 +1,84 @@
+// A concurrent single-level bitmap. A set bit marks a free entry, and
+// bits past the last entry are always clear. There is no summary level,
+// as keeping it in sync would need a second atomic per operation;
+// instead every thread caches the word it last took an entry from or
+// returned an entry to, and resumes its search there.
+#include <assert.h>
+#include <freelist.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define WORD_BITS 64
+
+struct freelist_atomic {
+  uint32_t size; // number of elements managed by the freelist
+  uint32_t nwords;
+  uint64_t words[];
+};
+
+// The word at which the calling thread starts its next search, modulo
+// the number of words, or UINT32_MAX if it is yet to search.
+static _Thread_local uint32_t hint = UINT32_MAX;
+// Spreads the first hints of the threads over the words.
+static uint32_t seed = 0;
+
+static inline uint32_t start_word(freelist_atomic_t fl) {
+  if (hint == UINT32_MAX)
+    hint = __atomic_fetch_add(&seed, 1, __ATOMIC_RELAXED) * UINT32_C(0x9E3779B1);
+  return hint % fl->nwords;
+}
+
+freelist_result_t freelist_atomic_new(uint32_t freespace /* must be a positive number */, freelist_atomic_t *fl) {
+  if (freespace == 0) return FREELIST_SIZE_ERR;
+  uint32_t nwords = freespace / WORD_BITS + (freespace % WORD_BITS != 0);
+  freelist_atomic_t new_fl = (freelist_atomic_t)malloc(sizeof(struct freelist_atomic) + sizeof(uint64_t) * nwords);
+  if (new_fl == NULL) return FREELIST_MEM_ERR;
+  new_fl->size = freespace;
+  new_fl->nwords = nwords;
+  for (uint32_t i = 0; i < nwords; i++) new_fl->words[i] = UINT64_MAX;
+  if (freespace % WORD_BITS != 0)
+    new_fl->words[nwords - 1] = (UINT64_C(1) << (freespace % WORD_BITS)) - 1;
+  *fl = new_fl;
+  return FREELIST_OK;
+}
+
+freelist_result_t freelist_atomic_next(freelist_atomic_t freelist, uint32_t *entry) {
+  uint32_t start = start_word(freelist);
+  for (uint32_t i = 0; i < freelist->nwords; i++) {
+    uint32_t w = start + i < freelist->nwords ? start + i : start + i - freelist->nwords;
+    uint64_t word = __atomic_load_n(&freelist->words[w], __ATOMIC_RELAXED);
+    while (word != 0) {
+      uint64_t bit = word & (~word + 1);
+      // NOTE(dhil): Whoever clears the bit owns the entry. Should we
+      // lose the race, then the previous value is a fresh view of the
+      // word to retry with.
+      uint64_t prev = __atomic_fetch_and(&freelist->words[w], ~bit, __ATOMIC_ACQUIRE);
+      if ((prev & bit) != 0) {
+        hint = w;
+        *entry = w * WORD_BITS + (uint32_t)__builtin_ctzll(bit);
+        return FREELIST_OK;
+      }
+      word = prev;
+    }
+  }
+  return FREELIST_FULL;
+}
+
+freelist_result_t freelist_atomic_reclaim(freelist_atomic_t freelist, uint32_t entry) {
+  if (entry >= freelist->size) {
+    return FREELIST_OB_ENTRY;
+  }
+  uint64_t bit = UINT64_C(1) << (entry % WORD_BITS);
+  uint64_t prev = __atomic_fetch_or(&freelist->words[entry / WORD_BITS], bit, __ATOMIC_RELEASE);
+  assert((prev & bit) == 0); // double reclaim
+  (void)prev;
+  // The entry is likely still in the cache of the calling thread.
+  hint = entry / WORD_BITS;
+  return FREELIST_OK;
+}
+
+void freelist_atomic_delete(freelist_atomic_t freelist) {
+  free(freelist);
+}
+
+#undef WORD_BITS
@@ -0,0 +1,161 @@
+// Host-defined epoll implementation
+
+#include <assert.h>
+#include <errno.h>
+#include <host/driver/epoll.h>
+#include <host/wasmtime_utils.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <wasm.h>
+#include <wasmtime.h>
+
+// The guest-side representation of a ready event: the vfd registered
+// as user data along with the returned events.
+struct guest_epoll_event {
+  int32_t vfd;
+  uint32_t revents;
+};
+
+static_assert(sizeof(struct guest_epoll_event) == 8, "size of struct guest_epoll_event");
+static_assert(offsetof(struct guest_epoll_event, vfd) == 0, "offset of vfd");
+static_assert(offsetof(struct guest_epoll_event, revents) == 4, "offset of revents");
+// NOTE(dhil): The guest uses the poll(2) event bits interchangeably
+// with the epoll(7) event bits.
+static_assert(EPOLLIN == POLLIN, "EPOLLIN == POLLIN");
+static_assert(EPOLLOUT == POLLOUT, "EPOLLOUT == POLLOUT");
+static_assert(EPOLLERR == POLLERR, "EPOLLERR == POLLERR");
+static_assert(EPOLLHUP == POLLHUP, "EPOLLHUP == POLLHUP");
+
+// Upper bound on the number of events reaped per `wait`.
+#define HOST_EPOLL_MAX_EVENTS 1024
+
+static wasm_functype_t *create_sig = NULL;  // i32 -> i32
+
+static wasm_functype_t *ctl_sig = NULL;  // i32 i32 i32 i32 i32 i32 -> i32
+
+static wasm_functype_t *wait_sig = NULL;  // i32 i32 i32 i32 i32 -> i32
+
+static atomic_bool stopping = false;
+
+DEFINE_BINDING(host_epoll_create) {
+  BINDING_ARITY(1, 1);
+
+  int ans = epoll_create1(EPOLL_CLOEXEC);
+
+  if (ans < 0) {
+    WRITE_ERRNO("host_epoll_create", 0);
+  }
+
+  RETURN_I32(ans);
+}
+
+DEFINE_BINDING(host_epoll_ctl) {
+  BINDING_ARITY(6, 1);
+
+  // Unpack epoll fd, operation, target fd, events, and user data.
+  int32_t epfd = ARG_I32(0);
+  int32_t op = ARG_I32(1);
+  int32_t fd = ARG_I32(2);
+  uint32_t events = ARG_U32(3);
+  int32_t vfd = ARG_I32(4);
+
+  struct epoll_event ev = { .events = events, .data = { .u64 = 0 } };
+  ev.data.u32 = (uint32_t)vfd;
+
+  // Perform the system call.
+  int ans = epoll_ctl((int)epfd, (int)op, (int)fd, &ev);
+
+  if (ans < 0) {
+    WRITE_ERRNO("host_epoll_ctl", 5);
+  }
+
+  RETURN_I32(ans);
+}
+
+DEFINE_BINDING(host_epoll_wait) {
+  BINDING_ARITY(5, 1);
+
+  // Unpack epoll fd, event buffer offset, capacity, and timeout.
+  int32_t epfd = ARG_I32(0);
+  uint32_t eoffset = ARG_U32(1);
+  uint32_t maxevents = ARG_U32(2);
+  int32_t timeout = ARG_I32(3);
+
+  if (maxevents == 0) {
+    errno = EINVAL;
+    WRITE_ERRNO("host_epoll_wait", 4);
+    RETURN_I32(-1);
+  }
+  if (maxevents > HOST_EPOLL_MAX_EVENTS) maxevents = HOST_EPOLL_MAX_EVENTS;
+
+  // Perform the system call.
+  struct epoll_event evs[HOST_EPOLL_MAX_EVENTS];
+  struct timespec deadline = host_wait_deadline(timeout);
+  int ans;
+  do {
+    if (atomic_load(&stopping)) {
+      errno = EINTR;
+      ans = -1;
+      break;
+    }
+    ans = epoll_wait((int)epfd, evs, (int)maxevents, host_wait_slice(timeout, &deadline));
+  } while (ans == 0 && host_wait_slice(timeout, &deadline) > 0);
+
+  if (ans < 0) {
+    WRITE_ERRNO("host_epoll_wait", 4);
+    RETURN_I32(ans);
+  }
+
+  // Compact the ready set into the guest buffer.
+  uint8_t *mem;
+  LOAD_MEMORY(mem, "host_epoll_wait");
+  struct guest_epoll_event *gevs = (struct guest_epoll_event*)(mem+eoffset);
+  for (int i = 0; i < ans; i++) {
+    gevs[i] = (struct guest_epoll_event){ .vfd = (int32_t)evs[i].data.u32, .revents = evs[i].events };
+  }
+
+  RETURN_I32(ans);
+}
+
+wasmtime_error_t* host_epoll_init(wasmtime_linker_t *linker, const char *export_module) {
+  wasmtime_error_t *error = NULL;
+
+  if (create_sig == NULL) {
+    create_sig = wasm_functype_new_1_1(NEW_WASM_I32, NEW_WASM_I32);
+  }
+  LINK_HOST_FN("create", create_sig, host_epoll_create);
+
+  if (ctl_sig == NULL) {
+    ctl_sig = wasm_functype_new_6_1(NEW_WASM_I32, NEW_WASM_I32, NEW_WASM_I32, NEW_WASM_I32, NEW_WASM_I32, NEW_WASM_I32, NEW_WASM_I32);
+  }
+  LINK_HOST_FN("ctl", ctl_sig, host_epoll_ctl);
+
+  if (wait_sig == NULL) {
+    wait_sig = wasm_functype_new_5_1(NEW_WASM_I32, NEW_WASM_I32, NEW_WASM_I32, NEW_WASM_I32, NEW_WASM_I32, NEW_WASM_I32);
+  }
+  LINK_HOST_FN("wait", wait_sig, host_epoll_wait);
+
+  return error;
+}
+
+void host_epoll_shutdown(void) {
+  atomic_store(&stopping, true);
+}
+
+void host_epoll_delete(void) {
+  wasm_functype_delete(create_sig);
+  create_sig = NULL;
+
+  wasm_functype_delete(ctl_sig);
+  ctl_sig = NULL;
+
+  wasm_functype_delete(wait_sig);
+  wait_sig = NULL;
+}
+
+#undef HOST_EPOLL_MAX_EVENTS
@@ -0,0 +1,159 @@
+// Precompiled module cache
+
+#include <assert.h>
+#include <host/driver/module_cache.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <wasm.h>
+#include <wasmtime.h>
+
+#define CWASM_SUFFIX ".cwasm"
+#define HASH_SUFFIX ".cwasm.hash"
+
+wasm_config_t* host_engine_config_new(void) {
+  wasm_config_t *config = wasm_config_new();
+  assert(config != NULL);
+#if defined DEBUG
+  wasmtime_config_debug_info_set(config, true);
+#endif
+  wasmtime_config_wasm_function_references_set(config, true);
+  wasmtime_config_wasm_exceptions_set(config, true);
+  wasmtime_config_wasm_typed_continuations_set(config, true);
+  // NOTE(dhil): Reserving the whole 32-bit address space for every
+  // linear memory means that `memory.grow` never moves it, which the
+  // host ring thread relies on.
+  wasmtime_config_static_memory_maximum_size_set(config, UINT64_C(1) << 32);
+  return config;
+}
+
+// 64-bit FNV-1a.
+static uint64_t content_hash(const uint8_t *data, size_t len) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (uint64_t)data[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+static bool has_suffix(const char *s, const char *suffix) {
+  size_t n = strlen(s), m = strlen(suffix);
+  return n >= m && strcmp(s + n - m, suffix) == 0;
+}
+
+static char* concat(const char *prefix, const char *suffix) {
+  size_t n = strlen(prefix), m = strlen(suffix);
+  char *s = (char*)malloc(n + m + 1);
+  assert(s != NULL);
+  memcpy(s, prefix, n);
+  memcpy(s + n, suffix, m + 1);
+  return s;
+}
+
+static bool read_file(const char *path, wasm_byte_vec_t *bytes) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) return false;
+  fseek(file, 0L, SEEK_END);
+  long file_size = ftell(file);
+  if (file_size < 0) {
+    fclose(file);
+    return false;
+  }
+  wasm_byte_vec_new_uninitialized(bytes, (size_t)file_size);
+  fseek(file, 0L, SEEK_SET);
+  bool ok = file_size == 0 || fread(bytes->data, (size_t)file_size, 1, file) == 1;
+  fclose(file);
+  if (!ok) wasm_byte_vec_delete(bytes);
+  return ok;
+}
+
+static bool read_hash(const char *path, uint64_t *hash) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL) return false;
+  bool ok = fscanf(file, "%" SCNx64, hash) == 1;
+  fclose(file);
+  return ok;
+}
+
+// Writes via a temporary file and a rename, such that concurrent
+// readers never observe a partially written file.
+static bool write_file(const char *path, const void *data, size_t len) {
+  char suffix[32];
+  snprintf(suffix, sizeof(suffix), ".tmp.%ld", (long)getpid());
+  char *tmp = concat(path, suffix);
+  FILE *file = fopen(tmp, "wb");
+  bool ok = file != NULL;
+  if (ok) {
+    ok = len == 0 || fwrite(data, len, 1, file) == 1;
+    ok = fclose(file) == 0 && ok;
+  }
+  ok = ok && rename(tmp, path) == 0;
+  if (!ok) (void)remove(tmp);
+  free(tmp);
+  return ok;
+}
+
+static bool write_cache(wasmtime_module_t *module, const char *cwasm_path, const char *hash_path, uint64_t hash) {
+  wasm_byte_vec_t artifact;
+  wasmtime_error_t *error = wasmtime_module_serialize(module, &artifact);
+  if (error != NULL) {
+    wasmtime_error_delete(error);
+    return false;
+  }
+  // NOTE(dhil): The artifact is written before its hash, so a reader
+  // may observe a new artifact with a stale hash (and recompile), but
+  // never a stale artifact with a new hash.
+  bool ok = write_file(cwasm_path, artifact.data, artifact.size);
+  wasm_byte_vec_delete(&artifact);
+  if (!ok) return false;
+  char text[17];
+  snprintf(text, sizeof(text), "%016" PRIx64, hash);
+  return write_file(hash_path, text, strlen(text));
+}
+
+wasmtime_error_t* host_module_load(wasm_engine_t *engine, const char *path, bool update, wasmtime_module_t **module) {
+  *module = NULL;
+  if (has_suffix(path, CWASM_SUFFIX))
+    return wasmtime_module_deserialize_file(engine, path, module);
+
+  wasm_byte_vec_t wasm;
+  if (!read_file(path, &wasm))
+    return wasmtime_error_new("failed to read module");
+
+  uint64_t hash = content_hash((const uint8_t*)wasm.data, wasm.size);
+  char *cwasm_path = concat(path, CWASM_SUFFIX);
+  char *hash_path = concat(path, HASH_SUFFIX);
+
+  // Try the cache first. The artifact is mapped rather than read.
+  uint64_t cached_hash;
+  if (read_hash(hash_path, &cached_hash) && cached_hash == hash) {
+    wasmtime_error_t *error = wasmtime_module_deserialize_file(engine, cwasm_path, module);
+    if (error == NULL) {
+      wasm_byte_vec_delete(&wasm);
+      free(cwasm_path);
+      free(hash_path);
+      return NULL;
+    }
+    // The artifact is stale, e.g. produced by a different engine
+    // configuration or wasmtime version.
+    wasmtime_error_delete(error);
+  }
+
+  // Fall back to compiling.
+  wasmtime_error_t *error = wasmtime_module_new(engine, (uint8_t*)wasm.data, wasm.size, module);
+  wasm_byte_vec_delete(&wasm);
+  if (error == NULL && update && !write_cache(*module, cwasm_path, hash_path, hash))
+    fprintf(stderr, "warning: failed to write %s\n", cwasm_path);
+
+  free(cwasm_path);
+  free(hash_path);
+  return error;
+}
+
+#undef CWASM_SUFFIX
+#undef HASH_SUFFIX
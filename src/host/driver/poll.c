@@ -3,8 +3,10 @@
 #include <assert.h>
 #include <errno.h>
 #include <error.h>
+#include <host/driver/poll.h>
 #include <host/wasmtime_utils.h>
 #include <poll.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -19,25 +21,20 @@ static_assert(offsetof(struct pollfd, events) == 4, "offset of events");
 static_assert(offsetof(struct pollfd, revents) == 6, "offset of revents");
 
 static wasm_functype_t *poll_sig = NULL;  // i32 i32 i32 i32 -> i32
-static wasmtime_func_t pollfn;
-static wasmtime_extern_t pollex;
 
 static wasm_functype_t *pollin_sig = NULL;  // () -> i32
-static wasmtime_func_t pollinfn;
-static wasmtime_extern_t pollinex;
 
 static wasm_functype_t *pollout_sig = NULL; // () -> i32
-static wasmtime_func_t polloutfn;
-static wasmtime_extern_t polloutex;
+
+static atomic_bool stopping = false;
 
 DEFINE_BINDING(host_poll) {
-  assert(nargs == 4);
-  assert(nresults == 1);
+  BINDING_ARITY(4, 1);
 
   // Unpack struct offset, length, and timeout
-  uint32_t soffset = uint32_t_of_wasmtime_val_t(args[0]);
-  uint32_t slen    = uint32_t_of_wasmtime_val_t(args[1]);
-  int32_t timeout  = int32_t_of_wasmtime_val_t(args[2]);
+  uint32_t soffset = ARG_U32(0);
+  uint32_t slen    = ARG_U32(1);
+  int32_t timeout  = ARG_I32(2);
 
   // Load the structure
   uint8_t *mem;
@@ -46,7 +43,16 @@ DEFINE_BINDING(host_poll) {
 
   // Perform the system call.
   /* printf("[host_poll] slen = %u, timeout = %d\n", slen, timeout); */
-  int ans = poll(pollfd, (nfds_t)slen, (int)timeout);
+  struct timespec deadline = host_wait_deadline(timeout);
+  int ans;
+  do {
+    if (atomic_load(&stopping)) {
+      errno = EINTR;
+      ans = -1;
+      break;
+    }
+    ans = poll(pollfd, (nfds_t)slen, host_wait_slice(timeout, &deadline));
+  } while (ans == 0 && host_wait_slice(timeout, &deadline) > 0);
 
   /* printf("[host_poll] ans = %d, errno = %d, strerror = %s\n", ans, errno, strerror(errno)); */
 
@@ -54,48 +60,44 @@ DEFINE_BINDING(host_poll) {
     WRITE_ERRNO("host_poll", 3);
   }
 
-  return result1(results, wasmtime_val_t_of_int32_t((int32_t)ans));
+  RETURN_I32(ans);
 }
 
 DEFINE_BINDING(host_pollin) {
-  assert(nargs == 0);
-  assert(nresults == 1);
-  return result1(results, wasmtime_val_t_of_int32_t((int32_t)POLLIN));
+  BINDING_ARITY(0, 1);
+  RETURN_I32(POLLIN);
 }
 
 DEFINE_BINDING(host_pollout) {
-  assert(nargs == 0);
-  assert(nresults == 1);
-  return result1(results, wasmtime_val_t_of_int32_t((int32_t)POLLOUT));
+  BINDING_ARITY(0, 1);
+  RETURN_I32(POLLOUT);
 }
 
-wasmtime_error_t* host_poll_init(wasmtime_linker_t *linker, wasmtime_context_t *context, const char *export_module) {
+wasmtime_error_t* host_poll_init(wasmtime_linker_t *linker, const char *export_module) {
   wasmtime_error_t *error = NULL;
 
   if (poll_sig == NULL) {
     poll_sig = wasm_functype_new_4_1(NEW_WASM_I32, NEW_WASM_I32, NEW_WASM_I32, NEW_WASM_I32, NEW_WASM_I32);
-    wasmtime_func_new(context, poll_sig, host_poll, NULL, NULL, &pollfn);
-    pollex = (wasmtime_extern_t){ .kind = WASMTIME_EXTERN_FUNC, .of = { .func = pollfn } };
-    LINK_HOST_FN("poll", pollex);
   }
+  LINK_HOST_FN("poll", poll_sig, host_poll);
 
   if (pollin_sig == NULL) {
     pollin_sig = wasm_functype_new_0_1(NEW_WASM_I32);
-    wasmtime_func_new(context, pollin_sig, host_pollin, NULL, NULL, &pollinfn);
-    pollinex = (wasmtime_extern_t){ .kind = WASMTIME_EXTERN_FUNC, .of = { .func = pollinfn } };
-    LINK_HOST_FN("pollin", pollinex);
   }
+  LINK_HOST_FN("pollin", pollin_sig, host_pollin);
 
   if (pollout_sig == NULL) {
     pollout_sig = wasm_functype_new_0_1(NEW_WASM_I32);
-    wasmtime_func_new(context, pollout_sig, host_pollout, NULL, NULL, &polloutfn);
-    polloutex = (wasmtime_extern_t){ .kind = WASMTIME_EXTERN_FUNC, .of = { .func = polloutfn } };
-    LINK_HOST_FN("pollout", polloutex);
   }
+  LINK_HOST_FN("pollout", pollout_sig, host_pollout);
 
   return error;
 }
 
+void host_poll_shutdown(void) {
+  atomic_store(&stopping, true);
+}
+
 void host_poll_delete(void) {
   wasm_functype_delete(poll_sig);
   poll_sig = NULL;
@@ -0,0 +1,537 @@
+// Host-defined shared submission/completion rings
+
+#define _GNU_SOURCE // for accept4
+#include <assert.h>
+#include <errno.h>
+#include <host/driver/ring.h>
+#include <host/wasmtime_utils.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <wasm.h>
+#include <wasmtime.h>
+
+// Guest operation codes; must agree with inc/host/ring.h.
+enum guest_ring_op {
+  GUEST_RING_OP_ACCEPT = 0,
+  GUEST_RING_OP_RECV = 1,
+  GUEST_RING_OP_SEND = 2,
+  GUEST_RING_OP_CLOSE = 3,
+  GUEST_RING_OP_POLL = 4,
+  GUEST_RING_OP_CANCEL = 5
+};
+
+// Guest-side layout of the ring header and its entries.
+struct guest_ring {
+  uint32_t sq_head;
+  uint32_t sq_tail;
+  uint32_t cq_head;
+  uint32_t cq_tail;
+  uint32_t entries;
+  uint32_t sqes;
+  uint32_t cqes;
+};
+
+struct guest_ring_sqe {
+  uint32_t opcode;
+  int32_t fd;
+  uint32_t buf;
+  uint32_t len;
+  uint64_t user_data;
+};
+
+struct guest_ring_cqe {
+  uint64_t user_data;
+  int32_t res;
+  uint32_t flags;
+};
+
+static_assert(sizeof(struct guest_ring) == 28, "size of struct guest_ring");
+static_assert(sizeof(struct guest_ring_sqe) == 24, "size of struct guest_ring_sqe");
+static_assert(sizeof(struct guest_ring_cqe) == 16, "size of struct guest_ring_cqe");
+static_assert(EPOLLIN == POLLIN, "EPOLLIN == POLLIN");
+static_assert(EPOLLOUT == POLLOUT, "EPOLLOUT == POLLOUT");
+
+// Upper bound on the number of events handled per wakeup of the ring
+// thread.
+#define HOST_RING_MAX_EVENTS 256
+
+// Operations that would block are parked per host fd until epoll
+// reports the fd ready. A guest fiber has at most one operation in
+// flight, so one slot per direction suffices.
+struct parked {
+  bool has_in, has_out;
+  uint32_t registered; // events registered with epoll
+  struct guest_ring_sqe in, out;
+};
+
+// NOTE(dhil): The engine reserves every linear memory up front (see
+// `host_engine_config_new`), such that `memory.grow` never moves it.
+// The ring thread thus resolves the memory base once, at setup, and
+// executes submissions and parked operations as soon as they are due,
+// whilst the guest keeps running. `host_ring_enter` checks that the
+// base has stayed put, and records the current memory size, which only
+// ever grows, for the bounds checks of the submissions it announces.
+struct ring_state {
+  pthread_t thread;
+  int epfd;
+  int doorbell;
+  bool stop;
+  uint32_t roffset; // offset of the ring header
+  uint32_t mask;
+  uint8_t *mem;
+  size_t mem_size; // as of the latest entry
+  struct guest_ring *ring;
+  struct guest_ring_sqe *sqes;
+  struct guest_ring_cqe *cqes;
+  uint32_t cq_tail; // private copy, published in batches
+  uint32_t sq_limit; // end of the submissions announced by the guest
+  uint32_t nparked; // parked operations, each of which owes a completion
+  bool overflow; // submissions were held back for want of completion space
+  pthread_mutex_t lock;
+  pthread_cond_t completed;
+  struct parked *parked;
+  size_t parked_size;
+};
+
+// NOTE(dhil): A driver runs at most one instance per thread, hence
+// the ring state is thread-local rather than per instance.
+static _Thread_local struct ring_state *state = NULL;
+
+static wasm_functype_t *setup_sig = NULL;  // i32 i32 -> i32
+
+static wasm_functype_t *enter_sig = NULL;  // i32 i32 i32 -> i32
+
+static atomic_bool stopping = false;
+
+static inline uint32_t load_acquire(const uint32_t *p) {
+  return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline void store_release(uint32_t *p, uint32_t v) {
+  __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+// The completion ring must have room for every parked operation, as
+// they complete without further submissions; `submit` holds back
+// submissions which could overflow it.
+static void post(struct ring_state *rs, uint64_t user_data, int32_t res) {
+  assert(rs->cq_tail - load_acquire(&rs->ring->cq_head) <= rs->mask);
+  rs->cqes[rs->cq_tail & rs->mask] = (struct guest_ring_cqe){ .user_data = user_data, .res = res, .flags = 0 };
+  rs->cq_tail++;
+}
+
+// Returns the number of completion entries not yet spoken for.
+static inline uint32_t cq_room(struct ring_state *rs) {
+  return rs->mask + 1 - (rs->cq_tail - load_acquire(&rs->ring->cq_head)) - rs->nparked;
+}
+
+static struct parked* lookup_parked(struct ring_state *rs, int fd) {
+  if ((size_t)fd >= rs->parked_size) {
+    size_t n = rs->parked_size == 0 ? 64 : rs->parked_size;
+    while (n <= (size_t)fd) n *= 2;
+    struct parked *parked = (struct parked*)realloc(rs->parked, sizeof(struct parked)*n);
+    if (parked == NULL) return NULL;
+    memset(parked + rs->parked_size, 0, sizeof(struct parked)*(n - rs->parked_size));
+    rs->parked = parked;
+    rs->parked_size = n;
+  }
+  return &rs->parked[fd];
+}
+
+// Unparks the operation in `*has` and posts its completion.
+static inline void complete_parked(struct ring_state *rs, bool *has, const struct guest_ring_sqe *sqe, int32_t res) {
+  *has = false;
+  rs->nparked--;
+  post(rs, sqe->user_data, res);
+}
+
+// Brings the epoll registration of `fd` in line with its parked
+// operations.
+static void reregister(struct ring_state *rs, int fd, struct parked *p) {
+  uint32_t events = (p->has_in ? EPOLLIN : 0) | (p->has_out ? EPOLLOUT : 0);
+  if (events == p->registered) return;
+  struct epoll_event ev = { .events = events, .data = { .fd = fd } };
+  int op = p->registered == 0 ? EPOLL_CTL_ADD : (events == 0 ? EPOLL_CTL_DEL : EPOLL_CTL_MOD);
+  if (epoll_ctl(rs->epfd, op, fd, &ev) != 0) {
+    // Fail the parked operations rather than leaving them stranded.
+    int err = errno;
+    if (p->has_in) complete_parked(rs, &p->has_in, &p->in, -err);
+    if (p->has_out) complete_parked(rs, &p->has_out, &p->out, -err);
+    if (op != EPOLL_CTL_ADD) (void)epoll_ctl(rs->epfd, EPOLL_CTL_DEL, fd, NULL);
+    p->registered = 0;
+    return;
+  }
+  p->registered = events;
+}
+
+// Returns whether the buffer of `sqe` lies within linear memory.
+static inline bool in_bounds(struct ring_state *rs, const struct guest_ring_sqe *sqe) {
+  return (uint64_t)sqe->buf + sqe->len <= rs->mem_size;
+}
+
+// Attempts `sqe`. Returns false if it would block; otherwise the
+// result has been posted.
+static bool attempt(struct ring_state *rs, const struct guest_ring_sqe *sqe, uint32_t revents) {
+  ssize_t ans;
+  switch (sqe->opcode) {
+  case GUEST_RING_OP_ACCEPT:
+    ans = accept4(sqe->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    break;
+  case GUEST_RING_OP_RECV:
+    if (!in_bounds(rs, sqe)) {
+      post(rs, sqe->user_data, -EFAULT);
+      return true;
+    }
+    ans = recv(sqe->fd, rs->mem+sqe->buf, (size_t)sqe->len, 0);
+    break;
+  case GUEST_RING_OP_SEND:
+    if (!in_bounds(rs, sqe)) {
+      post(rs, sqe->user_data, -EFAULT);
+      return true;
+    }
+    ans = send(sqe->fd, rs->mem+sqe->buf, (size_t)sqe->len, MSG_NOSIGNAL);
+    break;
+  case GUEST_RING_OP_POLL:
+    if (revents == 0) return false;
+    post(rs, sqe->user_data, (int32_t)revents);
+    return true;
+  default:
+    post(rs, sqe->user_data, -EINVAL);
+    return true;
+  }
+  if (ans < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return false;
+  post(rs, sqe->user_data, ans < 0 ? -errno : (int32_t)ans);
+  return true;
+}
+
+// Executes `sqe`. Returns false, without side effects, if its completion
+// might not fit in the completion ring.
+static bool submit(struct ring_state *rs, const struct guest_ring_sqe *sqe) {
+  if (sqe->opcode == GUEST_RING_OP_CANCEL) {
+    // The operation may have completed already, in which case there is
+    // nothing left to do. Otherwise its completion is accounted for.
+    if (sqe->fd < 0 || (size_t)sqe->fd >= rs->parked_size) return true;
+    struct parked *p = &rs->parked[sqe->fd];
+    if (p->has_in && p->in.user_data == sqe->user_data)
+      complete_parked(rs, &p->has_in, &p->in, -ECANCELED);
+    if (p->has_out && p->out.user_data == sqe->user_data)
+      complete_parked(rs, &p->has_out, &p->out, -ECANCELED);
+    reregister(rs, sqe->fd, p);
+    return true;
+  }
+
+  if (cq_room(rs) == 0) return false;
+
+  if (sqe->opcode == GUEST_RING_OP_CLOSE) {
+    // Cancel whatever is parked on the fd before closing it.
+    if (sqe->fd >= 0 && (size_t)sqe->fd < rs->parked_size) {
+      struct parked *p = &rs->parked[sqe->fd];
+      if (p->has_in) complete_parked(rs, &p->has_in, &p->in, -ECANCELED);
+      if (p->has_out) complete_parked(rs, &p->has_out, &p->out, -ECANCELED);
+      if (p->registered != 0) (void)epoll_ctl(rs->epfd, EPOLL_CTL_DEL, sqe->fd, NULL);
+      memset(p, 0, sizeof(struct parked));
+    }
+    int ans = close(sqe->fd);
+    post(rs, sqe->user_data, ans < 0 ? -errno : 0);
+    return true;
+  }
+
+  if (attempt(rs, sqe, 0)) return true;
+
+  struct parked *p = lookup_parked(rs, sqe->fd);
+  if (p == NULL) {
+    post(rs, sqe->user_data, -ENOMEM);
+    return true;
+  }
+  bool out = sqe->opcode == GUEST_RING_OP_SEND || (sqe->opcode == GUEST_RING_OP_POLL && (sqe->len & POLLOUT) != 0);
+  if ((out && p->has_out) || (!out && p->has_in)) {
+    post(rs, sqe->user_data, -EBUSY);
+    return true;
+  }
+  if (out) {
+    p->out = *sqe;
+    p->has_out = true;
+  } else {
+    p->in = *sqe;
+    p->has_in = true;
+  }
+  rs->nparked++;
+  reregister(rs, sqe->fd, p);
+  return true;
+}
+
+// Executes the submissions announced by the latest entry. Later ones
+// may refer to memory beyond `mem_size`, and wait for the next entry.
+static void drain_submissions(struct ring_state *rs) {
+  uint32_t head = rs->ring->sq_head;
+  uint32_t tail = rs->sq_limit;
+  rs->overflow = false;
+  while (head != tail) {
+    struct guest_ring_sqe sqe = rs->sqes[head & rs->mask];
+    if (!submit(rs, &sqe)) {
+      rs->overflow = true;
+      break;
+    }
+    head++;
+  }
+  store_release(&rs->ring->sq_head, head);
+}
+
+static void resume_parked(struct ring_state *rs, int fd, uint32_t revents) {
+  if ((size_t)fd >= rs->parked_size) return;
+  struct parked *p = &rs->parked[fd];
+  uint32_t errors = revents & (EPOLLERR | EPOLLHUP);
+  if (p->has_in && (revents & (EPOLLIN | errors)) != 0 && attempt(rs, &p->in, revents & (EPOLLIN | errors))) {
+    p->has_in = false;
+    rs->nparked--;
+  }
+  if (p->has_out && (revents & (EPOLLOUT | errors)) != 0 && attempt(rs, &p->out, revents & (EPOLLOUT | errors))) {
+    p->has_out = false;
+    rs->nparked--;
+  }
+  reregister(rs, fd, p);
+}
+
+static void* ring_thread(void *arg) {
+  struct ring_state *rs = (struct ring_state*)arg;
+  struct epoll_event evs[HOST_RING_MAX_EVENTS];
+  while (true) {
+    int n = epoll_wait(rs->epfd, evs, HOST_RING_MAX_EVENTS, -1);
+    if (n < 0 && errno != EINTR) break;
+    pthread_mutex_lock(&rs->lock);
+    if (rs->stop) {
+      pthread_mutex_unlock(&rs->lock);
+      return NULL;
+    }
+    for (int i = 0; i < n; i++) {
+      if (evs[i].data.fd == rs->doorbell) {
+        uint64_t count;
+        ssize_t ignored = read(rs->doorbell, &count, sizeof(count));
+        (void)ignored;
+        drain_submissions(rs);
+      } else {
+        resume_parked(rs, evs[i].data.fd, evs[i].events);
+      }
+    }
+    // Publish the completions, and wake up the guest.
+    store_release(&rs->ring->cq_tail, rs->cq_tail);
+    pthread_cond_broadcast(&rs->completed);
+    pthread_mutex_unlock(&rs->lock);
+  }
+  return NULL;
+}
+
+// Resolves the ring against linear memory at `mem` of `size` bytes.
+// Returns false if any part of it lies outside.
+static bool resolve(struct ring_state *rs, uint8_t *mem, size_t size) {
+  if ((uint64_t)rs->roffset + sizeof(struct guest_ring) > size) return false;
+  struct guest_ring *ring = (struct guest_ring*)(mem+rs->roffset);
+  uint64_t entries = (uint64_t)rs->mask + 1;
+  if (ring->entries != entries
+      || ring->sqes + entries*sizeof(struct guest_ring_sqe) > size
+      || ring->cqes + entries*sizeof(struct guest_ring_cqe) > size)
+    return false;
+  rs->mem = mem;
+  rs->mem_size = size;
+  rs->ring = ring;
+  rs->sqes = (struct guest_ring_sqe*)(mem+ring->sqes);
+  rs->cqes = (struct guest_ring_cqe*)(mem+ring->cqes);
+  return true;
+}
+
+DEFINE_BINDING(host_ring_setup) {
+  BINDING_ARITY(2, 1);
+
+  uint32_t roffset = ARG_U32(0);
+
+  if (state != NULL) {
+    errno = EBUSY;
+    WRITE_ERRNO("host_ring_setup", 1);
+    RETURN_I32(-1);
+  }
+
+  uint8_t *mem;
+  LOAD_MEMORY(mem, "host_ring_setup");
+
+  struct ring_state *rs = (struct ring_state*)calloc(1, sizeof(struct ring_state));
+  if (rs == NULL) {
+    WRITE_ERRNO("host_ring_setup", 1);
+    RETURN_I32(-1);
+  }
+  size_t size = host_context_memory_size(caller);
+  uint32_t entries = (uint64_t)roffset + sizeof(struct guest_ring) <= size ? ((struct guest_ring*)(mem+roffset))->entries : 0;
+  rs->roffset = roffset;
+  rs->mask = entries - 1;
+  if (entries == 0 || (entries & (entries - 1)) != 0 || !resolve(rs, mem, size)) {
+    free(rs);
+    errno = EINVAL;
+    WRITE_ERRNO("host_ring_setup", 1);
+    RETURN_I32(-1);
+  }
+  rs->cq_tail = rs->ring->cq_tail;
+  rs->sq_limit = rs->ring->sq_head;
+  pthread_mutex_init(&rs->lock, NULL);
+  // Waits for completions are timed against CLOCK_MONOTONIC.
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&rs->completed, &attr);
+  pthread_condattr_destroy(&attr);
+
+  // The doorbell wakes up the ring thread on new submissions.
+  rs->epfd = epoll_create1(EPOLL_CLOEXEC);
+  rs->doorbell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  struct epoll_event ev = { .events = EPOLLIN, .data = { .fd = rs->doorbell } };
+  if (rs->epfd < 0 || rs->doorbell < 0
+      || epoll_ctl(rs->epfd, EPOLL_CTL_ADD, rs->doorbell, &ev) != 0
+      || (errno = pthread_create(&rs->thread, NULL, ring_thread, rs)) != 0) {
+    WRITE_ERRNO("host_ring_setup", 1);
+    if (rs->epfd >= 0) close(rs->epfd);
+    if (rs->doorbell >= 0) close(rs->doorbell);
+    pthread_mutex_destroy(&rs->lock);
+    pthread_cond_destroy(&rs->completed);
+    free(rs);
+    RETURN_I32(-1);
+  }
+  state = rs;
+
+  RETURN_I32(0);
+}
+
+DEFINE_BINDING(host_ring_enter) {
+  BINDING_ARITY(3, 1);
+
+  uint32_t min_complete = ARG_U32(0);
+  int32_t timeout = ARG_I32(1);
+
+  struct ring_state *rs = state;
+  if (rs == NULL) {
+    errno = EBADF;
+    WRITE_ERRNO("host_ring_enter", 2);
+    RETURN_I32(-1);
+  }
+
+  // The ring thread keeps accessing linear memory at the base it was
+  // set up with, so a memory that has moved is beyond repair.
+  uint8_t *mem;
+  LOAD_MEMORY(mem, "host_ring_enter");
+  if (mem != rs->mem) {
+    errno = EFAULT;
+    WRITE_ERRNO("host_ring_enter", 2);
+    RETURN_I32(-1);
+  }
+
+  // Announce the pending submissions, and ring the doorbell.
+  pthread_mutex_lock(&rs->lock);
+  rs->mem_size = host_context_memory_size(caller);
+  rs->sq_limit = load_acquire(&rs->ring->sq_tail);
+  bool submitted = rs->sq_limit != load_acquire(&rs->ring->sq_head);
+  if (submitted) {
+    uint64_t one = 1;
+    if (write(rs->doorbell, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+      int err = errno;
+      pthread_mutex_unlock(&rs->lock);
+      errno = err;
+      WRITE_ERRNO("host_ring_enter", 2);
+      RETURN_I32(-1);
+    }
+    rs->overflow = false;
+  }
+
+  // Wait for the ring thread to post enough completions, and in any
+  // case to take up the submissions announced above.
+  struct timespec deadline = host_wait_deadline(timeout);
+  uint32_t head = load_acquire(&rs->ring->cq_head);
+  uint32_t available;
+  bool stopped = false;
+  while (true) {
+    available = load_acquire(&rs->ring->cq_tail) - head;
+    int slice = HOST_WAIT_SLICE_MS;
+    if (!submitted || rs->overflow || load_acquire(&rs->ring->sq_head) == rs->sq_limit) {
+      stopped = atomic_load(&stopping);
+      if (stopped || available >= min_complete) break;
+      if ((slice = host_wait_slice(timeout, &deadline)) == 0) break;
+    }
+    struct timespec until = host_wait_deadline(slice);
+    (void)pthread_cond_timedwait(&rs->completed, &rs->lock, &until);
+  }
+  bool overflow = rs->overflow && rs->sq_limit != load_acquire(&rs->ring->sq_head);
+  pthread_mutex_unlock(&rs->lock);
+
+  if (stopped) {
+    errno = EINTR;
+    WRITE_ERRNO("host_ring_enter", 2);
+    RETURN_I32(-1);
+  }
+  // Submissions are held back until the guest has consumed enough
+  // completions.
+  if (overflow) {
+    errno = EBUSY;
+    WRITE_ERRNO("host_ring_enter", 2);
+    RETURN_I32(-1);
+  }
+  RETURN_I32(available);
+}
+
+wasmtime_error_t* host_ring_init(wasmtime_linker_t *linker, const char *export_module) {
+  wasmtime_error_t *error = NULL;
+
+  if (setup_sig == NULL) {
+    setup_sig = wasm_functype_new_2_1(NEW_WASM_I32, NEW_WASM_I32, NEW_WASM_I32);
+  }
+  LINK_HOST_FN("setup", setup_sig, host_ring_setup);
+
+  if (enter_sig == NULL) {
+    enter_sig = wasm_functype_new_3_1(NEW_WASM_I32, NEW_WASM_I32, NEW_WASM_I32, NEW_WASM_I32);
+  }
+  LINK_HOST_FN("enter", enter_sig, host_ring_enter);
+
+  return error;
+}
+
+void host_ring_shutdown(void) {
+  atomic_store(&stopping, true);
+}
+
+void host_ring_release(void) {
+  struct ring_state *rs = state;
+  if (rs == NULL) return;
+  pthread_mutex_lock(&rs->lock);
+  rs->stop = true;
+  pthread_mutex_unlock(&rs->lock);
+  uint64_t one = 1;
+  ssize_t ignored = write(rs->doorbell, &one, sizeof(one));
+  (void)ignored;
+  pthread_join(rs->thread, NULL);
+  close(rs->epfd);
+  close(rs->doorbell);
+  pthread_mutex_destroy(&rs->lock);
+  pthread_cond_destroy(&rs->completed);
+  free(rs->parked);
+  free(rs);
+  state = NULL;
+}
+
+void host_ring_delete(void) {
+  host_ring_release();
+
+  wasm_functype_delete(setup_sig);
+  setup_sig = NULL;
+
+  wasm_functype_delete(enter_sig);
+  enter_sig = NULL;
+}
+
+#undef HOST_RING_MAX_EVENTS
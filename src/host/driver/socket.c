@@ -1,173 +1,366 @@
 // Host-defined socket implementation
 
+#define _GNU_SOURCE // for accept4, pipe2, and splice
 #include <arpa/inet.h>
+#include <errno.h>
 #include <error.h>
 #include <fcntl.h>
 #include <host/driver/socket.h>
 #include <host/wasmtime_utils.h>
+#include <limits.h>
+#include <linux/openat2.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <wasm.h>
 #include <wasmtime.h>
 
 static wasm_functype_t *listen_sig = NULL;  // i32 i32 i32 -> i32
-static wasmtime_func_t listenfn;
-static wasmtime_extern_t listenex;
+
+static wasm_functype_t *listen_ex_sig = NULL;  // i32 i32 i32 -> i32
+
+static wasm_functype_t *setsockopt_sig = NULL;  // i32 i32 i32 i32 -> i32
+
+// Guest-side layout of the listener options. A zero field leaves the
+// option at the system default.
+struct guest_listen_opts {
+  int32_t backlog;
+  int32_t defer_accept;
+  int32_t fastopen;
+  uint32_t nodelay;
+  int32_t sndbuf;
+  int32_t rcvbuf;
+};
+
+static_assert(sizeof(struct guest_listen_opts) == 24, "size of struct guest_listen_opts");
+
+// Guest-side option names, see `host_setsockopt`.
+enum guest_sockopt {
+  GUEST_SOCKOPT_NODELAY = 1,
+  GUEST_SOCKOPT_DEFER_ACCEPT = 2,
+  GUEST_SOCKOPT_FASTOPEN = 3,
+  GUEST_SOCKOPT_SNDBUF = 4,
+  GUEST_SOCKOPT_RCVBUF = 5
+};
 
 static wasm_functype_t *connect_sig = NULL;  // i32 i32 i32 i32 -> i32
-static wasmtime_func_t connectfn;
-static wasmtime_extern_t connectex;
+
+static wasm_functype_t *connect_result_sig = NULL;  // i32 i32 -> i32
 
 static wasm_functype_t *accept_sig = NULL; // i32 i32 -> i32
-static wasmtime_func_t acceptfn;
-static wasmtime_extern_t acceptex;
+
+static wasm_functype_t *accept_many_sig = NULL; // i32 i32 i32 i32 -> i32
 
 static wasm_functype_t *send_sig = NULL; // i32 i32 i32 i32 -> i32
-static wasmtime_func_t sendfn;
-static wasmtime_extern_t sendex;
 
 static wasm_functype_t *recv_sig = NULL; // i32 i32 i32 i32 -> i32
-static wasmtime_func_t recvfn;
-static wasmtime_extern_t recvex;
+
+// Guest-side layout of an I/O vector.
+struct guest_iovec {
+  uint32_t buf;
+  uint32_t len;
+};
+
+static_assert(sizeof(struct guest_iovec) == 8, "size of struct guest_iovec");
+static_assert(offsetof(struct guest_iovec, len) == 4, "offset of len");
+
+// Upper bound on the number of vectors transferred per `sendv` or
+// `recvv`. Excess vectors are left for the next call, exactly like a
+// short write.
+#define HOST_SOCKET_MAX_IOV 64
+
+static wasm_functype_t *sendv_sig = NULL; // i32 i32 i32 i32 -> i32
+
+static wasm_functype_t *recvv_sig = NULL; // i32 i32 i32 i32 -> i32
+
+static wasm_functype_t *open_sig = NULL; // i32 i32 i32 -> i32
+
+static wasm_functype_t *pipe_sig = NULL; // i32 i32 -> i32
+
+static wasm_functype_t *sendfile_sig = NULL; // i32 i32 i64 i32 i32 -> i32
+
+static wasm_functype_t *splice_sig = NULL; // i32 i32 i32 i32 -> i32
 
 static wasm_functype_t *close_sig = NULL;   // i32 i32 -> i32
-static wasmtime_func_t closefn;
-static wasmtime_extern_t closeex;
 
 DEFINE_BINDING(host_connect) {
-  assert(nargs == 4);
-  assert(nresults == 1);
+  BINDING_ARITY(4, 1);
 
   // Unpack addr and port args.
-  int32_t addr_offset = int32_t_of_wasmtime_val_t(args[0]);
-  int32_t addr_len = int32_t_of_wasmtime_val_t(args[1]);
-  int32_t port = int32_t_of_wasmtime_val_t(args[2]);
+  uint32_t addr_offset = ARG_U32(0);
+  uint32_t addr_len = ARG_U32(1);
+  int32_t port = ARG_I32(2);
 
   // Load memory.
   uint8_t *mem;
   LOAD_MEMORY(mem, "host_connect");
 
-  // Create and connect the socket.
-  int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-
-  if (sockfd < 0) {
-    WRITE_ERRNO("host_connect", 2);
-    return result1(results, wasmtime_val_t_of_int64_t((int64_t)sockfd));
-  }
-
+  // Copy the address string, it need not be NUL-terminated in guest
+  // memory.
+  char host[INET_ADDRSTRLEN];
   struct sockaddr_in addr;
   addr.sin_family = AF_INET;
-  assert((mem+addr_offset+addr_len) != NULL && *((char*)(mem+addr_offset+addr_len)) == '\0');
-  addr.sin_addr.s_addr = inet_addr((char*)(mem+addr_offset)); // Read the address string.
   addr.sin_port = htons((int)port);
+  if (addr_len >= sizeof(host)) {
+    errno = EINVAL;
+    WRITE_ERRNO("host_connect", 3);
+    RETURN_I32(-1);
+  }
+  memcpy(host, mem+addr_offset, addr_len);
+  host[addr_len] = '\0';
+  if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+    errno = EINVAL;
+    WRITE_ERRNO("host_connect", 3);
+    RETURN_I32(-1);
+  }
 
-  int ans = connect((int)sockfd, (struct sockaddr *)&addr, sizeof(addr));
-  if (ans < 0) {
+  // Create a nonblocking socket, such that connecting never stalls the
+  // guest scheduler.
+  int sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (sockfd < 0) {
     WRITE_ERRNO("host_connect", 3);
-    return result1(results, wasmtime_val_t_of_int64_t((int64_t)ans));
+    RETURN_I32(sockfd);
   }
 
-  // Set nonblocking
-  int flags = fcntl(sockfd, F_GETFL, 0);
-  if (flags == -1 || fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) != 0) {
+  // NOTE(dhil): A connect in progress still hands out the fd. The
+  // guest waits for it to become writable, and then collects the
+  // outcome with `host_connect_result`.
+  int ans = connect(sockfd, (struct sockaddr *)&addr, sizeof(addr));
+  if (ans < 0) {
     WRITE_ERRNO("host_connect", 3);
+    if (errno != EINPROGRESS) {
+      close(sockfd);
+      RETURN_I32(-1);
+    }
+  }
+
+  RETURN_I32(sockfd);
+}
+
+DEFINE_BINDING(host_connect_result) {
+  BINDING_ARITY(2, 1);
+
+  // Unpack socket fd.
+  int32_t sockfd = ARG_I32(0);
+
+  int err = 0;
+  socklen_t errlen = sizeof(err);
+  int ans = getsockopt((int)sockfd, SOL_SOCKET, SO_ERROR, &err, &errlen);
+  if (ans == 0 && err != 0) {
+    errno = err;
+    ans = -1;
+  }
+  if (ans < 0) {
+    WRITE_ERRNO("host_connect_result", 1);
   }
 
-  return result1(results, wasmtime_val_t_of_int32_t((int32_t)sockfd));
+  RETURN_I32(ans);
 }
 
 DEFINE_BINDING(host_accept) {
-  assert(nargs == 2);
-  assert(nresults == 1);
+  BINDING_ARITY(2, 1);
 
   // Unpack socket fd.
-  int32_t sockfd = int32_t_of_wasmtime_val_t(args[0]);
+  int32_t sockfd = ARG_I32(0);
 
-  // Perform the system call.
-  int ans = accept(sockfd, NULL, 0);
+  // Perform the system call. The new socket is nonblocking from the
+  // outset.
+  int ans = accept4(sockfd, NULL, 0, SOCK_NONBLOCK | SOCK_CLOEXEC);
 
   if (ans < 0) {
     /* printf("[host_accept]: sockfd = %d, ans = %d, errno = %s (%d)\n", sockfd, ans, strerror(errno), errno); */
     WRITE_ERRNO("host_accept", 1);
-    return result1(results, wasmtime_val_t_of_int32_t((int32_t)ans));
-  }
-
-  // Set nonblocking
-  int flags = fcntl(ans, F_GETFL, 0);
-  if (flags == -1 || fcntl(ans, F_SETFL, flags | O_NONBLOCK) != 0) {
-    WRITE_ERRNO("host_accept", 1);
   }
 
   /* printf("[host_accept]: sockfd = %d, ans = %d, errno = %s (%d)\n", sockfd, ans, strerror(errno), errno); */
 
-  return result1(results, wasmtime_val_t_of_int32_t((int32_t)ans));
+  RETURN_I32(ans);
 }
 
-DEFINE_BINDING(host_listen) {
-  assert(nargs == 3);
-  assert(nresults == 1);
+DEFINE_BINDING(host_accept_many) {
+  BINDING_ARITY(4, 1);
 
-  // Unpack port and backlog
-  int32_t port = int32_t_of_wasmtime_val_t(args[0]);
-  int32_t backlog = int32_t_of_wasmtime_val_t(args[1]);
+  // Unpack socket fd, fd array offset, and array capacity.
+  int32_t sockfd = ARG_I32(0);
+  uint32_t foffset = ARG_U32(1);
+  uint32_t max = ARG_U32(2);
 
-  // Create the socket.
-  int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+  if (max == 0) RETURN_I32(0);
 
-  // Enable address & port reuse.
-  int opt = 1;
-  if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
-    WRITE_ERRNO("host_listen", 2);
-    return result1(results, wasmtime_val_t_of_int32_t((int32_t)sockfd));
+  uint8_t *mem;
+  LOAD_MEMORY(mem, "host_accept_many");
+
+  // Accept until the backlog is drained or the array is full.
+  uint32_t n = 0;
+  while (n < max) {
+    int ans = accept4(sockfd, NULL, 0, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (ans < 0) break;
+    memory_write_u32(mem+foffset+(n*sizeof(int32_t)), (uint32_t)ans);
+    n++;
   }
 
-  if (sockfd < 0) {
-    WRITE_ERRNO("host_listen", 2);
-    return result1(results, wasmtime_val_t_of_int32_t((int32_t)sockfd));
+  // Only report an error if nothing was accepted; otherwise the error
+  // (typically EAGAIN) resurfaces on the next call.
+  if (n == 0) {
+    WRITE_ERRNO("host_accept_many", 3);
+    RETURN_I32(-1);
+  }
+
+  RETURN_I32(n);
+}
+
+// Sets a single option on `sockfd`. Returns -1 and sets errno on
+// failure.
+static int apply_sockopt(int sockfd, int32_t name, int32_t value) {
+  switch (name) {
+  case GUEST_SOCKOPT_NODELAY:
+    return setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(value));
+  case GUEST_SOCKOPT_DEFER_ACCEPT:
+    return setsockopt(sockfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &value, sizeof(value));
+  case GUEST_SOCKOPT_FASTOPEN:
+    return setsockopt(sockfd, IPPROTO_TCP, TCP_FASTOPEN, &value, sizeof(value));
+  case GUEST_SOCKOPT_SNDBUF:
+    return setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &value, sizeof(value));
+  case GUEST_SOCKOPT_RCVBUF:
+    return setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &value, sizeof(value));
+  default:
+    errno = EINVAL;
+    return -1;
   }
+}
+
+// NOTE(dhil): With SO_REUSEPORT every worker of a multi-threaded
+// driver binds its own listener to the same port, and the kernel
+// load-balances incoming connections between them. It is off by
+// default, such that a second server on the same port fails with
+// EADDRINUSE rather than silently taking half of the connections.
+static bool reuseport = false;
+
+void host_socket_set_reuseport(bool enable) {
+  reuseport = enable;
+}
+
+// Creates a nonblocking listener on `port`. Returns -1 and sets errno
+// on failure.
+static int open_listener(int32_t port, const struct guest_listen_opts *opts) {
+  // Create the socket.
+  int sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (sockfd < 0) return -1;
+
+  // Enable address reuse, and port reuse if the driver asked for it.
+  int opt = 1;
+  if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))
+      || (reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt))))
+    goto fail;
+
+  // NOTE(dhil): Linux copies TCP_NODELAY and the buffer sizes from the
+  // listener to every accepted socket, which saves a hostcall per
+  // connection. The buffer sizes must be set before listen(2) to take
+  // effect on the advertised window scale.
+  if ((opts->nodelay != 0 && apply_sockopt(sockfd, GUEST_SOCKOPT_NODELAY, 1))
+      || (opts->sndbuf > 0 && apply_sockopt(sockfd, GUEST_SOCKOPT_SNDBUF, opts->sndbuf))
+      || (opts->rcvbuf > 0 && apply_sockopt(sockfd, GUEST_SOCKOPT_RCVBUF, opts->rcvbuf))
+      || (opts->defer_accept > 0 && apply_sockopt(sockfd, GUEST_SOCKOPT_DEFER_ACCEPT, opts->defer_accept))
+      || (opts->fastopen > 0 && apply_sockopt(sockfd, GUEST_SOCKOPT_FASTOPEN, opts->fastopen)))
+    goto fail;
 
   // Bind the socket.
   struct sockaddr_in addr;
   addr.sin_family = AF_INET;
   addr.sin_addr.s_addr = INADDR_ANY;
   addr.sin_port = htons(port);
-  int ans = bind(sockfd, (struct sockaddr*)&addr, sizeof(addr));
-  if (ans < 0) {
-    WRITE_ERRNO("host_listen", 2);
-    return result1(results, wasmtime_val_t_of_int32_t((int32_t)ans));
-  }
+  if (bind(sockfd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+    goto fail;
 
   // Start listening.
-  ans = listen(sockfd, backlog);
-  if (ans < 0) {
-    WRITE_ERRNO("host_listen", 2);
-    return result1(results, wasmtime_val_t_of_int32_t((int32_t)ans));
+  if (listen(sockfd, opts->backlog) < 0)
+    goto fail;
+
+  return sockfd;
+
+ fail: {
+    int err = errno;
+    close(sockfd);
+    errno = err;
+    return -1;
   }
+}
+
+int host_socket_listen(int32_t port, int32_t backlog) {
+  struct guest_listen_opts opts = { .backlog = backlog };
+  return open_listener(port, &opts);
+}
+
+DEFINE_BINDING(host_listen) {
+  BINDING_ARITY(3, 1);
+
+  // Unpack port and backlog
+  int32_t port = ARG_I32(0);
+  int32_t backlog = ARG_I32(1);
 
-  // Set nonblocking
-  int flags = fcntl(sockfd, F_GETFL, 0);
-  if (flags == -1 || fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) != 0) {
+  struct guest_listen_opts opts = { .backlog = backlog };
+  int sockfd = open_listener(port, &opts);
+  if (sockfd < 0) {
     WRITE_ERRNO("host_listen", 2);
   }
 
   /* printf("[host_listen]: sockfd = %d, errno = %s (%d)\n", sockfd, strerror(errno), errno); */
 
-  return result1(results, wasmtime_val_t_of_int32_t((int32_t)sockfd));
+  RETURN_I32(sockfd);
+}
+
+DEFINE_BINDING(host_listen_ex) {
+  BINDING_ARITY(3, 1);
+
+  // Unpack port and options offset.
+  int32_t port = ARG_I32(0);
+  uint32_t ooffset = ARG_U32(1);
+
+  uint8_t *mem;
+  LOAD_MEMORY(mem, "host_listen_ex");
+
+  struct guest_listen_opts opts;
+  memcpy(&opts, mem+ooffset, sizeof(opts));
+  int sockfd = open_listener(port, &opts);
+  if (sockfd < 0) {
+    WRITE_ERRNO("host_listen_ex", 2);
+  }
+
+  RETURN_I32(sockfd);
+}
+
+DEFINE_BINDING(host_setsockopt) {
+  BINDING_ARITY(4, 1);
+
+  // Unpack fd, option name, and value.
+  int32_t sockfd = ARG_I32(0);
+  int32_t name = ARG_I32(1);
+  int32_t value = ARG_I32(2);
+
+  int ans = apply_sockopt((int)sockfd, name, value);
+  if (ans < 0) {
+    WRITE_ERRNO("host_setsockopt", 3);
+  }
+
+  RETURN_I32(ans);
 }
 
 DEFINE_BINDING(host_recv) {
-  assert(nargs == 4);
-  assert(nresults == 1);
+  BINDING_ARITY(4, 1);
 
   // Unpack fd, buffer offset, and length
-  int32_t sockfd = int32_t_of_wasmtime_val_t(args[0]);
-  uint32_t boffset = uint32_t_of_wasmtime_val_t(args[1]);
-  uint32_t blen = uint32_t_of_wasmtime_val_t(args[2]);
+  int32_t sockfd = ARG_I32(0);
+  uint32_t boffset = ARG_U32(1);
+  uint32_t blen = ARG_U32(2);
 
   // Load the buffer.
   uint8_t *mem;
@@ -183,17 +376,16 @@ DEFINE_BINDING(host_recv) {
     WRITE_ERRNO("host_recv", 3);
   }
 
-  return result1(results, wasmtime_val_t_of_int32_t((int32_t)ans));
+  RETURN_I32(ans);
 }
 
 DEFINE_BINDING(host_send) {
-  assert(nargs == 4);
-  assert(nresults == 1);
+  BINDING_ARITY(4, 1);
 
   // Unpack fd, buffer offset, and length
-  int32_t sockfd = int32_t_of_wasmtime_val_t(args[0]);
-  uint32_t boffset = uint32_t_of_wasmtime_val_t(args[1]);
-  uint32_t blen = uint32_t_of_wasmtime_val_t(args[2]);
+  int32_t sockfd = ARG_I32(0);
+  uint32_t boffset = ARG_U32(1);
+  uint32_t blen = ARG_U32(2);
 
   // Load the buffer.
   uint8_t *mem;
@@ -206,15 +398,227 @@ DEFINE_BINDING(host_send) {
     WRITE_ERRNO("host_send", 3);
   }
 
-  return result1(results, wasmtime_val_t_of_int32_t((int32_t)ans));
+  RETURN_I32(ans);
+}
+
+// Translates the guest vector array at `mem+ioffset` into host
+// vectors. Returns the number of vectors used.
+static inline int load_iovec(struct iovec *iov, uint8_t *mem, uint32_t ioffset, uint32_t iovcnt) {
+  if (iovcnt > HOST_SOCKET_MAX_IOV) iovcnt = HOST_SOCKET_MAX_IOV;
+  const struct guest_iovec *giov = (const struct guest_iovec*)(mem+ioffset);
+  for (uint32_t i = 0; i < iovcnt; i++) {
+    iov[i].iov_base = mem+giov[i].buf;
+    iov[i].iov_len = (size_t)giov[i].len;
+  }
+  return (int)iovcnt;
+}
+
+DEFINE_BINDING(host_recvv) {
+  BINDING_ARITY(4, 1);
+
+  // Unpack fd, vector array offset, and vector count.
+  int32_t sockfd = ARG_I32(0);
+  uint32_t ioffset = ARG_U32(1);
+  uint32_t iovcnt = ARG_U32(2);
+
+  uint8_t *mem;
+  LOAD_MEMORY(mem, "host_recvv");
+
+  // Scatter the input across the guest buffers.
+  struct iovec iov[HOST_SOCKET_MAX_IOV];
+  int n = load_iovec(iov, mem, ioffset, iovcnt);
+  ssize_t ans = readv((int)sockfd, iov, n);
+
+  if (ans < 0) {
+    WRITE_ERRNO("host_recvv", 3);
+  }
+
+  RETURN_I32((int32_t)ans);
+}
+
+DEFINE_BINDING(host_sendv) {
+  BINDING_ARITY(4, 1);
+
+  // Unpack fd, vector array offset, and vector count.
+  int32_t sockfd = ARG_I32(0);
+  uint32_t ioffset = ARG_U32(1);
+  uint32_t iovcnt = ARG_U32(2);
+
+  uint8_t *mem;
+  LOAD_MEMORY(mem, "host_sendv");
+
+  // Gather the guest buffers into a single system call.
+  struct iovec iov[HOST_SOCKET_MAX_IOV];
+  int n = load_iovec(iov, mem, ioffset, iovcnt);
+  ssize_t ans = writev((int)sockfd, iov, n);
+
+  if (ans < 0) {
+    WRITE_ERRNO("host_sendv", 3);
+  }
+
+  RETURN_I32((int32_t)ans);
+}
+
+// NOTE(dhil): Files are resolved beneath the working directory of the
+// driver, which is opened once as the root for `host_open`. Absolute
+// paths, parent references, and symbolic links must not lead out of
+// it; `openat2` enforces this in the kernel, without the races of
+// checking the path first.
+static int root_fd = -1;
+
+// Opens `path` beneath `root_fd` one component at a time, for kernels
+// without `openat2`. Neither parent references nor symbolic links are
+// followed.
+static int open_beneath_compat(char *path) {
+  int dirfd = root_fd;
+  char *save = NULL;
+  char *name = strtok_r(path, "/", &save);
+  while (name != NULL) {
+    char *next = strtok_r(NULL, "/", &save);
+    int fd;
+    if (strcmp(name, "..") == 0) {
+      errno = EXDEV;
+      fd = -1;
+    } else if (next != NULL) {
+      fd = openat(dirfd, name, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    } else {
+      fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    }
+    if (dirfd != root_fd) {
+      int err = errno;
+      close(dirfd);
+      errno = err;
+    }
+    if (fd < 0) return -1;
+    if (next == NULL) return fd;
+    dirfd = fd;
+    name = next;
+  }
+  // The path consists of separators only.
+  errno = EISDIR;
+  return -1;
+}
+
+static int open_beneath(char *path) {
+  if (root_fd < 0) {
+    errno = EBADF;
+    return -1;
+  }
+  if (path[0] == '/') {
+    errno = EXDEV;
+    return -1;
+  }
+  struct open_how how = {
+    .flags = O_RDONLY | O_CLOEXEC,
+    .mode = 0,
+    .resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS
+  };
+  int ans = (int)syscall(SYS_openat2, root_fd, path, &how, sizeof(how));
+  if (ans < 0 && errno == ENOSYS) return open_beneath_compat(path);
+  return ans;
+}
+
+DEFINE_BINDING(host_open) {
+  BINDING_ARITY(3, 1);
+
+  // Unpack path offset and length.
+  uint32_t poffset = ARG_U32(0);
+  uint32_t plen = ARG_U32(1);
+
+  uint8_t *mem;
+  LOAD_MEMORY(mem, "host_open");
+
+  // Copy the path such that it is guaranteed to be terminated.
+  char path[PATH_MAX];
+  if (plen == 0 || plen >= PATH_MAX) {
+    errno = ENAMETOOLONG;
+    WRITE_ERRNO("host_open", 2);
+    RETURN_I32(-1);
+  }
+  memcpy(path, mem+poffset, plen);
+  path[plen] = '\0';
+  if (strlen(path) != plen) {
+    errno = EINVAL;
+    WRITE_ERRNO("host_open", 2);
+    RETURN_I32(-1);
+  }
+
+  int ans = open_beneath(path);
+
+  if (ans < 0) {
+    WRITE_ERRNO("host_open", 2);
+  }
+
+  RETURN_I32(ans);
+}
+
+DEFINE_BINDING(host_pipe) {
+  BINDING_ARITY(2, 1);
+
+  // Unpack the offset of the two-element fd array.
+  uint32_t foffset = ARG_U32(0);
+
+  uint8_t *mem;
+  LOAD_MEMORY(mem, "host_pipe");
+
+  int fds[2];
+  int ans = pipe2(fds, O_NONBLOCK | O_CLOEXEC);
+
+  if (ans < 0) {
+    WRITE_ERRNO("host_pipe", 1);
+    RETURN_I32(ans);
+  }
+
+  memory_write_u32(mem+foffset, (uint32_t)fds[0]);
+  memory_write_u32(mem+foffset+sizeof(int32_t), (uint32_t)fds[1]);
+
+  RETURN_I32(ans);
+}
+
+DEFINE_BINDING(host_sendfile) {
+  BINDING_ARITY(5, 1);
+
+  // Unpack destination socket, source file, file offset, and length.
+  int32_t out_fd = ARG_I32(0);
+  int32_t in_fd = ARG_I32(1);
+  off_t offset = (off_t)ARG_I64(2);
+  uint32_t len = ARG_U32(3);
+
+  // Perform the system call. The guest tracks the file position
+  // itself, so the offset of the underlying file is left untouched.
+  ssize_t ans = sendfile((int)out_fd, (int)in_fd, &offset, (size_t)len);
+
+  if (ans < 0) {
+    WRITE_ERRNO("host_sendfile", 4);
+  }
+
+  RETURN_I32((int32_t)ans);
+}
+
+DEFINE_BINDING(host_splice) {
+  BINDING_ARITY(4, 1);
+
+  // Unpack source fd, destination fd, and length. One of them must
+  // be a pipe.
+  int32_t in_fd = ARG_I32(0);
+  int32_t out_fd = ARG_I32(1);
+  uint32_t len = ARG_U32(2);
+
+  // Perform the system call.
+  ssize_t ans = splice((int)in_fd, NULL, (int)out_fd, NULL, (size_t)len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+  if (ans < 0) {
+    WRITE_ERRNO("host_splice", 3);
+  }
+
+  RETURN_I32((int32_t)ans);
 }
 
 DEFINE_BINDING(host_close) {
-  assert(nargs == 2);
-  assert(nresults == 1);
+  BINDING_ARITY(2, 1);
 
   // Unpack fd.
-  int32_t sockfd = int32_t_of_wasmtime_val_t(args[0]);
+  int32_t sockfd = ARG_I32(0);
 
   // Perform the system call.
   int ans = close((int)sockfd);
@@ -223,58 +627,104 @@ DEFINE_BINDING(host_close) {
     WRITE_ERRNO("host_close", 1);
   }
 
-  return result1(results, wasmtime_val_t_of_int32_t((int32_t)ans));
+  RETURN_I32(ans);
 }
 
-wasmtime_error_t* host_socket_init(wasmtime_linker_t *linker, wasmtime_context_t *context, const char *export_module) {
+wasmtime_error_t* host_socket_init(wasmtime_linker_t *linker, const char *export_module) {
   wasmtime_error_t *error = NULL;
 
   if (accept_sig == NULL) {
     // Accept
     accept_sig = wasm_functype_new_2_1(NEW_WASM_I32, NEW_WASM_I32, NEW_WASM_I32);
-    wasmtime_func_new(context, accept_sig, host_accept, NULL, NULL, &acceptfn);
-    acceptex = (wasmtime_extern_t){ .kind = WASMTIME_EXTERN_FUNC, .of = { .func = acceptfn } };
-    LINK_HOST_FN("accept", acceptex);
   }
+  LINK_HOST_FN("accept", accept_sig, host_accept);
+
+  if (accept_many_sig == NULL) {
+    accept_many_sig = wasm_functype_new_4_1(NEW_WASM_I32, NEW_WASM_I32, NEW_WASM_I32, NEW_WASM_I32, NEW_WASM_I32);
+  }
+  LINK_HOST_FN("accept_many", accept_many_sig, host_accept_many);
 
   if (listen_sig == NULL) {
     // Listen
     listen_sig = wasm_functype_new_3_1(NEW_WASM_I32, NEW_WASM_I32, NEW_WASM_I32, NEW_WASM_I32);
-    wasmtime_func_new(context, listen_sig, host_listen, NULL, NULL, &listenfn);
-    listenex = (wasmtime_extern_t){ .kind = WASMTIME_EXTERN_FUNC, .of = { .func = listenfn } };
-    LINK_HOST_FN("listen", listenex);
   }
+  LINK_HOST_FN("listen", listen_sig, host_listen);
+
+  if (listen_ex_sig == NULL) {
+    listen_ex_sig = wasm_functype_new_3_1(NEW_WASM_I32, NEW_WASM_I32, NEW_WASM_I32, NEW_WASM_I32);
+  }
+  LINK_HOST_FN("listen_ex", listen_ex_sig, host_listen_ex);
+
+  if (setsockopt_sig == NULL) {
+    // Socket options
+    setsockopt_sig = wasm_functype_new_4_1(NEW_WASM_I32, NEW_WASM_I32, NEW_WASM_I32, NEW_WASM_I32, NEW_WASM_I32);
+  }
+  LINK_HOST_FN("setsockopt", setsockopt_sig, host_setsockopt);
 
   if (connect_sig == NULL) {
     // Connect
     connect_sig = wasm_functype_new_4_1(NEW_WASM_I32, NEW_WASM_I32, NEW_WASM_I32, NEW_WASM_I32, NEW_WASM_I32);
-    wasmtime_func_new(context, connect_sig, host_connect, NULL, NULL, &connectfn);
-    connectex = (wasmtime_extern_t){ .kind = WASMTIME_EXTERN_FUNC, .of = { .func = connectfn } };
-    LINK_HOST_FN("connect", connectex);
   }
+  LINK_HOST_FN("connect", connect_sig, host_connect);
+
+  if (connect_result_sig == NULL) {
+    connect_result_sig = wasm_functype_new_2_1(NEW_WASM_I32, NEW_WASM_I32, NEW_WASM_I32);
+  }
+  LINK_HOST_FN("connect_result", connect_result_sig, host_connect_result);
 
   if (recv_sig == NULL) {
     // Send and recv
     recv_sig = wasm_functype_new_4_1(NEW_WASM_I32, NEW_WASM_I32, NEW_WASM_I32, NEW_WASM_I32, NEW_WASM_I32);
-    wasmtime_func_new(context, recv_sig, host_recv, NULL, NULL, &recvfn);
-    recvex = (wasmtime_extern_t){ .kind = WASMTIME_EXTERN_FUNC, .of = { .func = recvfn } };
-    LINK_HOST_FN("recv", recvex);
   }
+  LINK_HOST_FN("recv", recv_sig, host_recv);
 
   if (send_sig == NULL) {
     send_sig = wasm_functype_new_4_1(NEW_WASM_I32, NEW_WASM_I32, NEW_WASM_I32, NEW_WASM_I32, NEW_WASM_I32);
-    wasmtime_func_new(context, send_sig, host_send, NULL, NULL, &sendfn);
-    sendex = (wasmtime_extern_t){ .kind = WASMTIME_EXTERN_FUNC, .of = { .func = sendfn } };
-    LINK_HOST_FN("send", sendex);
   }
+  LINK_HOST_FN("send", send_sig, host_send);
+
+  if (recvv_sig == NULL) {
+    // Vectored send and recv
+    recvv_sig = wasm_functype_new_4_1(NEW_WASM_I32, NEW_WASM_I32, NEW_WASM_I32, NEW_WASM_I32, NEW_WASM_I32);
+  }
+  LINK_HOST_FN("recvv", recvv_sig, host_recvv);
+
+  if (sendv_sig == NULL) {
+    sendv_sig = wasm_functype_new_4_1(NEW_WASM_I32, NEW_WASM_I32, NEW_WASM_I32, NEW_WASM_I32, NEW_WASM_I32);
+  }
+  LINK_HOST_FN("sendv", sendv_sig, host_sendv);
+
+  if (root_fd < 0) {
+    root_fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd < 0) return wasmtime_error_new("failed to open the root directory for host_open");
+  }
+  if (open_sig == NULL) {
+    // Files and pipes
+    open_sig = wasm_functype_new_3_1(NEW_WASM_I32, NEW_WASM_I32, NEW_WASM_I32, NEW_WASM_I32);
+  }
+  LINK_HOST_FN("open", open_sig, host_open);
+
+  if (pipe_sig == NULL) {
+    pipe_sig = wasm_functype_new_2_1(NEW_WASM_I32, NEW_WASM_I32, NEW_WASM_I32);
+  }
+  LINK_HOST_FN("pipe", pipe_sig, host_pipe);
+
+  if (sendfile_sig == NULL) {
+    // Zero-copy transfers
+    sendfile_sig = wasm_functype_new_5_1(NEW_WASM_I32, NEW_WASM_I32, NEW_WASM_I64, NEW_WASM_I32, NEW_WASM_I32, NEW_WASM_I32);
+  }
+  LINK_HOST_FN("sendfile", sendfile_sig, host_sendfile);
+
+  if (splice_sig == NULL) {
+    splice_sig = wasm_functype_new_4_1(NEW_WASM_I32, NEW_WASM_I32, NEW_WASM_I32, NEW_WASM_I32, NEW_WASM_I32);
+  }
+  LINK_HOST_FN("splice", splice_sig, host_splice);
 
   if (close_sig == NULL) {
     // Close
     close_sig = wasm_functype_new_2_1(NEW_WASM_I32, NEW_WASM_I32, NEW_WASM_I32);
-    wasmtime_func_new(context, close_sig, host_close, NULL, NULL, &closefn);
-    closeex = (wasmtime_extern_t){ .kind = WASMTIME_EXTERN_FUNC, .of = { .func = closefn } };
-    LINK_HOST_FN("close", closeex);
   }
+  LINK_HOST_FN("close", close_sig, host_close);
   return error;
 }
 
@@ -282,20 +732,54 @@ void host_socket_delete(void) {
   wasm_functype_delete(listen_sig);
   listen_sig = NULL;
 
+  wasm_functype_delete(listen_ex_sig);
+  listen_ex_sig = NULL;
+
+  wasm_functype_delete(setsockopt_sig);
+  setsockopt_sig = NULL;
+
   wasm_functype_delete(accept_sig);
   accept_sig = NULL;
 
+  wasm_functype_delete(accept_many_sig);
+  accept_many_sig = NULL;
+
   wasm_functype_delete(connect_sig);
   connect_sig = NULL;
 
+  wasm_functype_delete(connect_result_sig);
+  connect_result_sig = NULL;
+
   wasm_functype_delete(recv_sig);
   recv_sig = NULL;
 
   wasm_functype_delete(send_sig);
   send_sig = NULL;
 
+  wasm_functype_delete(recvv_sig);
+  recvv_sig = NULL;
+
+  wasm_functype_delete(sendv_sig);
+  sendv_sig = NULL;
+
+  wasm_functype_delete(open_sig);
+  open_sig = NULL;
+  if (root_fd >= 0) close(root_fd);
+  root_fd = -1;
+
+  wasm_functype_delete(pipe_sig);
+  pipe_sig = NULL;
+
+  wasm_functype_delete(sendfile_sig);
+  sendfile_sig = NULL;
+
+  wasm_functype_delete(splice_sig);
+  splice_sig = NULL;
+
   wasm_functype_delete(close_sig);
   close_sig = NULL;
 }
 
+#undef HOST_SOCKET_MAX_IOV
+
 
@@ -0,0 +1,161 @@
+// A hierarchical timer wheel in the style of Varghese and Lauck. Each
+// level has 64 slots, a slot at level `l` spans 64^l ticks, and the
+// four levels together span 2^24 ticks. Timers further out are parked
+// at the top level and cascade down until they are in range. Every
+// level keeps a bitmap of its occupied slots, such that advancing the
+// wheel jumps straight to the next tick at which something happens.
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <timer_wheel.h>
+
+#define LEVELS 4
+#define SLOT_BITS 6
+#define SLOTS (1u << SLOT_BITS)
+#define SLOT_MASK (SLOTS - 1)
+#define SPAN ((uint64_t)1 << (LEVELS * SLOT_BITS))
+// Pseudo slot of timers which have expired, but are yet to be reaped.
+#define EXPIRED_SLOT (LEVELS * SLOTS)
+
+struct timer_wheel {
+  uint64_t now;
+  uint32_t count; // number of armed timers
+  struct timer *expired;
+  uint64_t occupied[LEVELS];
+  struct timer *slots[LEVELS][SLOTS];
+};
+
+static inline void link_timer(struct timer **head, struct timer *timer) {
+  timer->next = *head;
+  if (*head != NULL) (*head)->pprev = &timer->next;
+  *head = timer;
+  timer->pprev = head;
+}
+
+static inline void unlink_timer(struct timer *timer) {
+  *timer->pprev = timer->next;
+  if (timer->next != NULL) timer->next->pprev = timer->pprev;
+  timer->next = NULL;
+  timer->pprev = NULL;
+}
+
+static inline uint64_t rotr64(uint64_t x, uint32_t r) {
+  return r == 0 ? x : (x >> r) | (x << (64 - r));
+}
+
+// Files `timer` according to its deadline relative to the wheel.
+static void place(struct timer_wheel *wheel, struct timer *timer) {
+  if (timer->deadline <= wheel->now) {
+    timer->slot = EXPIRED_SLOT;
+    link_timer(&wheel->expired, timer);
+    return;
+  }
+  uint64_t delta = timer->deadline - wheel->now;
+  uint64_t deadline = delta < SPAN ? timer->deadline : wheel->now + SPAN - 1;
+  delta = deadline - wheel->now;
+  uint32_t level = 0;
+  while (delta >= (uint64_t)1 << (SLOT_BITS * (level + 1))) level++;
+  uint32_t index = (uint32_t)(deadline >> (SLOT_BITS * level)) & SLOT_MASK;
+  timer->slot = level * SLOTS + index;
+  link_timer(&wheel->slots[level][index], timer);
+  wheel->occupied[level] |= (uint64_t)1 << index;
+}
+
+// Computes the next tick at which a slot needs processing. A slot at
+// level `l` is processed when the wheel reaches the start of its span.
+static bool next_event(const struct timer_wheel *wheel, uint64_t *tick) {
+  bool found = false;
+  uint64_t best = UINT64_MAX;
+  for (uint32_t level = 0; level < LEVELS; level++) {
+    if (wheel->occupied[level] == 0) continue;
+    uint32_t shift = SLOT_BITS * level;
+    uint32_t current = (uint32_t)(wheel->now >> shift) & SLOT_MASK;
+    uint64_t ahead = rotr64(wheel->occupied[level], (current + 1) & SLOT_MASK);
+    uint64_t k = (uint64_t)__builtin_ctzll(ahead) + 1;
+    uint64_t t = ((wheel->now >> shift) + k) << shift;
+    if (t < best) best = t;
+    found = true;
+  }
+  *tick = best;
+  return found;
+}
+
+timer_wheel_result_t timer_wheel_new(uint64_t now, timer_wheel_t *wheel) {
+  struct timer_wheel *tw = (struct timer_wheel*)calloc(1, sizeof(struct timer_wheel));
+  if (tw == NULL) return TIMER_WHEEL_MEM_ERR;
+  tw->now = now;
+  *wheel = tw;
+  return TIMER_WHEEL_OK;
+}
+
+void timer_wheel_delete(timer_wheel_t wheel) {
+  free(wheel);
+}
+
+void timer_wheel_disarm(timer_wheel_t wheel, struct timer *timer) {
+  if (!timer_armed(timer)) return;
+  uint32_t slot = timer->slot;
+  unlink_timer(timer);
+  wheel->count--;
+  if (slot == EXPIRED_SLOT) return;
+  uint32_t level = slot / SLOTS, index = slot % SLOTS;
+  if (wheel->slots[level][index] == NULL)
+    wheel->occupied[level] &= ~((uint64_t)1 << index);
+}
+
+void timer_wheel_arm(timer_wheel_t wheel, struct timer *timer, uint64_t deadline) {
+  timer_wheel_disarm(wheel, timer);
+  timer->deadline = deadline;
+  place(wheel, timer);
+  wheel->count++;
+}
+
+uint32_t timer_wheel_advance(timer_wheel_t wheel, uint64_t now, struct timer **expired) {
+  uint64_t tick;
+  while (next_event(wheel, &tick) && tick <= now) {
+    wheel->now = tick;
+    // Cascade every level whose span starts at `tick`, top-down, then
+    // reap the bottom slot.
+    for (uint32_t level = LEVELS; level-- > 0;) {
+      uint32_t shift = SLOT_BITS * level;
+      if ((tick & (((uint64_t)1 << shift) - 1)) != 0) continue;
+      uint32_t index = (uint32_t)(tick >> shift) & SLOT_MASK;
+      struct timer *timer = wheel->slots[level][index];
+      wheel->slots[level][index] = NULL;
+      wheel->occupied[level] &= ~((uint64_t)1 << index);
+      while (timer != NULL) {
+        struct timer *next = timer->next;
+        place(wheel, timer);
+        timer = next;
+      }
+    }
+  }
+  if (now > wheel->now) wheel->now = now;
+
+  // Hand out the expired timers.
+  uint32_t n = 0;
+  *expired = wheel->expired;
+  for (struct timer *timer = wheel->expired; timer != NULL; timer = timer->next) {
+    timer->pprev = NULL;
+    n++;
+  }
+  wheel->expired = NULL;
+  wheel->count -= n;
+  return n;
+}
+
+bool timer_wheel_next(timer_wheel_t wheel, uint64_t *deadline) {
+  if (wheel->expired != NULL) {
+    *deadline = wheel->now;
+    return true;
+  }
+  return next_event(wheel, deadline);
+}
+
+#undef LEVELS
+#undef SLOT_BITS
+#undef SLOTS
+#undef SLOT_MASK
+#undef SPAN
+#undef EXPIRED_SLOT
@@ -1,16 +1,100 @@
+#define _POSIX_C_SOURCE 200809L // for clock_gettime
 #include <assert.h>
+#include <buf_pool.h>
 #include <errno.h>
 #include <fiber.h>
+#include <fiber_local.h>
+#include <fiber_pool.h>
 #include <freelist.h>
 #include <limits.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <timer_wheel.h>
 #include <unistd.h>
 #include <waeio.h>
 #include <wasio.h>
 
 #define FIBER_KILL_SIGNAL INT32_MIN
+#define FIBER_TIMEOUT_SIGNAL (INT32_MIN + 1)
+#define FIBER_CANCEL_SIGNAL (INT32_MIN + 2)
+
+// Default deadline, in milliseconds, for a connection to make progress
+// in `waeio_recv`, `waeio_send`, and friends. Zero disables it.
+#ifndef WAEIO_IDLE_TIMEOUT_MS
+#define WAEIO_IDLE_TIMEOUT_MS 0
+#endif
+
+// Polling policy used by `waeio_main`; see `enum waeio_poll_policy`.
+#ifndef WAEIO_POLL_POLICY
+#define WAEIO_POLL_POLICY WAEIO_POLL_BALANCED
+#endif
+
+// How long, in microseconds, the balanced policy keeps polling without
+// blocking after the last sign of activity.
+#ifndef WAEIO_SPIN_BUDGET_US
+#define WAEIO_SPIN_BUDGET_US 50
+#endif
+
+// Number of connection fibers allocated up front, and the maximum
+// number of finished fibers kept around for reuse.
+#ifndef WAEIO_FIBER_POOL_WARM
+#define WAEIO_FIBER_POOL_WARM 16
+#endif
+
+#ifndef WAEIO_FIBER_POOL_CAP
+#define WAEIO_FIBER_POOL_CAP MAX_CONNECTIONS
+#endif
+
+// Maximum number of idle I/O buffers kept per size class.
+#ifndef WAEIO_BUF_POOL_CAP
+#define WAEIO_BUF_POOL_CAP 64
+#endif
+
+// Room in the vfd tables, beyond the connection limit, for listeners,
+// pipes, and upstream connections.
+#ifndef WAEIO_VFD_HEADROOM
+#define WAEIO_VFD_HEADROOM 64
+#endif
+
+// Maximum number of connections accepted per hostcall.
+#ifndef WAEIO_ACCEPT_BATCH
+#define WAEIO_ACCEPT_BATCH 64
+#endif
+
+// Maximum number of idle upstream connections kept for reuse.
+#ifndef WAEIO_UPSTREAM_POOL_SIZE
+#define WAEIO_UPSTREAM_POOL_SIZE 64
+#endif
+
+// Completion mode: accept, recv, send, and close are written to a
+// submission ring in linear memory and executed by a host thread,
+// which posts their results to a completion ring. The scheduler drains
+// completions rather than polling, and the I/O itself overlaps with
+// guest execution. Readiness waits (e.g. by `waeio_sendv`) become ring
+// operations too.
+#ifndef WAEIO_COMPLETION_RING
+#define WAEIO_COMPLETION_RING 0
+#endif
+
+#if WAEIO_COMPLETION_RING
+#if WASIO_BACKEND != 2
+#error "the completion ring requires the host poll backend"
+#endif
+#include <host/errno.h>
+#include <host/ring.h>
+
+#ifndef WAEIO_RING_ENTRIES
+#define WAEIO_RING_ENTRIES 2048
+#endif
+static_assert((WAEIO_RING_ENTRIES & (WAEIO_RING_ENTRIES - 1)) == 0, "WAEIO_RING_ENTRIES must be a power of two");
+// Every fiber may have one operation in flight. A larger connection
+// limit set at runtime is clamped accordingly.
+static_assert(WAEIO_RING_ENTRIES >= MAX_CONNECTIONS + 1, "WAEIO_RING_ENTRIES is too small");
+#endif
 
 enum cmd_tag {
   ACCEPT,
@@ -18,6 +102,10 @@ enum cmd_tag {
   SUSPEND,
   RECV,
   SEND,
+  SLEEP,
+#if WAEIO_COMPLETION_RING
+  SUBMIT,
+#endif
   QUIT
 };
 
@@ -30,68 +118,428 @@ typedef struct cmd {
       wasio_fd_t arg;
     };
     // IO command
-    wasio_fd_t vfd;
+    struct {
+      wasio_fd_t vfd;
+      // Ring operation, only used by SUBMIT.
+      uint32_t opcode;
+      uint8_t *buf;
+      uint32_t len;
+    };
   };
+  // Deadline in milliseconds on the monotonic clock. When it passes the
+  // fiber is resumed with FIBER_TIMEOUT_SIGNAL.
+  bool timed;
+  uint64_t deadline;
+  // The following are maintained by the scheduler whilst the command
+  // is pending.
+#if WAEIO_COMPLETION_RING
+  // The signal the command fails with once the host has abandoned it,
+  // or 0 if it has not been cancelled.
+  int32_t interrupted;
+#endif
+  fiber_t fiber;
+  void *local;
+  struct timer timer;
 } cmd_t;
 
+// A runnable fiber. A connection is scheduled before its fiber exists:
+// `fiber` is NULL until the closure first runs, at which point a fiber
+// for `entry` is drawn from the pool. `local` is the fiber's
+// fiber-local storage, if any.
 struct fiber_closure {
   fiber_t fiber;
+  fiber_entry_point_t entry;
   void *arg;
+  void *local;
 };
 
-// Queue interface
-struct qnode {
-  struct qnode *next;
-  struct fiber_closure clo;
-};
-
+// Queue interface. A queue is a FIFO ring which doubles when full; the
+// indices run freely and are masked on access.
 struct queue {
-  struct qnode *next;
+  uint32_t head;
+  uint32_t tail;
+  uint32_t mask;
+  struct fiber_closure q[];
 };
 
-static inline void queue_push(struct queue *q, struct fiber_closure clo) {
-  struct qnode *node = (struct qnode*)malloc(sizeof(struct qnode));
-  node->clo = clo;
-  node->next = q->next;
-  q->next = node;
+// Allocates a queue with room for at least `capacity` closures.
+static struct queue* queue_new(uint32_t capacity) {
+  uint32_t size = 1;
+  while (size < capacity) size <<= 1;
+  struct queue *q = (struct queue*)malloc(sizeof(struct queue) + size * sizeof(struct fiber_closure));
+  if (q == NULL) return NULL;
+  q->head = q->tail = 0;
+  q->mask = size - 1;
+  return q;
+}
+
+// Moves the contents of `q` to the front of a queue twice its size.
+static struct queue* queue_grow(struct queue *q) {
+  struct queue *grown = queue_new(2 * (q->mask + 1));
+  if (grown == NULL) abort();
+  for (uint32_t i = q->head; i != q->tail; i++)
+    grown->q[grown->tail++] = q->q[i & q->mask];
+  free(q);
+  return grown;
+}
+
+// NOTE(dhil): A fiber sits in at most one queue at a time, so a queue
+// sized for the connection limit only grows if the application spawns
+// fibers beyond it.
+static inline void queue_push(struct queue **q, struct fiber_closure clo) {
+  if ((*q)->tail - (*q)->head > (*q)->mask) *q = queue_grow(*q);
+  (*q)->q[(*q)->tail++ & (*q)->mask] = clo;
 }
 
 static inline struct fiber_closure queue_pop(struct queue *q) {
-  if (q == NULL) abort();
-  struct qnode *next = q->next;
-  q->next = next->next;
-  struct fiber_closure clo = next->clo;
-  free(next);
-  return clo;
+  if (q->head == q->tail) abort();
+  return q->q[q->head++ & q->mask];
 }
 
 static inline bool queue_is_empty(const struct queue *q) {
-  return q->next == NULL;
+  return q->head == q->tail;
 }
 
+// An idle upstream connection, keyed by its peer.
+struct upstream {
+  char addr[16]; // Fits any dotted-quad IPv4 address.
+  int32_t port;
+  wasio_fd_t vfd;
+};
+
 struct waeio_ctl {
-  uint32_t nconns;
-  uint32_t max_conns;
   struct queue *frontq;
   struct queue *rearq;
   struct wasio_pollfd wfd;
   struct wasio_event *ev;
-  fiber_t fibers[MAX_CONNECTIONS];
+  fiber_pool_t pool;
+  buf_pool_t bufs;
+  // The command a fiber is parked on, by vfd. The parked vfds are also
+  // kept densely, such that shutting down visits only those. The
+  // tables cover `nvfds` vfds.
+  cmd_t **parked;
+  uint32_t nparked;
+  wasio_fd_t *parked_vfds;
+  uint32_t *parked_index;
+  // Set once the scheduler is shutting down.
+  bool draining;
+  timer_wheel_t timers;
+  struct waeio_poll_config poll;
+  // Whether the scheduler has been idle since `spin_start`.
+  bool spinning;
+  uint64_t spin_start;
+  // Idle upstream connections; the most recently returned is last.
+  uint32_t nidle;
+  struct upstream idle[WAEIO_UPSTREAM_POOL_SIZE];
+#if WAEIO_COMPLETION_RING
+  struct host_ring ring;
+  uint32_t inflight;
+  struct host_ring_sqe sqes[WAEIO_RING_ENTRIES];
+  struct host_ring_cqe cqes[WAEIO_RING_ENTRIES];
+#endif
 };
 
-static struct waeio_ctl ctl = {0};
+static struct waeio_ctl sched;
+static struct waeio_ctl *const ctl = &sched;
+
+// Pending cancellations, by vfd; see `waeio_cancel`.
+static bool *cancelled;
+
+// Number of vfds covered by the tables indexed by vfd. They are sized
+// for the connection limit at startup, and grow geometrically.
+static uint32_t nvfds = 0;
+
+// The connection limit; see `waeio_set_max_connections`.
+static uint32_t max_conns = 0;
+
+// Number of live connections.
+static uint32_t nconns = 0;
+static int32_t idle_timeout_ms = WAEIO_IDLE_TIMEOUT_MS;
+
+// Connections accepted by the last batch, but not yet handed out.
+static struct {
+  uint32_t next;
+  uint32_t len;
+  wasio_fd_t vfds[WAEIO_ACCEPT_BATCH];
+} accepted;
+
+static inline uint64_t now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static inline uint64_t now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+// Applies `timeout` milliseconds, or none if negative, to `cmd`.
+static inline void set_deadline(cmd_t *cmd, int32_t timeout) {
+  cmd->timed = timeout >= 0;
+  cmd->deadline = cmd->timed ? now_ms() + (uint64_t)timeout : 0;
+}
+
+static inline int32_t idle_timeout(void) {
+  return idle_timeout_ms > 0 ? idle_timeout_ms : -1;
+}
+
+static inline void conns_add(int32_t n) {
+  nconns += (uint32_t)n;
+}
+
+static inline uint32_t conns(void) {
+  return nconns;
+}
+
+// Makes `clo` runnable.
+static inline void schedule(struct fiber_closure clo) {
+  queue_push(&ctl->rearq, clo);
+}
 
 static inline void queue_swap(void) {
-  struct queue *tmp = ctl.frontq;
-  ctl.frontq = ctl.rearq;
-  ctl.rearq = tmp;
+  struct queue *tmp = ctl->frontq;
+  ctl->frontq = ctl->rearq;
+  ctl->rearq = tmp;
+}
+
+// Reallocates `table` to hold `to` entries of `size` bytes, the ones
+// from `from` onwards cleared.
+static void* resize_table(void *table, size_t size, uint32_t from, uint32_t to) {
+  unsigned char *grown = (unsigned char*)realloc(table, size * to);
+  if (grown == NULL) return NULL;
+  if (to > from) memset(grown + size * from, 0, size * (to - from));
+  return grown;
+}
+
+// Resizes the tables indexed by vfd to cover `size` vfds. On failure
+// the tables keep covering `nvfds` vfds.
+static bool resize_vfds(uint32_t size) {
+  cmd_t **parked = (cmd_t**)resize_table(ctl->parked, sizeof(cmd_t*), nvfds, size);
+  if (parked == NULL) return false;
+  ctl->parked = parked;
+  wasio_fd_t *parked_vfds = (wasio_fd_t*)resize_table(ctl->parked_vfds, sizeof(wasio_fd_t), nvfds, size);
+  if (parked_vfds == NULL) return false;
+  ctl->parked_vfds = parked_vfds;
+  uint32_t *parked_index = (uint32_t*)resize_table(ctl->parked_index, sizeof(uint32_t), nvfds, size);
+  if (parked_index == NULL) return false;
+  ctl->parked_index = parked_index;
+  bool *cancels = (bool*)resize_table(cancelled, sizeof(bool), nvfds, size);
+  if (cancels == NULL) return false;
+  cancelled = cancels;
+  nvfds = size;
+  return true;
 }
 
+static void free_vfds(void) {
+  free(ctl->parked);
+  free(ctl->parked_vfds);
+  free(ctl->parked_index);
+  ctl->parked = NULL;
+  ctl->parked_vfds = NULL;
+  ctl->parked_index = NULL;
+  free(cancelled);
+  cancelled = NULL;
+  nvfds = 0;
+}
+
+// Whether the tables indexed by vfd cover `vfd`, growing them if
+// needed.
+static inline bool cover(wasio_fd_t vfd) {
+  if (vfd < 0) return false;
+  if ((uint32_t)vfd < nvfds) return true;
+  uint32_t size = 2 * nvfds;
+  if (size <= (uint32_t)vfd) size = (uint32_t)vfd + 1;
+  return resize_vfds(size);
+}
+
+// Makes room in the pollset for `n` more vfds.
+static inline bool make_room(uint32_t n) {
+  return wasio_reserve(&ctl->wfd, ctl->wfd.length + n) == WASIO_OK;
+}
+
+// Records that `vfd` was just created. Any cancellation aimed at a
+// previous holder of `vfd` lapses. Returns false if `vfd` is beyond the
+// tables, in which case it must not be used.
+static inline bool claim(wasio_fd_t vfd) {
+  if (!cover(vfd)) return false;
+  cancelled[vfd] = false;
+  return true;
+}
+
+// Closes `vfd` on behalf of a connection which never gets to run.
+static inline void discard(wasio_fd_t vfd) {
+  (void)wasio_close(&ctl->wfd, vfd);
+}
+
+// Consumes the pending cancellation of `vfd`, if any.
+static inline bool take_cancel(wasio_fd_t vfd) {
+  if (!cancelled[vfd]) return false;
+  cancelled[vfd] = false;
+  return true;
+}
+
+static inline void park(wasio_fd_t vfd, cmd_t *cmd) {
+  if (ctl->parked[vfd] == NULL) {
+    ctl->parked_index[vfd] = ctl->nparked;
+    ctl->parked_vfds[ctl->nparked++] = vfd;
+  }
+  ctl->parked[vfd] = cmd;
+}
+
+static inline void unpark(wasio_fd_t vfd) {
+  wasio_fd_t last = ctl->parked_vfds[--ctl->nparked];
+  ctl->parked_vfds[ctl->parked_index[vfd]] = last;
+  ctl->parked_index[last] = ctl->parked_index[vfd];
+  ctl->parked[vfd] = NULL;
+}
+
+// Makes the fiber which yielded `cmd` runnable again, and has the
+// command fail with `signal`.
+static inline void interrupt(cmd_t *cmd, int32_t signal) {
+  timer_wheel_disarm(ctl->timers, &cmd->timer);
+  schedule((struct fiber_closure){ .fiber = cmd->fiber, .arg = (void*)(intptr_t)signal, .local = cmd->local });
+}
+
+#if !WAEIO_COMPLETION_RING
+// Vacates the slot of the command parked on `vfd`, and drops its
+// pollset interest, such that readiness nobody waits for any longer is
+// not reported.
+static inline void abandon(wasio_fd_t vfd) {
+  unpark(vfd);
+  (void)wasio_notify_clear(&ctl->wfd, vfd);
+}
+
+// Delivers the pending cancellation of `vfd` to the fiber parked on it,
+// if there is one. Otherwise the fiber is cancelled as soon as it parks.
+static void cancel_parked(wasio_fd_t vfd) {
+  cmd_t *cmd = ctl->parked[vfd];
+  if (cmd == NULL || !take_cancel(vfd)) return;
+  abandon(vfd);
+  interrupt(cmd, FIBER_CANCEL_SIGNAL);
+}
+
+#endif
+
+// Whether a shut down scheduler has no fibers left.
+static bool drained(void) {
+  bool idle = queue_is_empty(ctl->frontq) && queue_is_empty(ctl->rearq) && ctl->nparked == 0;
+#if WAEIO_COMPLETION_RING
+  // The host must be done with the memory of every operation, closes
+  // included.
+  idle = idle && ctl->inflight == 0;
+#endif
+  return idle;
+}
+
+// Whether `revents` concerns the operation `cmd` is parked on. Errors
+// and hangups concern every operation.
+static inline bool awaits(const cmd_t *cmd, uint32_t revents) {
+  uint32_t events = cmd->tag == SEND ? WASIO_POLLOUT : WASIO_POLLIN;
+#ifdef WASIO_POLLNVAL
+  events |= WASIO_POLLNVAL;
+#endif
+  return (revents & (events | WASIO_POLLERR | WASIO_POLLHUP)) != 0;
+}
+
+#if WAEIO_COMPLETION_RING
+// NOTE(dhil): The ring indices are shared with a host thread. The
+// acquire/release accesses compile to plain loads and stores on wasm32
+// without the threads proposal, which the host observes in program
+// order on x86-64.
+static inline void ring_push(uint32_t opcode, wasio_fd_t vfd, uint8_t *buf, uint32_t len, cmd_t *cmd) {
+  uint32_t tail = ctl->ring.sq_tail;
+  // NOTE(dhil): Cancellations take up submission entries on top of the
+  // operations in flight, so the submission ring may fill up; the host
+  // drains it without the guest having to wait for completions.
+  while (tail - __atomic_load_n(&ctl->ring.sq_head, __ATOMIC_ACQUIRE) == WAEIO_RING_ENTRIES)
+    (void)host_ring_enter(0, 0, &host_errno);
+  ctl->sqes[tail & (WAEIO_RING_ENTRIES - 1)] = (struct host_ring_sqe){
+    .opcode = opcode, .fd = vfd, .buf = buf, .len = len, .user_data = (uint64_t)(uintptr_t)cmd
+  };
+  __atomic_store_n(&ctl->ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static inline void ring_submit(cmd_t *cmd, uint32_t opcode, wasio_fd_t vfd, uint8_t *buf, uint32_t len) {
+  ring_push(opcode, vfd, buf, len, cmd);
+  ctl->inflight++;
+}
+
+// Submits the operation of `cmd`, which stays parked on its vfd until
+// it completes, such that it can be cancelled. A cancellation which is
+// already pending for the vfd fails the command at once.
+static inline void ring_park(cmd_t *cmd, uint32_t opcode, uint8_t *buf, uint32_t len) {
+  if (take_cancel(cmd->vfd)) {
+    interrupt(cmd, FIBER_CANCEL_SIGNAL);
+    return;
+  }
+  park(cmd->vfd, cmd);
+  ring_submit(cmd, opcode, cmd->vfd, buf, len);
+}
+
+// Asks the host to abandon the operation of `cmd`. Unless the operation
+// completes first, the command then fails with `signal`. The fiber is
+// only resumed by the completion, as the host may still be using the
+// command's buffer until then.
+static inline void ring_cancel(cmd_t *cmd, int32_t signal) {
+  if (cmd->interrupted != 0) return;
+  cmd->interrupted = signal;
+  timer_wheel_disarm(ctl->timers, &cmd->timer);
+  ring_push(HOST_RING_OP_CANCEL, cmd->vfd, NULL, 0, cmd);
+}
+#endif
+
+// Starts shutting down the scheduler: every fiber is woken with
+// FIBER_KILL_SIGNAL, and is refused whatever it asks for from then on,
+// until it runs to completion. Only live fibers are visited.
+static void begin_drain(void) {
+  ctl->draining = true;
+#if WAEIO_COMPLETION_RING
+  // The fibers parked on the ring are resumed once the host has given
+  // up on their operations.
+  for (uint32_t i = 0; i < ctl->nparked; i++)
+    ring_cancel(ctl->parked[ctl->parked_vfds[i]], FIBER_KILL_SIGNAL);
+#else
+  while (ctl->nparked > 0) {
+    wasio_fd_t vfd = ctl->parked_vfds[ctl->nparked - 1];
+    cmd_t *cmd = ctl->parked[vfd];
+    abandon(vfd);
+    interrupt(cmd, FIBER_KILL_SIGNAL);
+  }
+#endif
+  // Whatever remains on the wheel is asleep.
+  struct timer *expired;
+  (void)timer_wheel_advance(ctl->timers, UINT64_MAX, &expired);
+  while (expired != NULL) {
+    cmd_t *cmd = (cmd_t*)((char*)expired - offsetof(cmd_t, timer));
+    expired = expired->next;
+    interrupt(cmd, FIBER_KILL_SIGNAL);
+  }
+}
+
+// Resumes `fiber` with its fiber-local storage installed.
+static inline void* resume(fiber_t fiber, void *local, void *arg, fiber_result_t *status) {
+  fiber_local_install(local);
+  return fiber_resume(fiber, arg, status);
+}
+
+// Releases the fiber-local storage of the fiber which just finished.
+static inline void release_local(void) {
+  fiber_local_delete(fiber_local());
+  fiber_local_install(NULL);
+}
+
+// NOTE(dhil): The storage installed whilst handling a request belongs
+// to `yieldee`, as it is the fiber which was resumed last.
 static bool handle_request(fiber_t yieldee, fiber_result_t status, void *payload) {
   switch (status) {
   case FIBER_OK: { // Run to completion.
-    ctl.nconns--;
-    free(yieldee);
+    // NOTE(dhil): Connection fibers are pooled and never return, so
+    // this is the main fiber, which `waeio_main` frees.
+    (void)yieldee;
+    release_local();
+    conns_add(-1);
   }
     break;
   case FIBER_ERROR: { // TODO(dhil): decide what to do...
@@ -99,31 +547,83 @@ static bool handle_request(fiber_t yieldee, fiber_result_t status, void *payload
   }
     break;
   case FIBER_YIELD: {
+    if (payload == FIBER_POOL_FINISHED) { // Pooled fiber ran to completion.
+      release_local();
+      conns_add(-1);
+      fiber_pool_release(ctl->pool, yieldee);
+      break;
+    }
     cmd_t *cmd = (cmd_t*)payload;
+    cmd->fiber = yieldee;
+    cmd->local = fiber_local();
+    if (ctl->draining) {
+      // NOTE(dhil): A connection spawned now would never run.
+      if (cmd->tag == ASYNC) discard(cmd->arg);
+      interrupt(cmd, FIBER_KILL_SIGNAL);
+      break;
+    }
+    if (cmd->timed)
+      timer_wheel_arm(ctl->timers, &cmd->timer, cmd->deadline);
     switch (cmd->tag) {
     case ASYNC: {
-      uint32_t vfd = (uint32_t)(intptr_t)cmd->arg;
-      fiber_t child = fiber_alloc(cmd->entry);
-      ctl.fibers[vfd] = child;
-      queue_push(ctl.rearq, (struct fiber_closure){ .fiber = child, .arg = (void*)(intptr_t)vfd });
+      struct fiber_closure child = { .fiber = NULL, .entry = cmd->entry, .arg = (void*)(intptr_t)cmd->arg };
+      conns_add(1);
+      schedule(child);
     } // fall through
     case SUSPEND:
-      queue_push(ctl.rearq, (struct fiber_closure){ .fiber = yieldee, .arg = NULL });
+      schedule((struct fiber_closure){ .fiber = yieldee, .arg = NULL, .local = cmd->local });
+      break;
+    case SLEEP:
+      // NOTE(dhil): the fiber is enqueued by its timer.
+      break;
+#if WAEIO_COMPLETION_RING
+    case ACCEPT:
+    case RECV:
+      ring_park(cmd, HOST_RING_OP_POLL, NULL, HOST_POLLIN);
       break;
+    case SEND:
+      ring_park(cmd, HOST_RING_OP_POLL, NULL, HOST_POLLOUT);
+      break;
+    case SUBMIT:
+      // NOTE(dhil): A close must not displace the command of a fiber
+      // parked on the same vfd, which the close cancels anyway.
+      if (cmd->opcode == HOST_RING_OP_CLOSE)
+        ring_submit(cmd, cmd->opcode, cmd->vfd, cmd->buf, cmd->len);
+      else
+        ring_park(cmd, cmd->opcode, cmd->buf, cmd->len);
+      break;
+#else
     case ACCEPT:
     case RECV: {
-      uint32_t vfd = (uint32_t)(intptr_t)cmd->arg;
-      wasio_notify_recv(&ctl.wfd, vfd);
+      // NOTE(dhil): A fiber may park on a vfd other than its own,
+      // e.g. the far end of a splice, so record who to wake up.
+      uint32_t vfd = (uint32_t)cmd->vfd;
+      if (take_cancel(vfd)) {
+        interrupt(cmd, FIBER_CANCEL_SIGNAL);
+        break;
+      }
+      park(vfd, cmd);
+      wasio_notify_recv(&ctl->wfd, vfd);
     }
       break;
     case SEND: {
-      uint32_t vfd = (uint32_t)(intptr_t)cmd->arg;
-      wasio_notify_send(&ctl.wfd, vfd);
+      uint32_t vfd = (uint32_t)cmd->vfd;
+      if (take_cancel(vfd)) {
+        interrupt(cmd, FIBER_CANCEL_SIGNAL);
+        break;
+      }
+      park(vfd, cmd);
+      wasio_notify_send(&ctl->wfd, vfd);
       // NOTE(dhil): the fiber is implicitly enqueued by the I/O subsystem.
     }
       break;
+#endif
     case QUIT:
-      return false;
+      begin_drain();
+      // Killed fibers which block again are killed again; everyone
+      // else carries on until they block.
+      schedule((struct fiber_closure){ .fiber = yieldee, .arg = NULL, .local = cmd->local });
+      break;
     }
   }
     break;
@@ -131,55 +631,268 @@ static bool handle_request(fiber_t yieldee, fiber_result_t status, void *payload
   return true;
 }
 
+// Milliseconds until the nearest deadline, 0 if there are ready
+// fibers, and -1 if there is nothing to wait for. Within the spin
+// budget following activity the scheduler does not block at all, and
+// it never blocks for longer than the policy permits.
+static int32_t poll_timeout(void) {
+  if (!queue_is_empty(ctl->frontq) || ctl->draining) return 0;
+  if (ctl->poll.max_block_ms == 0) return 0;
+  if (ctl->poll.spin_us > 0) {
+    // NOTE(dhil): The clock is only read once the scheduler has run out
+    // of work, which keeps it off the hot path under load.
+    uint64_t now = now_us();
+    if (!ctl->spinning) {
+      ctl->spinning = true;
+      ctl->spin_start = now;
+      return 0;
+    }
+    if (now - ctl->spin_start < ctl->poll.spin_us) return 0;
+  }
+  int32_t timeout = -1;
+  uint64_t deadline;
+  if (timer_wheel_next(ctl->timers, &deadline)) {
+    uint64_t now = now_ms();
+    if (deadline <= now) return 0;
+    timeout = deadline - now > INT32_MAX ? INT32_MAX : (int32_t)(deadline - now);
+  }
+  if (ctl->poll.max_block_ms > 0 && (timeout < 0 || timeout > ctl->poll.max_block_ms))
+    timeout = ctl->poll.max_block_ms;
+  return timeout;
+}
+
+// Resumes the fibers whose deadlines have passed.
+static bool expire_timers(bool *active) {
+  struct timer *expired;
+  if (timer_wheel_advance(ctl->timers, now_ms(), &expired) == 0)
+    return true;
+  *active = true;
+  fiber_result_t status;
+  while (expired != NULL) {
+    cmd_t *cmd = (cmd_t*)((char*)expired - offsetof(cmd_t, timer));
+    // The command lives on the fiber's stack; it must not be touched
+    // once the fiber runs again.
+    expired = expired->next;
+#if WAEIO_COMPLETION_RING
+    // The fiber is resumed once the host has given up on the operation.
+    if (cmd->tag != SLEEP) {
+      ring_cancel(cmd, FIBER_TIMEOUT_SIGNAL);
+      continue;
+    }
+#else
+    if (cmd->tag != SLEEP && ctl->parked[cmd->vfd] == cmd)
+      abandon(cmd->vfd);
+#endif
+    fiber_t fiber = cmd->fiber;
+    void *ans = resume(fiber, cmd->local, (void*)(intptr_t)FIBER_TIMEOUT_SIGNAL, &status);
+    if (!handle_request(fiber, status, ans)) return false;
+  }
+  return true;
+}
+
+// Drops the idle upstream connection at `i` from the pool.
+static inline void upstream_remove(uint32_t i) {
+  memmove(&ctl->idle[i], &ctl->idle[i + 1], sizeof(struct upstream) * (ctl->nidle - i - 1));
+  ctl->nidle--;
+}
+
+#if !WAEIO_COMPLETION_RING
+// Closes `vfd` if it is an idle upstream connection: nobody waits on
+// it, so any event means the peer has hung up or broken protocol.
+static void evict_upstream(wasio_fd_t vfd) {
+  for (uint32_t i = 0; i < ctl->nidle; i++) {
+    if (ctl->idle[i].vfd != vfd) continue;
+    upstream_remove(i);
+    (void)waeio_close(vfd);
+    return;
+  }
+}
+#endif
+
 static bool run_next(void) {
   // First run all ready fibers.
   fiber_result_t status;
   bool keep_going = true;
-  while (!queue_is_empty(ctl.frontq) && keep_going) {
-    struct fiber_closure clo = queue_pop(ctl.frontq);
-    void *ans = fiber_resume(clo.fiber, clo.arg, &status);
+  bool active = !queue_is_empty(ctl->frontq);
+  while (!queue_is_empty(ctl->frontq) && keep_going) {
+    struct fiber_closure clo = queue_pop(ctl->frontq);
+    if (clo.fiber == NULL) { // A connection which is yet to start.
+      if (ctl->draining) {
+        discard((wasio_fd_t)(intptr_t)clo.arg);
+        conns_add(-1);
+        continue;
+      }
+      clo.fiber = fiber_pool_acquire(ctl->pool, clo.entry, clo.arg, &clo.arg);
+      if (clo.fiber == NULL) abort();
+    }
+    void *ans = resume(clo.fiber, clo.local, clo.arg, &status);
     keep_going = handle_request(clo.fiber, status, ans);
   }
   // Swap front and rear queues.
   queue_swap();
-  // Now poll.
-  uint32_t nready;
-  if (wasio_poll(&ctl.wfd, ctl.ev, ctl.max_conns, &nready, 0) != WASIO_OK)
+#if WAEIO_COMPLETION_RING
+  // Publish submissions and reap completions. Block only if there is
+  // nothing else to do, and no longer than the nearest deadline.
+  int32_t timeout = poll_timeout();
+  // A draining scheduler has nothing left to do but wait for the host to
+  // finish the operations in flight.
+  if (ctl->draining && queue_is_empty(ctl->frontq) && ctl->inflight > 0) timeout = -1;
+  uint32_t min_complete = timeout != 0 && (ctl->inflight > 0 || timeout > 0) ? 1 : 0;
+  // The host holds back submissions whose completions might not fit;
+  // they go through once the completions below have been consumed.
+  if (host_ring_enter(min_complete, timeout, &host_errno) < 0 && host_errno != HOST_EBUSY)
     return false;
-  WASIO_EVENT_FOREACH(&ctl.wfd, ctl.ev, nready, vfd, {
-      void *ans = fiber_resume(ctl.fibers[vfd], &status, (void*)(intptr_t)0);
-      if (!handle_request(ctl.fibers[vfd], status, ans)) return false;
+  uint32_t head = ctl->ring.cq_head;
+  uint32_t tail = __atomic_load_n(&ctl->ring.cq_tail, __ATOMIC_ACQUIRE);
+  if (head != tail) active = true;
+  while (head != tail) {
+    struct host_ring_cqe cqe = ctl->cqes[head & (WAEIO_RING_ENTRIES - 1)];
+    __atomic_store_n(&ctl->ring.cq_head, ++head, __ATOMIC_RELEASE);
+    ctl->inflight--;
+    cmd_t *cmd = (cmd_t*)(uintptr_t)cqe.user_data;
+    if (ctl->parked[cmd->vfd] == cmd) unpark(cmd->vfd);
+    timer_wheel_disarm(ctl->timers, &cmd->timer);
+    int32_t res = cmd->interrupted != 0 && cqe.res == -HOST_ECANCELED ? cmd->interrupted : cqe.res;
+    fiber_t fiber = cmd->fiber;
+    void *ans = resume(fiber, cmd->local, (void*)(intptr_t)res, &status);
+    if (!handle_request(fiber, status, ans)) return false;
+  }
+#else
+  // Now poll. Block only if there is nothing else to do, and no longer
+  // than the nearest deadline.
+  uint32_t nready;
+  int32_t timeout = poll_timeout();
+  wasio_result_t res = wasio_poll(&ctl->wfd, ctl->ev, max_conns, &nready, timeout);
+  if (res != WASIO_OK) return false;
+  WASIO_EVENT_FOREACH(&ctl->wfd, ctl->ev, nready, vfd, revents, {
+      // Only wake up fibers which are actually waiting on the vfd, for
+      // the event at hand. Only they count as activity.
+      cmd_t *cmd = ctl->parked[vfd];
+      if (cmd != NULL && awaits(cmd, revents)) {
+        active = true;
+        fiber_t fiber = cmd->fiber;
+        unpark(vfd);
+        timer_wheel_disarm(ctl->timers, &cmd->timer);
+        void *ans = resume(fiber, cmd->local, (void*)(intptr_t)0, &status);
+        if (!handle_request(fiber, status, ans)) return false;
+      } else if (cmd == NULL) {
+        evict_upstream(vfd);
+      }
     });
-  return keep_going;
+#endif
+  if (!expire_timers(&active)) return false;
+  // Any activity restarts the spin budget.
+  if (active) ctl->spinning = false;
+  return keep_going && !(ctl->draining && drained());
+}
+
+// Runs the scheduler until it has shut down.
+static void run(void) {
+  while (run_next()) {}
+  // Whatever ran last must not leave its storage behind.
+  fiber_local_install(NULL);
+}
+
+struct waeio_poll_config waeio_poll_preset(enum waeio_poll_policy policy) {
+  switch (policy) {
+  case WAEIO_POLL_BUSY:
+    return (struct waeio_poll_config){ .spin_us = 0, .max_block_ms = 0 };
+  case WAEIO_POLL_POWERSAVE:
+    return (struct waeio_poll_config){ .spin_us = 0, .max_block_ms = -1 };
+  case WAEIO_POLL_BALANCED:
+  default:
+    return (struct waeio_poll_config){ .spin_us = WAEIO_SPIN_BUDGET_US, .max_block_ms = -1 };
+  }
 }
 
 int waeio_main(void* (*listener)(wasio_fd_t*)) {
-  ctl.frontq = (struct queue*)malloc(sizeof(struct queue));
-  ctl.rearq  = (struct queue*)malloc(sizeof(struct queue));
-  ctl.nconns = 0;
-  ctl.max_conns = MAX_CONNECTIONS;
-  assert(wasio_init(&ctl.wfd, ctl.max_conns) == WASIO_OK);
-  ctl.ev = WASIO_EVENT_INITIALISER(ctl.max_conns);
+  struct waeio_poll_config config = waeio_poll_preset(WAEIO_POLL_POLICY);
+  return waeio_main_ex(listener, &config);
+}
+
+static void ctl_init(const struct waeio_poll_config *config) {
+  ctl->poll = *config;
+  ctl->spinning = false;
+  ctl->draining = false;
+  ctl->nparked = 0;
+  // Every connection has at most one fiber, plus the listener's.
+  ctl->frontq = queue_new(max_conns + 1);
+  ctl->rearq  = queue_new(max_conns + 1);
+  assert(ctl->frontq != NULL && ctl->rearq != NULL);
+  assert(timer_wheel_new(now_ms(), &ctl->timers) == TIMER_WHEEL_OK);
+  assert(fiber_pool_new(WAEIO_FIBER_POOL_WARM, WAEIO_FIBER_POOL_CAP, &ctl->pool) == FIBER_POOL_OK);
+  assert(buf_pool_new(WAEIO_BUF_POOL_CAP, &ctl->bufs) == BUF_POOL_OK);
+  assert(wasio_init(&ctl->wfd, max_conns) == WASIO_OK);
+  ctl->ev = WASIO_EVENT_INITIALISER(max_conns);
+}
+
+static void ctl_finalize(void) {
+  // Connections spawned after the scheduler had shut down.
+  struct queue *qs[2] = { ctl->frontq, ctl->rearq };
+  for (uint32_t i = 0; i < 2; i++) {
+    while (!queue_is_empty(qs[i])) {
+      struct fiber_closure clo = queue_pop(qs[i]);
+      if (clo.fiber != NULL) continue;
+      discard((wasio_fd_t)(intptr_t)clo.arg);
+      conns_add(-1);
+    }
+  }
+  for (uint32_t i = 0; i < ctl->nidle; i++)
+    (void)wasio_close(&ctl->wfd, ctl->idle[i].vfd);
+  ctl->nidle = 0;
+  wasio_finalize(&ctl->wfd);
+  free(ctl->ev);
+  free(ctl->frontq);
+  free(ctl->rearq);
+  timer_wheel_delete(ctl->timers);
+  fiber_pool_delete(ctl->pool);
+  // Buffers still out on loan are freed on release.
+  buf_pool_delete(ctl->bufs);
+  ctl->bufs = NULL;
+}
+
+// The connection limit set by `waeio_set_max_connections`, or else by
+// the environment, or else at compile time.
+static uint32_t connection_limit(void) {
+  uint32_t limit = max_conns;
+  if (limit == 0) {
+    const char *env = getenv("WAEIO_MAX_CONNECTIONS");
+    unsigned long n = env != NULL ? strtoul(env, NULL, 10) : 0;
+    limit = n > 0 && n <= UINT32_MAX / 4 ? (uint32_t)n : MAX_CONNECTIONS;
+  }
+#if WAEIO_COMPLETION_RING
+  if (limit > WAEIO_RING_ENTRIES - 1) limit = WAEIO_RING_ENTRIES - 1;
+#endif
+  return limit;
+}
+
+int waeio_main_ex(void* (*listener)(wasio_fd_t*), const struct waeio_poll_config *config) {
+  max_conns = connection_limit();
+  assert(resize_vfds(max_conns + WAEIO_VFD_HEADROOM));
+  ctl_init(config);
   // Open listener socket.
   wasio_fd_t servsock;
-  assert(wasio_listen(&ctl.wfd, &servsock, 8080, 1000) == WASIO_OK);
-  ctl.nconns++;
+  assert(make_room(1));
+  assert(wasio_listen(&ctl->wfd, &servsock, 8080, 1000) == WASIO_OK);
+  assert(claim(servsock));
+  conns_add(1);
+#if WAEIO_COMPLETION_RING
+  // Hand the rings to the host.
+  ctl->inflight = 0;
+  ctl->ring = (struct host_ring){ .entries = WAEIO_RING_ENTRIES, .sqes = ctl->sqes, .cqes = ctl->cqes };
+  assert(host_ring_setup(&ctl->ring, &host_errno) == 0);
+#endif
   // Allocate fiber for main.
   fiber_t mainfiber = fiber_alloc((fiber_entry_point_t)(void*)listener);
-  ctl.fibers[(uint32_t)servsock] = mainfiber;
   // Enqueue main (TODO)
-  queue_push(ctl.frontq, (struct fiber_closure){ .fiber = mainfiber, .arg = &servsock });
+  queue_push(&ctl->frontq, (struct fiber_closure){ .fiber = mainfiber, .arg = &servsock, .local = NULL });
   // Enter scheduling loop.
-  bool keep_going = true;
-  while (keep_going) {
-    keep_going = run_next();
-  }
+  run();
   // Clean up
   fiber_free(mainfiber);
-  wasio_close(&ctl.wfd, servsock);
-  wasio_finalize(&ctl.wfd);
-  free(ctl.frontq);
-  free(ctl.rearq);
+  wasio_close(&ctl->wfd, servsock);
+  ctl_finalize();
+  free_vfds();
   return 0;
 }
 
@@ -194,13 +907,36 @@ static inline bool is_busy(wasio_result_t res) {
   return res == WASIO_EAGAIN;
 }
 
+// Sets errno for a failed wasio operation, which does not say more
+// than `res` about the cause.
+static inline int fail_with(wasio_result_t res) {
+  switch (res) {
+  case WASIO_EFULL: errno = EMFILE; break;
+  case WASIO_EAGAIN: errno = EAGAIN; break;
+  case WASIO_ECONN: errno = ECONNRESET; break;
+  case WASIO_EINPROGRESS: errno = EINPROGRESS; break;
+  default: errno = EIO; break;
+  }
+  return -1;
+}
+
 int waeio_accept(wasio_fd_t vfd, wasio_fd_t *new_conn) {
+  // Hand out connections from the previous batch first.
+  if (accepted.next < accepted.len) {
+    *new_conn = accepted.vfds[accepted.next++];
+    return 0;
+  }
+
   cmd_t cmd = { .tag = ACCEPT, .vfd = vfd };
   wasio_result_t res;
   do {
     int ans;
     ans = (int)fiber_yield(&cmd);
 
+    if (ans == FIBER_CANCEL_SIGNAL) {
+      errno = ECANCELED;
+      return -1;
+    }
     if (ans < 0) {
       if (ans == FIBER_KILL_SIGNAL) errno = FIBER_KILL_SIGNAL;
       return ans;
@@ -208,7 +944,7 @@ int waeio_accept(wasio_fd_t vfd, wasio_fd_t *new_conn) {
 
     // Keep suspending if there is insufficient space to accept new
     // connections.
-    while (ctl.nconns == ctl.max_conns) {
+    while (conns() >= max_conns) {
       cmd_t cmd = { .tag = SUSPEND, .vfd = -1 };
       ans = (int)fiber_yield(&cmd);
       if (ans < 0) {
@@ -217,16 +953,60 @@ int waeio_accept(wasio_fd_t vfd, wasio_fd_t *new_conn) {
       }
     }
 
-    res = wasio_accept(&ctl.wfd, vfd, new_conn);
-    if (res == WASIO_OK)
+    // Drain as much of the backlog as there is room for.
+    uint32_t room = max_conns - conns();
+    if (room > WAEIO_ACCEPT_BATCH) room = WAEIO_ACCEPT_BATCH;
+    uint32_t naccepted = 0;
+    (void)make_room(room);
+    res = wasio_accept_many(&ctl->wfd, vfd, accepted.vfds, room, &naccepted);
+    if (res == WASIO_OK) {
+      // Connections beyond the vfd tables are turned away.
+      uint32_t n = 0;
+      for (uint32_t i = 0; i < naccepted; i++) {
+        if (claim(accepted.vfds[i])) accepted.vfds[n++] = accepted.vfds[i];
+        else (void)wasio_close(&ctl->wfd, accepted.vfds[i]);
+      }
+      if (n == 0) {
+        res = WASIO_EAGAIN;
+        continue;
+      }
+      accepted.len = n;
+      accepted.next = 1;
+      *new_conn = accepted.vfds[0];
       return 0;
+    }
   } while (is_busy(res));
 
   return -1;
 }
 
+#if WAEIO_COMPLETION_RING
+// Executes an operation on the ring and returns its result, a negated
+// host errno, or a signal, for which errno is set.
+static inline int ring_op(uint32_t opcode, wasio_fd_t vfd, uint8_t *buf, uint32_t len, int32_t timeout) {
+  cmd_t cmd = { .tag = SUBMIT, .vfd = vfd, .opcode = opcode, .buf = buf, .len = len };
+  set_deadline(&cmd, timeout);
+  int ans = (int)(intptr_t)fiber_yield(&cmd);
+  if (ans == FIBER_KILL_SIGNAL) errno = FIBER_KILL_SIGNAL;
+  else if (ans == FIBER_TIMEOUT_SIGNAL) errno = ETIMEDOUT;
+  else if (ans == FIBER_CANCEL_SIGNAL) errno = ECANCELED;
+  return ans;
+}
+#endif
+
 int waeio_recv(wasio_fd_t vfd, uint8_t *buf, uint32_t len) {
+  return waeio_recv_timeout(vfd, buf, len, idle_timeout());
+}
+
+int waeio_recv_timeout(wasio_fd_t vfd, uint8_t *buf, uint32_t len, int32_t timeout) {
+#if WAEIO_COMPLETION_RING
+  int ans = ring_op(HOST_RING_OP_RECV, vfd, buf, len, timeout);
+  if (ans == FIBER_KILL_SIGNAL) return ans;
+  // End of stream is reported as an error, like `wasio_recv` does.
+  return ans > 0 ? ans : -1;
+#else
   cmd_t cmd = { .tag = RECV, .vfd = vfd };
+  set_deadline(&cmd, timeout);
   uint32_t recvlen = 0;
   wasio_result_t res;
   do {
@@ -235,16 +1015,63 @@ int waeio_recv(wasio_fd_t vfd, uint8_t *buf, uint32_t len) {
       errno = FIBER_KILL_SIGNAL;
       return ans;
     }
-    res = wasio_recv(&ctl.wfd, vfd, buf, len, &recvlen);
+    if (ans == FIBER_TIMEOUT_SIGNAL) {
+      errno = ETIMEDOUT;
+      return -1;
+    }
+    if (ans == FIBER_CANCEL_SIGNAL) {
+      errno = ECANCELED;
+      return -1;
+    }
+    res = wasio_recv(&ctl->wfd, vfd, buf, len, &recvlen);
     if (res == WASIO_OK)
       return recvlen;
   } while (is_busy(res));
 
   return -1;
+#endif
 }
 
 int waeio_send(wasio_fd_t vfd, uint8_t *buf, uint32_t len) {
+  return waeio_send_timeout(vfd, buf, len, idle_timeout());
+}
+
+int waeio_send_timeout(wasio_fd_t vfd, uint8_t *buf, uint32_t len, int32_t timeout) {
+#if WAEIO_COMPLETION_RING
+  int ans = ring_op(HOST_RING_OP_SEND, vfd, buf, len, timeout);
+  if (ans == FIBER_KILL_SIGNAL) return ans;
+  return ans >= 0 ? ans : -1;
+#else
+  cmd_t cmd = { .tag = SEND, .vfd = vfd };
+  set_deadline(&cmd, timeout);
+  uint32_t sendlen = 0;
+  wasio_result_t res;
+  do {
+    int ans = (int)fiber_yield(&cmd);
+    if (ans == FIBER_KILL_SIGNAL) {
+      errno = FIBER_KILL_SIGNAL;
+      return ans;
+    }
+    if (ans == FIBER_TIMEOUT_SIGNAL) {
+      errno = ETIMEDOUT;
+      return -1;
+    }
+    if (ans == FIBER_CANCEL_SIGNAL) {
+      errno = ECANCELED;
+      return -1;
+    }
+    res = wasio_send(&ctl->wfd, vfd, buf, len, &sendlen);
+    if (res == WASIO_OK)
+      return sendlen;
+  } while (is_busy(res));
+
+  return -1;
+#endif
+}
+
+int waeio_sendv(wasio_fd_t vfd, const struct wasio_iovec *iov, uint32_t iovcnt) {
   cmd_t cmd = { .tag = SEND, .vfd = vfd };
+  set_deadline(&cmd, idle_timeout());
   uint32_t sendlen = 0;
   wasio_result_t res;
   do {
@@ -253,7 +1080,15 @@ int waeio_send(wasio_fd_t vfd, uint8_t *buf, uint32_t len) {
       errno = FIBER_KILL_SIGNAL;
       return ans;
     }
-    res = wasio_send(&ctl.wfd, vfd, buf, len, &sendlen);
+    if (ans == FIBER_TIMEOUT_SIGNAL) {
+      errno = ETIMEDOUT;
+      return -1;
+    }
+    if (ans == FIBER_CANCEL_SIGNAL) {
+      errno = ECANCELED;
+      return -1;
+    }
+    res = wasio_sendv(&ctl->wfd, vfd, iov, iovcnt, &sendlen);
     if (res == WASIO_OK)
       return sendlen;
   } while (is_busy(res));
@@ -261,8 +1096,254 @@ int waeio_send(wasio_fd_t vfd, uint8_t *buf, uint32_t len) {
   return -1;
 }
 
+int waeio_sendfile(wasio_fd_t vfd, wasio_fd_t file_vfd, int64_t offset, uint32_t len) {
+  cmd_t cmd = { .tag = SEND, .vfd = vfd };
+  set_deadline(&cmd, idle_timeout());
+  uint32_t sendlen = 0;
+  wasio_result_t res;
+  do {
+    int ans = (int)fiber_yield(&cmd);
+    if (ans == FIBER_KILL_SIGNAL) {
+      errno = FIBER_KILL_SIGNAL;
+      return ans;
+    }
+    if (ans == FIBER_TIMEOUT_SIGNAL) {
+      errno = ETIMEDOUT;
+      return -1;
+    }
+    if (ans == FIBER_CANCEL_SIGNAL) {
+      errno = ECANCELED;
+      return -1;
+    }
+    res = wasio_sendfile(&ctl->wfd, vfd, file_vfd, offset, len, &sendlen);
+    if (res == WASIO_OK)
+      return sendlen;
+  } while (is_busy(res));
+
+  return -1;
+}
+
+int waeio_splice(wasio_fd_t in_vfd, wasio_fd_t out_vfd, uint32_t len) {
+  // Wait for input first. Should the transfer stall on the output
+  // instead, wait for it to drain before retrying, and so forth. The
+  // deadline covers the transfer as a whole.
+  cmd_t cmd = { .tag = RECV, .vfd = in_vfd };
+  set_deadline(&cmd, idle_timeout());
+  uint32_t splicelen = 0;
+  wasio_result_t res;
+  do {
+    int ans = (int)fiber_yield(&cmd);
+    if (ans == FIBER_KILL_SIGNAL) {
+      errno = FIBER_KILL_SIGNAL;
+      return ans;
+    }
+    if (ans == FIBER_TIMEOUT_SIGNAL) {
+      errno = ETIMEDOUT;
+      return -1;
+    }
+    if (ans == FIBER_CANCEL_SIGNAL) {
+      errno = ECANCELED;
+      return -1;
+    }
+    res = wasio_splice(&ctl->wfd, in_vfd, out_vfd, len, &splicelen);
+    if (res == WASIO_OK)
+      return splicelen;
+    if (res == WASIO_ECONN)
+      return 0;
+    cmd.tag = cmd.tag == RECV ? SEND : RECV;
+    cmd.vfd = cmd.tag == RECV ? in_vfd : out_vfd;
+  } while (is_busy(res));
+
+  return -1;
+}
+
+int waeio_sleep(uint32_t ms) {
+  cmd_t cmd = { .tag = SLEEP, .timed = true, .deadline = now_ms() + ms };
+  int ans = (int)fiber_yield(&cmd);
+  if (ans == FIBER_KILL_SIGNAL) {
+    errno = FIBER_KILL_SIGNAL;
+    return ans;
+  }
+  return 0;
+}
+
+void* waeio_fiber_local(uint32_t size) {
+  void *local = fiber_local();
+  if (local == NULL) {
+    local = fiber_local_new(size);
+    fiber_local_install(local);
+  }
+  assert(local == NULL || fiber_local_size(local) >= size);
+  return local;
+}
+
+void* waeio_buf_acquire(uint32_t size) {
+  return buf_pool_acquire(ctl->bufs, size);
+}
+
+uint32_t waeio_buf_capacity(const void *buf) {
+  return buf_pool_capacity(buf);
+}
+
+void waeio_buf_retain(void *buf) {
+  buf_pool_retain(buf);
+}
+
+void waeio_buf_release(void *buf) {
+  buf_pool_release(ctl->bufs, buf);
+}
+
+int waeio_buf_stats(struct buf_pool_stats *stats) {
+  if (ctl->bufs == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+  buf_pool_stats(ctl->bufs, stats);
+  return BUF_POOL_NCLASSES;
+}
+
+void waeio_set_idle_timeout(int32_t ms) {
+  idle_timeout_ms = ms;
+}
+
+void waeio_set_max_connections(uint32_t n) {
+  max_conns = n;
+}
+
+int waeio_connect(const char *addr, int32_t port, wasio_fd_t *vfd) {
+  return waeio_connect_timeout(addr, port, vfd, idle_timeout());
+}
+
+int waeio_connect_timeout(const char *addr, int32_t port, wasio_fd_t *vfd, int32_t timeout) {
+  if (!make_room(1)) {
+    errno = ENOMEM;
+    return -1;
+  }
+  wasio_result_t res = wasio_connect(&ctl->wfd, vfd, addr, port);
+  if (res != WASIO_OK && res != WASIO_EINPROGRESS) return fail_with(res);
+  if (!claim(*vfd)) {
+    (void)wasio_close(&ctl->wfd, *vfd);
+    errno = EMFILE;
+    return -1;
+  }
+  if (res == WASIO_OK) return 0;
+
+  // Park until the connection is writable, i.e. established or failed.
+  cmd_t cmd = { .tag = SEND, .vfd = *vfd };
+  set_deadline(&cmd, timeout);
+  int ans = (int)fiber_yield(&cmd);
+  if (ans == FIBER_KILL_SIGNAL) {
+    (void)wasio_close(&ctl->wfd, *vfd);
+    errno = FIBER_KILL_SIGNAL;
+    return ans;
+  }
+  if (ans == FIBER_TIMEOUT_SIGNAL) {
+    (void)wasio_close(&ctl->wfd, *vfd);
+    errno = ETIMEDOUT;
+    return -1;
+  }
+  if (ans == FIBER_CANCEL_SIGNAL) {
+    (void)wasio_close(&ctl->wfd, *vfd);
+    errno = ECANCELED;
+    return -1;
+  }
+  res = wasio_connect_result(&ctl->wfd, *vfd);
+  if (res != WASIO_OK) {
+    (void)wasio_close(&ctl->wfd, *vfd);
+    return fail_with(res);
+  }
+  return 0;
+}
+
+// Whether the idle connection `vfd` is still usable: the peer has
+// neither hung up nor sent anything unsolicited.
+static bool upstream_alive(wasio_fd_t vfd) {
+  uint8_t byte;
+  uint32_t recvlen = 0;
+  return wasio_recv(&ctl->wfd, vfd, &byte, 1, &recvlen) == WASIO_EAGAIN;
+}
+
+int waeio_upstream_acquire(const char *addr, int32_t port, wasio_fd_t *vfd, bool *reused) {
+  // Prefer the most recently used connection, it is the least likely
+  // to have been timed out by the peer.
+  for (uint32_t i = ctl->nidle; i > 0; i--) {
+    struct upstream *up = &ctl->idle[i - 1];
+    if (up->port != port || strcmp(up->addr, addr) != 0) continue;
+    wasio_fd_t candidate = up->vfd;
+    upstream_remove(i - 1);
+    if (upstream_alive(candidate)) {
+      *vfd = candidate;
+      *reused = true;
+      return 0;
+    }
+    (void)waeio_close(candidate);
+  }
+  *reused = false;
+  return waeio_connect(addr, port, vfd);
+}
+
+int waeio_upstream_release(const char *addr, int32_t port, wasio_fd_t vfd) {
+  if (ctl->nidle == WAEIO_UPSTREAM_POOL_SIZE || strlen(addr) >= sizeof(ctl->idle[0].addr))
+    return waeio_close(vfd);
+#if !WAEIO_COMPLETION_RING
+  // Watch the connection while it sits in the pool, such that a hang
+  // up evicts it (see `evict_upstream`).
+  if (wasio_notify_recv(&ctl->wfd, vfd) != WASIO_OK)
+    return waeio_close(vfd);
+#endif
+  struct upstream *up = &ctl->idle[ctl->nidle++];
+  strcpy(up->addr, addr);
+  up->port = port;
+  up->vfd = vfd;
+  return 0;
+}
+
+int waeio_open(const char *path, wasio_fd_t *vfd) {
+  return wasio_open(&ctl->wfd, path, vfd) == WASIO_OK ? 0 : -1;
+}
+
+int waeio_pipe(wasio_fd_t *rvfd, wasio_fd_t *wvfd) {
+  if (!make_room(2)) {
+    errno = ENOMEM;
+    return -1;
+  }
+  if (wasio_pipe(&ctl->wfd, rvfd, wvfd) != WASIO_OK) return -1;
+  if (!claim(*rvfd) || !claim(*wvfd)) {
+    (void)wasio_close(&ctl->wfd, *rvfd);
+    (void)wasio_close(&ctl->wfd, *wvfd);
+    errno = EMFILE;
+    return -1;
+  }
+  return 0;
+}
+
 int waeio_close(wasio_fd_t vfd) {
-  return wasio_close(&ctl.wfd, vfd) == WASIO_OK ? 0 : -1;
+#if WAEIO_COMPLETION_RING
+  // Closing through the ring cancels any operations still parked on
+  // the fd.
+  int ans = ring_op(HOST_RING_OP_CLOSE, vfd, NULL, 0, -1);
+  if (ans == FIBER_KILL_SIGNAL) return ans;
+  return ans == 0 ? 0 : -1;
+#else
+  return wasio_close(&ctl->wfd, vfd) == WASIO_OK ? 0 : -1;
+#endif
+}
+
+int waeio_cancel(wasio_fd_t vfd) {
+  if (vfd < 0 || (uint32_t)vfd >= nvfds) {
+    errno = EBADF;
+    return -1;
+  }
+  if (ctl->draining) return 0;
+#if WAEIO_COMPLETION_RING
+  cmd_t *cmd = ctl->parked[vfd];
+  if (cmd != NULL) ring_cancel(cmd, FIBER_CANCEL_SIGNAL);
+  else cancelled[vfd] = true;
+#else
+  cancelled[vfd] = true;
+  cancel_parked(vfd);
+#endif
+  return 0;
 }
 
 void waeio_cancel_all(void) {
@@ -270,5 +1351,15 @@ void waeio_cancel_all(void) {
   (void)fiber_yield(&cmd);
 }
 
+#undef WAEIO_FIBER_POOL_WARM
+#undef WAEIO_FIBER_POOL_CAP
+#undef WAEIO_ACCEPT_BATCH
+#undef WAEIO_VFD_HEADROOM
+#undef WAEIO_UPSTREAM_POOL_SIZE
 #undef FIBER_KILL_SIGNAL
+#undef FIBER_TIMEOUT_SIGNAL
+#undef FIBER_CANCEL_SIGNAL
+#undef WAEIO_IDLE_TIMEOUT_MS
+#undef WAEIO_POLL_POLICY
+#undef WAEIO_SPIN_BUDGET_US
 
@@ -0,0 +1,342 @@
+// A host epoll based implementation of WASIO.
+
+#include <assert.h>
+#include <freelist.h>
+#include <host/epoll.h>
+#include <host/errno.h>
+#include <host/socket.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wasio.h>
+
+// Spreads the reuse of vfds over the table, such that a vfd which was
+// just closed is not handed out again straight away.
+#ifndef WASIO_ROTATE_VFDS
+#define WASIO_ROTATE_VFDS 0
+#endif
+
+static inline wasio_result_t translate_error(int32_t errno) {
+  if (errno == HOST_EAGAIN || errno == HOST_EWOULDBLOCK) {
+    return WASIO_EAGAIN;
+  } else {
+    return WASIO_ERROR;
+  }
+}
+
+// Installs `fd` in the vfd table and registers `events` with the
+// host. The registration persists until the vfd is closed. Regular
+// files cannot be registered with epoll, hence they are installed with
+// `events = 0`, which skips the registration.
+static wasio_result_t wasio_wrap(struct wasio_pollfd *wfd, int32_t fd, uint32_t events, wasio_fd_t /* out */ *vfd) {
+  uint32_t entry;
+  if (freelist_next(wfd->fl, &entry) != FREELIST_OK)
+    return WASIO_EFULL;
+  if (events != 0 && host_epoll_ctl(wfd->epfd, HOST_EPOLL_CTL_ADD, fd, events, (int32_t)entry, &host_errno) < 0) {
+    assert(freelist_reclaim(wfd->fl, entry) == FREELIST_OK);
+    return translate_error(host_errno);
+  }
+  wfd->fds[entry] = fd;
+  wfd->interest[entry] = events;
+  wfd->wanted[entry] = 0;
+  wfd->length++;
+  *vfd = (wasio_fd_t)entry;
+  return WASIO_OK;
+}
+
+wasio_result_t wasio_init(struct wasio_pollfd *wfd, uint32_t capacity) {
+  if (freelist_new(capacity, &wfd->fl) != FREELIST_OK)
+    return WASIO_EFULL;
+  freelist_rotate(wfd->fl, WASIO_ROTATE_VFDS);
+  int32_t epfd = host_epoll_create(&host_errno);
+  if (epfd < 0) {
+    freelist_delete(wfd->fl);
+    return translate_error(host_errno);
+  }
+  wfd->epfd = epfd;
+  wfd->capacity = capacity;
+  wfd->length = 0;
+  wfd->fds = (int32_t*)malloc(sizeof(int32_t)*capacity);
+  wfd->interest = (uint32_t*)malloc(sizeof(uint32_t)*capacity);
+  wfd->wanted = (uint32_t*)malloc(sizeof(uint32_t)*capacity);
+  if (wfd->fds == NULL || wfd->interest == NULL || wfd->wanted == NULL) {
+    wasio_finalize(wfd);
+    return WASIO_ERROR;
+  }
+  for (uint32_t i = 0; i < capacity; i++) {
+    wfd->fds[i] = -1;
+    wfd->interest[i] = 0;
+    wfd->wanted[i] = 0;
+  }
+  return WASIO_OK;
+}
+
+wasio_result_t wasio_reserve(struct wasio_pollfd *wfd, uint32_t capacity) {
+  if (capacity <= wfd->capacity) return WASIO_OK;
+  if (capacity < 2 * wfd->capacity) capacity = 2 * wfd->capacity;
+  // NOTE(dhil): The vfd arrays grow first, such that the freelist never
+  // hands out an entry which they do not cover.
+  int32_t *fds = (int32_t*)realloc(wfd->fds, sizeof(int32_t)*capacity);
+  if (fds == NULL) return WASIO_EFULL;
+  wfd->fds = fds;
+  uint32_t *interest = (uint32_t*)realloc(wfd->interest, sizeof(uint32_t)*capacity);
+  if (interest == NULL) return WASIO_EFULL;
+  wfd->interest = interest;
+  uint32_t *wanted = (uint32_t*)realloc(wfd->wanted, sizeof(uint32_t)*capacity);
+  if (wanted == NULL) return WASIO_EFULL;
+  wfd->wanted = wanted;
+  for (uint32_t i = wfd->capacity; i < capacity; i++) {
+    wfd->fds[i] = -1;
+    wfd->interest[i] = 0;
+    wfd->wanted[i] = 0;
+  }
+  if (freelist_resize(&wfd->fl, capacity) != FREELIST_OK)
+    return WASIO_EFULL;
+  wfd->capacity = capacity;
+  return WASIO_OK;
+}
+
+void wasio_finalize(struct wasio_pollfd *wfd) {
+  (void)host_close(wfd->epfd, &host_errno);
+  freelist_delete(wfd->fl);
+  free(wfd->fds);
+  free(wfd->interest);
+  free(wfd->wanted);
+  wfd->epfd = -1;
+  wfd->length = 0;
+  wfd->capacity = 0;
+}
+
+wasio_result_t wasio_listen(struct wasio_pollfd *wfd, wasio_fd_t /* out */ *vfd, int32_t port, int32_t backlog) {
+  int32_t fd = host_listen(port, backlog, &host_errno);
+  if (fd < 0) return translate_error(host_errno);
+  wasio_result_t res = wasio_wrap(wfd, fd, WASIO_POLLIN, vfd);
+  if (res != WASIO_OK) (void)host_close(fd, &host_errno);
+  return res;
+}
+
+static_assert(sizeof(struct wasio_listen_opts) == sizeof(struct host_listen_opts), "size of struct wasio_listen_opts");
+static_assert(WASIO_SOCKOPT_NODELAY == HOST_SOCKOPT_NODELAY && WASIO_SOCKOPT_RCVBUF == HOST_SOCKOPT_RCVBUF, "option names");
+
+wasio_result_t wasio_listen_ex(struct wasio_pollfd *wfd, wasio_fd_t /* out */ *vfd, int32_t port, const struct wasio_listen_opts *opts) {
+  int32_t fd = host_listen_ex(port, (const struct host_listen_opts*)opts, &host_errno);
+  if (fd < 0) return translate_error(host_errno);
+  wasio_result_t res = wasio_wrap(wfd, fd, WASIO_POLLIN, vfd);
+  if (res != WASIO_OK) (void)host_close(fd, &host_errno);
+  return res;
+}
+
+wasio_result_t wasio_setsockopt(struct wasio_pollfd *wfd, wasio_fd_t vfd, enum wasio_sockopt name, int32_t value) {
+  int32_t ans = host_setsockopt(wfd->fds[vfd], (int32_t)name, value, &host_errno);
+  if (ans < 0) return translate_error(host_errno);
+  return WASIO_OK;
+}
+
+wasio_result_t wasio_poll( struct wasio_pollfd *wfd
+                         , struct wasio_event *ev
+                         , uint32_t max_events
+                         , uint32_t *nready
+                         , int32_t timeout ) {
+  int32_t ans = host_epoll_wait(wfd->epfd, (struct host_epoll_event*)ev, max_events, timeout, &host_errno);
+  if (ans < 0) return translate_error(host_errno);
+
+  // Filter out events nobody is waiting for, and compact the
+  // remainder in-place.
+  uint32_t n = 0;
+  for (uint32_t i = 0; i < (uint32_t)ans; i++) {
+    wasio_fd_t vfd = ev[i].vfd;
+    // Error conditions are always of interest.
+    uint32_t revents = ev[i].revents & (wfd->wanted[vfd] | WASIO_POLLERR | WASIO_POLLHUP);
+    bool deliver = wfd->wanted[vfd] != 0 && revents != 0;
+    // NOTE(dhil): Registrations are level-triggered, so interest nobody
+    // has a use for would be reported by every wait. Read interest stays
+    // after a delivery, as the reader is likely to come back; write
+    // interest is dropped as sockets are almost always writable; and
+    // unwanted readiness drops whatever is not waited for. A vfd without
+    // interest is registered one-shot, as epoll reports hangups and
+    // errors regardless, such that they are reported once at most.
+    uint32_t keep = deliver ? WASIO_POLLIN : wfd->wanted[vfd];
+    if (keep != wfd->interest[vfd]) {
+      if (host_epoll_ctl(wfd->epfd, HOST_EPOLL_CTL_MOD, wfd->fds[vfd], keep != 0 ? keep : HOST_EPOLLONESHOT, vfd, &host_errno) < 0)
+        return translate_error(host_errno);
+      wfd->interest[vfd] = keep;
+    }
+    if (!deliver) continue;
+    wfd->wanted[vfd] = 0;
+    ev[n++] = (struct wasio_event){ .vfd = vfd, .revents = revents };
+  }
+  *nready = n;
+  return WASIO_OK;
+}
+
+wasio_result_t wasio_accept(struct wasio_pollfd *wfd, wasio_fd_t vfd, wasio_fd_t *new_conn) {
+  int32_t fd = host_accept(wfd->fds[vfd], &host_errno);
+  if (fd < 0) return translate_error(host_errno);
+  wasio_result_t res = wasio_wrap(wfd, fd, WASIO_POLLIN, new_conn);
+  if (res != WASIO_OK) (void)host_close(fd, &host_errno);
+  return res;
+}
+
+wasio_result_t wasio_accept_many(struct wasio_pollfd *wfd, wasio_fd_t vfd, wasio_fd_t *new_conns, uint32_t max, uint32_t *naccepted) {
+  uint32_t room = wfd->capacity - wfd->length;
+  if (max > room) max = room;
+  if (max == 0) return WASIO_EFULL;
+  // The host fds are written to `new_conns` and then replaced in-place
+  // by their vfds.
+  int32_t ans = host_accept_many(wfd->fds[vfd], (int32_t*)new_conns, max, &host_errno);
+  if (ans < 0) return translate_error(host_errno);
+  for (int32_t i = 0; i < ans; i++) {
+    wasio_result_t res = wasio_wrap(wfd, new_conns[i], WASIO_POLLIN, &new_conns[i]);
+    if (res != WASIO_OK) {
+      // Drop the connections that could not be registered.
+      for (int32_t j = i; j < ans; j++)
+        (void)host_close(new_conns[j], &host_errno);
+      if (i == 0) return res;
+      ans = i;
+      break;
+    }
+  }
+  *naccepted = (uint32_t)ans;
+  return WASIO_OK;
+}
+
+wasio_result_t wasio_connect(struct wasio_pollfd *wfd, wasio_fd_t /* out */ *vfd, const char *addr, int32_t port) {
+  host_errno = 0;
+  int32_t fd = host_connect(addr, (uint32_t)strlen(addr), port, &host_errno);
+  if (fd < 0) return translate_error(host_errno);
+  bool in_progress = host_errno == HOST_EINPROGRESS;
+  wasio_result_t res = wasio_wrap(wfd, fd, WASIO_POLLIN, vfd);
+  if (res != WASIO_OK) {
+    (void)host_close(fd, &host_errno);
+    return res;
+  }
+  return in_progress ? WASIO_EINPROGRESS : WASIO_OK;
+}
+
+wasio_result_t wasio_connect_result(struct wasio_pollfd *wfd, wasio_fd_t vfd) {
+  if (host_connect_result(wfd->fds[vfd], &host_errno) < 0) return translate_error(host_errno);
+  return WASIO_OK;
+}
+
+wasio_result_t wasio_recv(struct wasio_pollfd *wfd, wasio_fd_t vfd, uint8_t *buf, uint32_t len, uint32_t *recvlen) {
+  int32_t ans = host_recv(wfd->fds[vfd], buf, len, &host_errno);
+  if (ans == 0) return WASIO_ECONN;
+  if (ans < 0) return translate_error(host_errno);
+  *recvlen = (uint32_t)ans;
+  return WASIO_OK;
+}
+
+wasio_result_t wasio_send(struct wasio_pollfd *wfd, wasio_fd_t vfd, uint8_t *buf, uint32_t len, uint32_t *sendlen) {
+  int32_t ans = host_send(wfd->fds[vfd], buf, len, &host_errno);
+  if (ans < 0) return translate_error(host_errno);
+  *sendlen = (uint32_t)ans;
+  return WASIO_OK;
+}
+
+static_assert(sizeof(struct wasio_iovec) == sizeof(struct host_iovec), "size of struct wasio_iovec");
+static_assert(offsetof(struct wasio_iovec, len) == offsetof(struct host_iovec, len), "offset of len");
+
+wasio_result_t wasio_recvv(struct wasio_pollfd *wfd, wasio_fd_t vfd, const struct wasio_iovec *iov, uint32_t iovcnt, uint32_t *recvlen) {
+  int32_t ans = host_recvv(wfd->fds[vfd], (const struct host_iovec*)iov, iovcnt, &host_errno);
+  if (ans == 0) return WASIO_ECONN;
+  if (ans < 0) return translate_error(host_errno);
+  *recvlen = (uint32_t)ans;
+  return WASIO_OK;
+}
+
+wasio_result_t wasio_sendv(struct wasio_pollfd *wfd, wasio_fd_t vfd, const struct wasio_iovec *iov, uint32_t iovcnt, uint32_t *sendlen) {
+  int32_t ans = host_sendv(wfd->fds[vfd], (const struct host_iovec*)iov, iovcnt, &host_errno);
+  if (ans < 0) return translate_error(host_errno);
+  *sendlen = (uint32_t)ans;
+  return WASIO_OK;
+}
+
+wasio_result_t wasio_open(struct wasio_pollfd *wfd, const char *path, wasio_fd_t /* out */ *vfd) {
+  int32_t fd = host_open(path, (uint32_t)strlen(path), &host_errno);
+  if (fd < 0) return translate_error(host_errno);
+  wasio_result_t res = wasio_wrap(wfd, fd, 0, vfd);
+  if (res != WASIO_OK) (void)host_close(fd, &host_errno);
+  return res;
+}
+
+wasio_result_t wasio_pipe(struct wasio_pollfd *wfd, wasio_fd_t /* out */ *rvfd, wasio_fd_t /* out */ *wvfd) {
+  if (wfd->capacity - wfd->length < 2) return WASIO_EFULL;
+  int32_t fds[2];
+  if (host_pipe(fds, &host_errno) < 0) return translate_error(host_errno);
+  // NOTE(dhil): The write end is registered for read interest too;
+  // it never becomes readable, but `wasio_notify_send` relies on the
+  // registration being present.
+  wasio_result_t res = wasio_wrap(wfd, fds[0], WASIO_POLLIN, rvfd);
+  if (res != WASIO_OK) {
+    (void)host_close(fds[0], &host_errno);
+    (void)host_close(fds[1], &host_errno);
+    return res;
+  }
+  res = wasio_wrap(wfd, fds[1], WASIO_POLLIN, wvfd);
+  if (res != WASIO_OK) {
+    (void)wasio_close(wfd, *rvfd);
+    (void)host_close(fds[1], &host_errno);
+  }
+  return res;
+}
+
+wasio_result_t wasio_sendfile(struct wasio_pollfd *wfd, wasio_fd_t vfd, wasio_fd_t file_vfd, int64_t offset, uint32_t len, uint32_t *sendlen) {
+  int32_t ans = host_sendfile(wfd->fds[vfd], wfd->fds[file_vfd], offset, len, &host_errno);
+  if (ans < 0) return translate_error(host_errno);
+  *sendlen = (uint32_t)ans;
+  return WASIO_OK;
+}
+
+wasio_result_t wasio_splice(struct wasio_pollfd *wfd, wasio_fd_t in_vfd, wasio_fd_t out_vfd, uint32_t len, uint32_t *splicelen) {
+  int32_t ans = host_splice(wfd->fds[in_vfd], wfd->fds[out_vfd], len, &host_errno);
+  if (ans == 0 && len > 0) return WASIO_ECONN;
+  if (ans < 0) return translate_error(host_errno);
+  *splicelen = (uint32_t)ans;
+  return WASIO_OK;
+}
+
+wasio_result_t wasio_close(struct wasio_pollfd *wfd, wasio_fd_t vfd) {
+  // NOTE(dhil): Closing the host fd implicitly removes it from the
+  // epoll interest set.
+  if (host_close(wfd->fds[vfd], &host_errno) != 0) return translate_error(host_errno);
+  wfd->fds[vfd] = -1;
+  wfd->interest[vfd] = 0;
+  wfd->wanted[vfd] = 0;
+  wfd->length--;
+  assert(freelist_reclaim(wfd->fl, (uint32_t)vfd) == FREELIST_OK);
+  return WASIO_OK;
+}
+
+wasio_result_t wasio_notify_recv(struct wasio_pollfd *wfd, wasio_fd_t vfd) {
+  // Read interest is usually still registered; see `wasio_poll`.
+  if ((wfd->interest[vfd] & WASIO_POLLIN) == 0) {
+    uint32_t events = wfd->interest[vfd] | WASIO_POLLIN;
+    if (host_epoll_ctl(wfd->epfd, HOST_EPOLL_CTL_MOD, wfd->fds[vfd], events, vfd, &host_errno) < 0)
+      return translate_error(host_errno);
+    wfd->interest[vfd] = events;
+  }
+  wfd->wanted[vfd] |= WASIO_POLLIN;
+  return WASIO_OK;
+}
+
+wasio_result_t wasio_notify_send(struct wasio_pollfd *wfd, wasio_fd_t vfd) {
+  if ((wfd->interest[vfd] & WASIO_POLLOUT) == 0) {
+    uint32_t events = wfd->interest[vfd] | WASIO_POLLOUT;
+    if (host_epoll_ctl(wfd->epfd, HOST_EPOLL_CTL_MOD, wfd->fds[vfd], events, vfd, &host_errno) < 0)
+      return translate_error(host_errno);
+    wfd->interest[vfd] = events;
+  }
+  wfd->wanted[vfd] |= WASIO_POLLOUT;
+  return WASIO_OK;
+}
+
+wasio_result_t wasio_notify_clear(struct wasio_pollfd *wfd, wasio_fd_t vfd) {
+  wfd->wanted[vfd] = 0;
+  if (wfd->interest[vfd] != 0) {
+    if (host_epoll_ctl(wfd->epfd, HOST_EPOLL_CTL_MOD, wfd->fds[vfd], HOST_EPOLLONESHOT, vfd, &host_errno) < 0)
+      return translate_error(host_errno);
+    wfd->interest[vfd] = 0;
+  }
+  return WASIO_OK;
+}
@@ -4,8 +4,10 @@
 #include <host/errno.h>
 #include <host/poll.h>
 #include <host/socket.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <wasio.h>
 
 static inline wasio_result_t translate_error(int32_t errno) {
@@ -17,13 +19,60 @@ static inline wasio_result_t translate_error(int32_t errno) {
   }
 }
 
+// Marks a vfd which has no entry.
+#define WASIO_NO_SLOT UINT32_MAX
+
+// Appends an entry for `fd`, and records it in the slot index. An entry
+// without `events` starts out disarmed; see `wasio_disarm`.
+static wasio_result_t wasio_append(struct wasio_pollfd *wfd, int32_t fd, short events) {
+  assert(wfd->length < wfd->capacity && fd >= 0);
+  if ((uint32_t)fd >= wfd->nslots) {
+    uint32_t nslots = wfd->nslots < 64 ? 64 : wfd->nslots;
+    while (nslots <= (uint32_t)fd) nslots *= 2;
+    uint32_t *slots = (uint32_t*)realloc(wfd->slots, sizeof(uint32_t)*nslots);
+    if (slots == NULL) return WASIO_EFULL;
+    for (uint32_t i = wfd->nslots; i < nslots; i++)
+      slots[i] = WASIO_NO_SLOT;
+    wfd->slots = slots;
+    wfd->nslots = nslots;
+  }
+  wfd->slots[fd] = wfd->length;
+  wfd->fds[wfd->length++] = (struct pollfd) { .fd = events != 0 ? fd : ~fd, .events = events, .revents = 0 };
+  return WASIO_OK;
+}
+
+// Appends an entry for `fd`, which was just handed out by the host, or
+// closes it if there is no room for it.
+static wasio_result_t wasio_track(struct wasio_pollfd *wfd, int32_t fd, short events) {
+  if (wasio_append(wfd, fd, events) == WASIO_OK) return WASIO_OK;
+  (void)host_close(fd, &host_errno);
+  return WASIO_EFULL;
+}
+
 wasio_result_t wasio_listen(struct wasio_pollfd *wfd, wasio_fd_t /* out */ *vfd, int32_t port, int32_t backlog) {
-  assert(wfd->length < wfd->capacity);
+  if (wfd->length == wfd->capacity) return WASIO_EFULL;
   int32_t fd = host_listen(port, backlog, &host_errno);
   if (fd < 0) return translate_error(host_errno);
-  wfd->fds[wfd->length++] = (struct pollfd) { .fd = fd, .events = WASIO_POLLIN, .revents = 0 };
+  if (wasio_track(wfd, fd, WASIO_POLLIN) != WASIO_OK) return WASIO_EFULL;
   *vfd = (wasio_fd_t)fd;
-  assert(wfd->length <= wfd->capacity);
+  return WASIO_OK;
+}
+
+static_assert(sizeof(struct wasio_listen_opts) == sizeof(struct host_listen_opts), "size of struct wasio_listen_opts");
+static_assert(WASIO_SOCKOPT_NODELAY == HOST_SOCKOPT_NODELAY && WASIO_SOCKOPT_RCVBUF == HOST_SOCKOPT_RCVBUF, "option names");
+
+wasio_result_t wasio_listen_ex(struct wasio_pollfd *wfd, wasio_fd_t /* out */ *vfd, int32_t port, const struct wasio_listen_opts *opts) {
+  if (wfd->length == wfd->capacity) return WASIO_EFULL;
+  int32_t fd = host_listen_ex(port, (const struct host_listen_opts*)opts, &host_errno);
+  if (fd < 0) return translate_error(host_errno);
+  if (wasio_track(wfd, fd, WASIO_POLLIN) != WASIO_OK) return WASIO_EFULL;
+  *vfd = (wasio_fd_t)fd;
+  return WASIO_OK;
+}
+
+wasio_result_t wasio_setsockopt(struct wasio_pollfd *wfd __attribute__((unused)), wasio_fd_t vfd, enum wasio_sockopt name, int32_t value) {
+  int32_t ans = host_setsockopt(vfd, (int32_t)name, value, &host_errno);
+  if (ans < 0) return translate_error(host_errno);
   return WASIO_OK;
 }
 
@@ -32,16 +81,35 @@ wasio_result_t wasio_init(struct wasio_pollfd *wfd, uint32_t capacity) {
   if (wfd->fds == NULL) return WASIO_ERROR;
   wfd->capacity = capacity;
   wfd->length = 0;
+  wfd->slots = NULL;
+  wfd->nslots = 0;
+  return WASIO_OK;
+}
+
+wasio_result_t wasio_reserve(struct wasio_pollfd *wfd, uint32_t capacity) {
+  if (capacity <= wfd->capacity) return WASIO_OK;
+  if (capacity < 2 * wfd->capacity) capacity = 2 * wfd->capacity;
+  struct pollfd *fds = (struct pollfd*)realloc(wfd->fds, sizeof(struct pollfd)*capacity);
+  if (fds == NULL) return WASIO_EFULL;
+  wfd->fds = fds;
+  wfd->capacity = capacity;
   return WASIO_OK;
 }
 
 void wasio_finalize(struct wasio_pollfd *wfd) {
   free(wfd->fds);
+  free(wfd->slots);
+  wfd->slots = NULL;
+  wfd->nslots = 0;
   wfd->length = 0;
   wfd->capacity = 0;
 }
 
-wasio_result_t wasio_poll(struct wasio_pollfd *wfd, uint32_t *nready, int32_t timeout) {
+wasio_result_t wasio_poll( struct wasio_pollfd *wfd
+                         , struct wasio_event *ev __attribute__((unused))
+                         , uint32_t max_events __attribute__((unused))
+                         , uint32_t *nready
+                         , int32_t timeout ) {
   int ans = host_poll(wfd->fds, wfd->length, timeout, &host_errno);
   if (ans < 0) return translate_error(host_errno);
   *nready = (uint32_t)ans;
@@ -49,12 +117,47 @@ wasio_result_t wasio_poll(struct wasio_pollfd *wfd, uint32_t *nready, int32_t ti
 }
 
 wasio_result_t wasio_accept(struct wasio_pollfd *wfd, wasio_fd_t vfd, wasio_fd_t *new_conn) {
-  assert(wfd->length < wfd->capacity);
+  if (wfd->length == wfd->capacity) return WASIO_EFULL;
   int ans = host_accept(vfd, &host_errno);
   if (ans < 0) return translate_error(host_errno);
-  wfd->fds[wfd->length++] = (struct pollfd) { .fd = (int32_t)ans, .events = WASIO_POLLIN, .revents = 0 };
+  if (wasio_track(wfd, (int32_t)ans, WASIO_POLLIN) != WASIO_OK) return WASIO_EFULL;
   *new_conn = (int32_t)ans;
-  assert(wfd->length <= wfd->capacity);
+  return WASIO_OK;
+}
+
+wasio_result_t wasio_connect(struct wasio_pollfd *wfd, wasio_fd_t /* out */ *vfd, const char *addr, int32_t port) {
+  if (wfd->length == wfd->capacity) return WASIO_EFULL;
+  host_errno = 0;
+  int32_t fd = host_connect(addr, (uint32_t)strlen(addr), port, &host_errno);
+  if (fd < 0) return translate_error(host_errno);
+  bool in_progress = host_errno == HOST_EINPROGRESS;
+  if (wasio_track(wfd, fd, WASIO_POLLIN) != WASIO_OK) return WASIO_EFULL;
+  *vfd = (wasio_fd_t)fd;
+  return in_progress ? WASIO_EINPROGRESS : WASIO_OK;
+}
+
+wasio_result_t wasio_connect_result(struct wasio_pollfd *wfd __attribute__((unused)), wasio_fd_t vfd) {
+  if (host_connect_result(vfd, &host_errno) < 0) return translate_error(host_errno);
+  return WASIO_OK;
+}
+
+wasio_result_t wasio_accept_many(struct wasio_pollfd *wfd, wasio_fd_t vfd, wasio_fd_t *new_conns, uint32_t max, uint32_t *naccepted) {
+  uint32_t room = wfd->capacity - wfd->length;
+  if (max > room) max = room;
+  if (max == 0) return WASIO_EFULL;
+  int32_t ans = host_accept_many(vfd, (int32_t*)new_conns, max, &host_errno);
+  if (ans < 0) return translate_error(host_errno);
+  for (int32_t i = 0; i < ans; i++) {
+    if (wasio_append(wfd, new_conns[i], WASIO_POLLIN) != WASIO_OK) {
+      // Drop the connections that could not be tracked.
+      for (int32_t j = i; j < ans; j++)
+        (void)host_close(new_conns[j], &host_errno);
+      if (i == 0) return WASIO_EFULL;
+      ans = i;
+      break;
+    }
+  }
+  *naccepted = (uint32_t)ans;
   return WASIO_OK;
 }
 
@@ -73,9 +176,114 @@ wasio_result_t wasio_send(struct wasio_pollfd *wfd __attribute__((unused)), wasi
   return WASIO_OK;
 }
 
-wasio_result_t wasio_close(struct wasio_pollfd *wfd __attribute__((unused)), wasio_fd_t vfd) {
+static_assert(sizeof(struct wasio_iovec) == sizeof(struct host_iovec), "size of struct wasio_iovec");
+static_assert(offsetof(struct wasio_iovec, len) == offsetof(struct host_iovec, len), "offset of len");
+
+wasio_result_t wasio_recvv(struct wasio_pollfd *wfd __attribute__((unused)), wasio_fd_t vfd, const struct wasio_iovec *iov, uint32_t iovcnt, uint32_t *recvlen) {
+  int32_t ans = host_recvv(vfd, (const struct host_iovec*)iov, iovcnt, &host_errno);
+  if (ans == 0) return WASIO_ECONN;
+  if (ans < 0) return translate_error(host_errno);
+  *recvlen = (uint32_t)ans;
+  return WASIO_OK;
+}
+
+wasio_result_t wasio_sendv(struct wasio_pollfd *wfd __attribute__((unused)), wasio_fd_t vfd, const struct wasio_iovec *iov, uint32_t iovcnt, uint32_t *sendlen) {
+  int32_t ans = host_sendv(vfd, (const struct host_iovec*)iov, iovcnt, &host_errno);
+  if (ans < 0) return translate_error(host_errno);
+  *sendlen = (uint32_t)ans;
+  return WASIO_OK;
+}
+
+wasio_result_t wasio_open(struct wasio_pollfd *wfd __attribute__((unused)), const char *path, wasio_fd_t /* out */ *vfd) {
+  int32_t ans = host_open(path, (uint32_t)strlen(path), &host_errno);
+  if (ans < 0) return translate_error(host_errno);
+  *vfd = (wasio_fd_t)ans;
+  return WASIO_OK;
+}
+
+wasio_result_t wasio_pipe(struct wasio_pollfd *wfd, wasio_fd_t /* out */ *rvfd, wasio_fd_t /* out */ *wvfd) {
+  if (wfd->capacity - wfd->length < 2) return WASIO_EFULL;
+  int32_t fds[2];
+  if (host_pipe(fds, &host_errno) < 0) return translate_error(host_errno);
+  // Pipe ends start out disarmed.
+  if (wasio_append(wfd, fds[0], 0) != WASIO_OK) {
+    (void)host_close(fds[0], &host_errno);
+    (void)host_close(fds[1], &host_errno);
+    return WASIO_EFULL;
+  }
+  if (wasio_track(wfd, fds[1], 0) != WASIO_OK) {
+    (void)wasio_close(wfd, fds[0]);
+    return WASIO_EFULL;
+  }
+  *rvfd = (wasio_fd_t)fds[0];
+  *wvfd = (wasio_fd_t)fds[1];
+  return WASIO_OK;
+}
+
+wasio_result_t wasio_sendfile(struct wasio_pollfd *wfd __attribute__((unused)), wasio_fd_t vfd, wasio_fd_t file_vfd, int64_t offset, uint32_t len, uint32_t *sendlen) {
+  int32_t ans = host_sendfile(vfd, file_vfd, offset, len, &host_errno);
+  if (ans < 0) return translate_error(host_errno);
+  *sendlen = (uint32_t)ans;
+  return WASIO_OK;
+}
+
+wasio_result_t wasio_splice(struct wasio_pollfd *wfd __attribute__((unused)), wasio_fd_t in_vfd, wasio_fd_t out_vfd, uint32_t len, uint32_t *splicelen) {
+  int32_t ans = host_splice(in_vfd, out_vfd, len, &host_errno);
+  if (ans == 0 && len > 0) return WASIO_ECONN;
+  if (ans < 0) return translate_error(host_errno);
+  *splicelen = (uint32_t)ans;
+  return WASIO_OK;
+}
+
+// Finds the entry of `vfd`, armed or not.
+static inline struct pollfd* wasio_lookup(struct wasio_pollfd *wfd, wasio_fd_t vfd) {
+  if (vfd < 0 || (uint32_t)vfd >= wfd->nslots || wfd->slots[vfd] == WASIO_NO_SLOT) return NULL;
+  return &wfd->fds[wfd->slots[vfd]];
+}
+
+// Drops the entry of `vfd`, if any.
+static void wasio_forget(struct wasio_pollfd *wfd, wasio_fd_t vfd) {
+  struct pollfd *pfd = wasio_lookup(wfd, vfd);
+  if (pfd == NULL) return;
+  // NOTE(dhil): The last entry takes the vacant place. If this happens
+  // whilst iterating the ready entries, then the moved entry is
+  // skipped, but as poll is level-triggered it is reported again.
+  struct pollfd last = wfd->fds[--wfd->length];
+  wfd->slots[last.fd < 0 ? ~last.fd : last.fd] = wfd->slots[vfd];
+  wfd->slots[vfd] = WASIO_NO_SLOT;
+  *pfd = last;
+}
+
+wasio_result_t wasio_close(struct wasio_pollfd *wfd, wasio_fd_t vfd) {
+  wasio_forget(wfd, vfd);
   int ans = host_close(vfd, &host_errno);
   if (ans < 0) return translate_error(host_errno);
   return WASIO_OK;
 }
 
+wasio_result_t wasio_notify_recv(struct wasio_pollfd *wfd, wasio_fd_t vfd) {
+  struct pollfd *pfd = wasio_lookup(wfd, vfd);
+  if (pfd == NULL) return WASIO_ERROR;
+  pfd->fd = (int32_t)vfd;
+  pfd->events |= WASIO_POLLIN;
+  return WASIO_OK;
+}
+
+wasio_result_t wasio_notify_send(struct wasio_pollfd *wfd, wasio_fd_t vfd) {
+  struct pollfd *pfd = wasio_lookup(wfd, vfd);
+  if (pfd == NULL) return WASIO_ERROR;
+  pfd->fd = (int32_t)vfd;
+  pfd->events |= WASIO_POLLOUT;
+  return WASIO_OK;
+}
+
+wasio_result_t wasio_notify_clear(struct wasio_pollfd *wfd, wasio_fd_t vfd) {
+  struct pollfd *pfd = wasio_lookup(wfd, vfd);
+  if (pfd == NULL) return WASIO_ERROR;
+  pfd->events = 0;
+  pfd->revents = 0;
+  if (pfd->fd >= 0) pfd->fd = ~pfd->fd;
+  return WASIO_OK;
+}
+
+#undef WASIO_NO_SLOT
@@ -0,0 +1,112 @@
+#include <assert.h>
+#include <buf_pool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NBUFS 256
+
+static struct buf_pool_stats stats[BUF_POOL_NCLASSES];
+
+static const struct buf_pool_stats* class_stats(buf_pool_t pool, uint32_t size) {
+  buf_pool_stats(pool, stats);
+  for (uint32_t i = 0; i < BUF_POOL_NCLASSES; i++) {
+    if (stats[i].size == size) return &stats[i];
+  }
+  abort();
+}
+
+int main(void) {
+  buf_pool_t pool;
+  assert(buf_pool_new(4, &pool) == BUF_POOL_OK);
+
+  // Sizes round up to the next class.
+  const uint32_t min = UINT32_C(1) << BUF_POOL_MIN_SHIFT, max = UINT32_C(1) << BUF_POOL_MAX_SHIFT;
+  uint8_t *b0 = buf_pool_acquire(pool, 0);
+  uint8_t *b1 = buf_pool_acquire(pool, min + 1);
+  uint8_t *b2 = buf_pool_acquire(pool, 4096);
+  assert(b0 != NULL && b1 != NULL && b2 != NULL);
+  assert(buf_pool_capacity(b0) == min);
+  assert(buf_pool_capacity(b1) == 2 * min);
+  assert(buf_pool_capacity(b2) == 4096);
+  memset(b2, 0xAB, 4096);
+  assert(class_stats(pool, 4096)->in_use == 1);
+  assert(class_stats(pool, 4096)->misses == 1);
+
+  // Released buffers are recycled, most recent first.
+  buf_pool_release(pool, b2);
+  assert(class_stats(pool, 4096)->in_use == 0);
+  assert(class_stats(pool, 4096)->idle == 1);
+  uint8_t *b3 = buf_pool_acquire(pool, 3000);
+  assert(b3 == b2);
+  assert(class_stats(pool, 4096)->acquired == 2);
+  assert(class_stats(pool, 4096)->misses == 1);
+  assert(class_stats(pool, 4096)->idle == 0);
+
+  // Shared buffers return to the pool with the last reference.
+  buf_pool_retain(b3);
+  buf_pool_retain(b3);
+  buf_pool_release(pool, b3);
+  buf_pool_release(pool, b3);
+  assert(class_stats(pool, 4096)->in_use == 1);
+  buf_pool_release(pool, b3);
+  assert(class_stats(pool, 4096)->in_use == 0);
+  assert(class_stats(pool, 4096)->idle == 1);
+  buf_pool_release(pool, b0);
+  buf_pool_release(pool, b1);
+
+  // High water and the idle cap.
+  static uint8_t *bufs[NBUFS];
+  for (uint32_t i = 0; i < NBUFS; i++) {
+    bufs[i] = buf_pool_acquire(pool, 1024);
+    assert(bufs[i] != NULL);
+    memset(bufs[i], (int)i, 1024);
+  }
+  for (uint32_t i = 0; i < NBUFS; i++) {
+    for (uint32_t j = 0; j < 1024; j++) assert(bufs[i][j] == (uint8_t)i);
+  }
+  assert(class_stats(pool, 1024)->in_use == NBUFS);
+  assert(class_stats(pool, 1024)->high_water == NBUFS);
+  for (uint32_t i = 0; i < NBUFS; i++)
+    buf_pool_release(pool, bufs[i]);
+  assert(class_stats(pool, 1024)->in_use == 0);
+  assert(class_stats(pool, 1024)->high_water == NBUFS);
+  assert(class_stats(pool, 1024)->idle == 4);
+  for (uint32_t i = 0; i < 4; i++)
+    bufs[i] = buf_pool_acquire(pool, 1024);
+  assert(class_stats(pool, 1024)->misses == NBUFS);
+  for (uint32_t i = 0; i < 4; i++)
+    buf_pool_release(pool, bufs[i]);
+
+  // Oversized buffers bypass the pool.
+  uint8_t *big = buf_pool_acquire(pool, max + 1);
+  assert(big != NULL && buf_pool_capacity(big) == max + 1);
+  memset(big, 0, max + 1);
+  buf_pool_stats(pool, stats);
+  for (uint32_t i = 0; i < BUF_POOL_NCLASSES; i++) assert(stats[i].in_use == 0);
+  buf_pool_release(pool, big);
+  uint8_t *top = buf_pool_acquire(pool, max);
+  assert(buf_pool_capacity(top) == max);
+  buf_pool_release(pool, top);
+
+  // Buffers may move between pools; the net counts add up.
+  buf_pool_t other;
+  assert(buf_pool_new(4, &other) == BUF_POOL_OK);
+  uint8_t *moved = buf_pool_acquire(pool, 512);
+  buf_pool_release(other, moved);
+  assert(class_stats(pool, 512)->in_use == 1);
+  assert(class_stats(other, 512)->in_use == -1);
+  assert(class_stats(other, 512)->idle == 1);
+  assert(buf_pool_acquire(other, 512) == moved);
+  buf_pool_release(NULL, moved);
+  buf_pool_delete(other);
+
+  // Without a pool buffers come from and go to the heap.
+  uint8_t *loose = buf_pool_acquire(NULL, 100);
+  assert(loose != NULL && buf_pool_capacity(loose) == 2 * min);
+  buf_pool_release(NULL, loose);
+
+  buf_pool_delete(pool);
+
+  return 0;
+}
@@ -0,0 +1,141 @@
+#include <assert.h>
+#include <freelist.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define NTHREADS 8
+#define HELD 64
+#define ROUNDS 200000
+
+struct stress {
+  freelist_atomic_t fl;
+  uint32_t capacity;
+  uint32_t *owner;   // the thread holding an entry, by entry; 0 if free
+  uint32_t *payload; // written by the holder, checked by the next one
+  uint64_t full;     // number of times the freelist ran dry
+};
+
+struct worker {
+  struct stress *st;
+  uint32_t id;
+};
+
+static inline uint32_t xorshift(uint32_t *state) {
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *state = x;
+}
+
+static void* stress_worker(void *arg) {
+  struct worker *w = (struct worker*)arg;
+  struct stress *st = w->st;
+  uint32_t held[HELD], nheld = 0, rng = w->id * 7919 + 1;
+  for (uint32_t round = 0; round < ROUNDS; round++) {
+    if (nheld < HELD && (nheld == 0 || xorshift(&rng) % 2 == 0)) {
+      uint32_t entry;
+      freelist_result_t res = freelist_atomic_next(st->fl, &entry);
+      if (res == FREELIST_FULL) {
+        __atomic_add_fetch(&st->full, 1, __ATOMIC_RELAXED);
+        continue;
+      }
+      assert(res == FREELIST_OK && entry < st->capacity);
+      // Nobody else may hold the entry.
+      assert(__atomic_exchange_n(&st->owner[entry], w->id, __ATOMIC_RELAXED) == 0);
+      // The previous holder's write is visible.
+      assert(st->payload[entry] == 0);
+      st->payload[entry] = w->id;
+      held[nheld++] = entry;
+    } else {
+      uint32_t i = xorshift(&rng) % nheld;
+      uint32_t entry = held[i];
+      held[i] = held[--nheld];
+      assert(st->payload[entry] == w->id);
+      st->payload[entry] = 0;
+      assert(__atomic_exchange_n(&st->owner[entry], 0, __ATOMIC_RELAXED) == w->id);
+      assert(freelist_atomic_reclaim(st->fl, entry) == FREELIST_OK);
+    }
+  }
+  while (nheld > 0) {
+    uint32_t entry = held[--nheld];
+    st->payload[entry] = 0;
+    assert(__atomic_exchange_n(&st->owner[entry], 0, __ATOMIC_RELAXED) == w->id);
+    assert(freelist_atomic_reclaim(st->fl, entry) == FREELIST_OK);
+  }
+  return NULL;
+}
+
+// Checks that every entry is handed out exactly once.
+void check_drained(freelist_atomic_t fl, uint32_t capacity) {
+  bool *seen = (bool*)calloc(capacity, sizeof(bool));
+  assert(seen != NULL);
+  uint32_t entry;
+  for (uint32_t i = 0; i < capacity; i++) {
+    assert(freelist_atomic_next(fl, &entry) == FREELIST_OK);
+    assert(entry < capacity && !seen[entry]);
+    seen[entry] = true;
+  }
+  assert(freelist_atomic_next(fl, &entry) == FREELIST_FULL);
+  for (uint32_t i = 0; i < capacity; i++)
+    assert(freelist_atomic_reclaim(fl, i) == FREELIST_OK);
+  free(seen);
+}
+
+// Runs NTHREADS threads against a freelist of `capacity` entries, and
+// returns how often the freelist ran dry.
+uint64_t stress(uint32_t capacity) {
+  struct stress st = { .capacity = capacity, .full = 0 };
+  assert(freelist_atomic_new(capacity, &st.fl) == FREELIST_OK);
+  st.owner = (uint32_t*)calloc(capacity, sizeof(uint32_t));
+  st.payload = (uint32_t*)calloc(capacity, sizeof(uint32_t));
+  assert(st.owner != NULL && st.payload != NULL);
+  pthread_t threads[NTHREADS];
+  struct worker workers[NTHREADS];
+  for (uint32_t i = 0; i < NTHREADS; i++) {
+    workers[i] = (struct worker){ .st = &st, .id = i + 1 };
+    assert(pthread_create(&threads[i], NULL, stress_worker, &workers[i]) == 0);
+  }
+  for (uint32_t i = 0; i < NTHREADS; i++)
+    assert(pthread_join(threads[i], NULL) == 0);
+  // Nothing was lost or duplicated.
+  for (uint32_t i = 0; i < capacity; i++) assert(st.owner[i] == 0);
+  check_drained(st.fl, capacity);
+  freelist_atomic_delete(st.fl);
+  free(st.owner);
+  free(st.payload);
+  return st.full;
+}
+
+int main(void) {
+  freelist_atomic_t fl;
+  uint32_t entry;
+  assert(freelist_atomic_new(0, &fl) == FREELIST_SIZE_ERR);
+
+  // Sizes which are, and are not, a multiple of the word size.
+  const uint32_t sizes[] = { 1, 63, 64, 65, 130, 4096, 100000 };
+  for (uint32_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    assert(freelist_atomic_new(sizes[i], &fl) == FREELIST_OK);
+    check_drained(fl, sizes[i]);
+    assert(freelist_atomic_reclaim(fl, sizes[i]) == FREELIST_OB_ENTRY);
+    freelist_atomic_delete(fl);
+  }
+
+  // A reclaimed entry is found again when it is the only free one.
+  assert(freelist_atomic_new(130, &fl) == FREELIST_OK);
+  for (uint32_t i = 0; i < 130; i++) assert(freelist_atomic_next(fl, &entry) == FREELIST_OK);
+  assert(freelist_atomic_reclaim(fl, 77) == FREELIST_OK);
+  assert(freelist_atomic_next(fl, &entry) == FREELIST_OK && entry == 77);
+  assert(freelist_atomic_next(fl, &entry) == FREELIST_FULL);
+  freelist_atomic_delete(fl);
+
+  // Plenty of room, and heavy contention with the freelist running dry.
+  (void)stress(NTHREADS * HELD * 4);
+  // The workers hold more entries than there are, so some must find
+  // the freelist dry.
+  assert(stress(NTHREADS * HELD / 4 + 3) > 0);
+
+  return 0;
+}
@@ -1,5 +1,6 @@
 #include <assert.h>
 #include <freelist.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -12,6 +13,39 @@ void fill_list(size_t capacity, freelist_t fl) {
   }
 }
 
+// Checks random allocations and reclamations against a plain array.
+void check_model(uint32_t capacity, bool rotate, uint32_t steps) {
+  freelist_t fl;
+  uint32_t entry, cursor = 0;
+  bool *used = (bool*)calloc(capacity, sizeof(bool));
+  assert(used != NULL);
+  assert(freelist_new(capacity, &fl) == FREELIST_OK);
+  freelist_rotate(fl, rotate);
+  srand(capacity);
+  for (uint32_t step = 0; step < steps; step++) {
+    if (rand() % 3 != 0) {
+      uint32_t expected = capacity;
+      for (uint32_t i = 0; i < capacity && expected == capacity; i++) {
+        uint32_t j = rotate ? (cursor + i) % capacity : i;
+        if (!used[j]) expected = j;
+      }
+      if (expected == capacity) {
+        assert(freelist_next(fl, &entry) == FREELIST_FULL);
+      } else {
+        assert(freelist_next(fl, &entry) == FREELIST_OK && entry == expected);
+        used[entry] = true;
+        cursor = (entry + 1) % capacity;
+      }
+    } else {
+      entry = (uint32_t)rand() % capacity;
+      assert(freelist_reclaim(fl, entry) == FREELIST_OK);
+      used[entry] = false;
+    }
+  }
+  freelist_delete(fl);
+  free(used);
+}
+
 int main(void) {
   uint32_t entry;
   freelist_t fl;
@@ -56,5 +90,64 @@ int main(void) {
   assert(freelist_reclaim(fl, 0) == FREELIST_OK);
   freelist_delete(fl);
 
+  // Tests across leaf and summary words (size 100000).
+  assert(freelist_new(100000, &fl) == FREELIST_OK);
+  for (uint32_t i = 0; i < 100000; i++)
+    assert(freelist_next(fl, &entry) == FREELIST_OK && entry == i);
+  assert(freelist_next(fl, &entry) == FREELIST_FULL);
+  const uint32_t boundaries[] = { 99999, 4096, 4095, 64, 63, 0 };
+  for (size_t i = 0; i < sizeof(boundaries) / sizeof(boundaries[0]); i++)
+    assert(freelist_reclaim(fl, boundaries[i]) == FREELIST_OK);
+  for (size_t i = sizeof(boundaries) / sizeof(boundaries[0]); i > 0; i--)
+    assert(freelist_next(fl, &entry) == FREELIST_OK && entry == boundaries[i - 1]);
+  assert(freelist_next(fl, &entry) == FREELIST_FULL);
+  assert(freelist_reclaim(fl, 100000) == FREELIST_OB_ENTRY);
+  freelist_delete(fl);
+
+  // Growing across summary words, and shrinking within a leaf word.
+  assert(freelist_new(100, &fl) == FREELIST_OK);
+  fill_list(100, fl);
+  assert(freelist_resize(&fl, 5000) == FREELIST_OK);
+  for (uint32_t i = 100; i < 5000; i++)
+    assert(freelist_next(fl, &entry) == FREELIST_OK && entry == i);
+  assert(freelist_next(fl, &entry) == FREELIST_FULL);
+  assert(freelist_resize(&fl, 4097) == FREELIST_OK);
+  assert(freelist_reclaim(fl, 4097) == FREELIST_OB_ENTRY);
+  assert(freelist_reclaim(fl, 4096) == FREELIST_OK);
+  assert(freelist_next(fl, &entry) == FREELIST_OK && entry == 4096);
+  assert(freelist_next(fl, &entry) == FREELIST_FULL);
+  freelist_delete(fl);
+
+  // Entries dropped by shrinking come back free.
+  assert(freelist_new(130, &fl) == FREELIST_OK);
+  fill_list(130, fl);
+  assert(freelist_resize(&fl, 65) == FREELIST_OK);
+  assert(freelist_resize(&fl, 130) == FREELIST_OK);
+  assert(freelist_next(fl, &entry) == FREELIST_OK && entry == 65);
+  freelist_delete(fl);
+
+  // Rotation.
+  assert(freelist_new(8, &fl) == FREELIST_OK);
+  freelist_rotate(fl, true);
+  assert(freelist_next(fl, &entry) == FREELIST_OK && entry == 0);
+  assert(freelist_next(fl, &entry) == FREELIST_OK && entry == 1);
+  assert(freelist_reclaim(fl, 0) == FREELIST_OK);
+  assert(freelist_next(fl, &entry) == FREELIST_OK && entry == 2);
+  fill_list(5, fl);
+  assert(freelist_next(fl, &entry) == FREELIST_OK && entry == 0);
+  assert(freelist_next(fl, &entry) == FREELIST_FULL);
+  assert(freelist_reclaim(fl, 7) == FREELIST_OK);
+  assert(freelist_reclaim(fl, 3) == FREELIST_OK);
+  assert(freelist_next(fl, &entry) == FREELIST_OK && entry == 3);
+  assert(freelist_next(fl, &entry) == FREELIST_OK && entry == 7);
+  freelist_delete(fl);
+
+  // Random tests.
+  check_model(1, false, 100);
+  check_model(77, false, 10000);
+  check_model(77, true, 10000);
+  check_model(10000, false, 50000);
+  check_model(10000, true, 50000);
+
   return 0;
 }
@@ -0,0 +1,131 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <timer_wheel.h>
+
+#define NTIMERS 4096
+
+static struct timer timers[NTIMERS];
+static bool fired[NTIMERS];
+
+// Advances to `now` and checks that exactly the armed timers with
+// deadlines in (`before`, `now`] expired.
+static uint32_t advance_and_check(timer_wheel_t tw, uint64_t before, uint64_t now, const bool *armed) {
+  struct timer *expired;
+  uint32_t n = timer_wheel_advance(tw, now, &expired);
+  uint32_t count = 0;
+  for (struct timer *t = expired; t != NULL; t = t->next) {
+    size_t i = (size_t)(t - timers);
+    assert(i < NTIMERS);
+    assert(armed[i] && !fired[i]);
+    assert(t->deadline <= now);
+    assert(!timer_armed(t));
+    fired[i] = true;
+    count++;
+  }
+  assert(count == n);
+  for (size_t i = 0; i < NTIMERS; i++) {
+    if (armed[i] && !fired[i]) assert(timers[i].deadline > now);
+    if (armed[i] && timers[i].deadline > before && timers[i].deadline <= now) assert(fired[i]);
+  }
+  return n;
+}
+
+int main(void) {
+  timer_wheel_t tw;
+  struct timer *expired;
+  uint64_t deadline;
+  static bool armed[NTIMERS];
+
+  // Basic tests.
+  assert(timer_wheel_new(100, &tw) == TIMER_WHEEL_OK);
+  assert(!timer_wheel_next(tw, &deadline));
+  assert(timer_wheel_advance(tw, 200, &expired) == 0 && expired == NULL);
+
+  // A deadline in the past expires on the next advance.
+  timer_wheel_arm(tw, &timers[0], 150);
+  assert(timer_armed(&timers[0]));
+  assert(timer_wheel_next(tw, &deadline) && deadline == 200);
+  assert(timer_wheel_advance(tw, 200, &expired) == 1 && expired == &timers[0]);
+  assert(!timer_armed(&timers[0]));
+
+  // Exact expiry at the bottom level.
+  timer_wheel_arm(tw, &timers[0], 210);
+  assert(timer_wheel_next(tw, &deadline) && deadline == 210);
+  assert(timer_wheel_advance(tw, 209, &expired) == 0);
+  assert(timer_wheel_advance(tw, 210, &expired) == 1 && expired == &timers[0]);
+
+  // Disarming.
+  timer_wheel_arm(tw, &timers[0], 300);
+  timer_wheel_arm(tw, &timers[1], 5000);
+  timer_wheel_disarm(tw, &timers[0]);
+  timer_wheel_disarm(tw, &timers[0]);
+  assert(!timer_armed(&timers[0]));
+  assert(timer_wheel_next(tw, &deadline) && deadline <= 5000);
+  assert(timer_wheel_advance(tw, 4999, &expired) == 0);
+  assert(timer_wheel_advance(tw, 5000, &expired) == 1 && expired == &timers[1]);
+  assert(!timer_wheel_next(tw, &deadline));
+
+  // Rearming reschedules.
+  timer_wheel_arm(tw, &timers[0], 6000);
+  timer_wheel_arm(tw, &timers[0], 5500);
+  assert(timer_wheel_advance(tw, 5500, &expired) == 1 && expired == &timers[0]);
+  assert(timer_wheel_advance(tw, 6000, &expired) == 0);
+
+  // Deadlines beyond the span of the wheel.
+  timer_wheel_arm(tw, &timers[0], 6000 + ((uint64_t)1 << 30));
+  assert(timer_wheel_advance(tw, 6000 + ((uint64_t)1 << 30) - 1, &expired) == 0);
+  assert(timer_wheel_advance(tw, 6000 + ((uint64_t)1 << 30), &expired) == 1 && expired == &timers[0]);
+  timer_wheel_delete(tw);
+
+  // Randomised tests against the obvious specification.
+  srand(42);
+  uint64_t now = 12345;
+  assert(timer_wheel_new(now, &tw) == TIMER_WHEEL_OK);
+  for (uint32_t round = 0; round < 64; round++) {
+    // (Re)arm a random subset; spread the deadlines over all levels.
+    for (size_t i = 0; i < NTIMERS; i++) {
+      if (armed[i] && !fired[i]) {
+        if (rand() % 8 == 0) {
+          timer_wheel_disarm(tw, &timers[i]);
+          armed[i] = false;
+        }
+        continue;
+      }
+      if (rand() % 2 == 0) {
+        uint32_t shift = (uint32_t)(rand() % 27);
+        uint64_t delay = (uint64_t)rand() % ((uint64_t)1 << shift);
+        timer_wheel_arm(tw, &timers[i], now + delay);
+        armed[i] = true;
+        fired[i] = false;
+      } else {
+        armed[i] = false;
+      }
+    }
+
+    // The reported bound never exceeds the earliest deadline.
+    uint64_t earliest = UINT64_MAX;
+    for (size_t i = 0; i < NTIMERS; i++)
+      if (armed[i] && !fired[i] && timers[i].deadline < earliest) earliest = timers[i].deadline;
+    if (earliest != UINT64_MAX) {
+      assert(timer_wheel_next(tw, &deadline) && deadline <= (earliest > now ? earliest : now));
+    }
+
+    // Advance in steps of varying magnitude.
+    for (uint32_t step = 0; step < 16; step++) {
+      uint32_t shift = (uint32_t)(rand() % 22);
+      uint64_t next = now + (uint64_t)rand() % ((uint64_t)1 << shift);
+      advance_and_check(tw, now, next, armed);
+      now = next;
+    }
+  }
+
+  // Drain whatever is left.
+  advance_and_check(tw, now, now + ((uint64_t)1 << 27), armed);
+  assert(!timer_wheel_next(tw, &deadline));
+  timer_wheel_delete(tw);
+
+  return 0;
+}
@@ -7,6 +7,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 
 struct errno_item {
   const char *name;
@@ -274,15 +275,54 @@ void emit_poll_h(FILE *fp) {
   emit_hend(fp);
 }
 
+void emit_epoll_h(FILE *fp) {
+  emit_header(fp);
+  emit_hguard(fp, "WAEIO_HOST_EPOLL_H");
+
+  emit_stringln(fp, "\n#include <assert.h>");
+  emit_stringln(fp, "#include <stddef.h>");
+  emit_stringln(fp, "#include <stdint.h>");
+  emit_stringln(fp, "#include <wasm_utils.h>\n");
+
+  fprintf(fp, "#define HOST_EPOLL_CTL_ADD %d\n", EPOLL_CTL_ADD);
+  fprintf(fp, "#define HOST_EPOLL_CTL_MOD %d\n", EPOLL_CTL_MOD);
+  fprintf(fp, "#define HOST_EPOLL_CTL_DEL %d\n\n", EPOLL_CTL_DEL);
+
+  fprintf(fp, "#define HOST_EPOLLIN %d\n", EPOLLIN);
+  fprintf(fp, "#define HOST_EPOLLPRI %d\n", EPOLLPRI);
+  fprintf(fp, "#define HOST_EPOLLOUT %d\n", EPOLLOUT);
+  fprintf(fp, "#define HOST_EPOLLERR %d\n", EPOLLERR);
+  fprintf(fp, "#define HOST_EPOLLHUP %d\n", EPOLLHUP);
+  fprintf(fp, "#define HOST_EPOLLRDHUP %d\n", EPOLLRDHUP);
+  fprintf(fp, "#define HOST_EPOLLONESHOT %d\n\n", EPOLLONESHOT);
+
+  // NOTE(dhil): The host packs each ready event as a (vfd, revents)
+  // pair, where vfd is the user data registered via `ctl`.
+  fprintf(fp, "struct host_epoll_event {\n"
+          "  int32_t vfd;\n"
+          "  uint32_t revents;\n"
+          "};\n"
+          "static_assert(sizeof(struct host_epoll_event) == 8, \"size of struct host_epoll_event\");\n"
+          "static_assert(offsetof(struct host_epoll_event, vfd) == 0, \"offset of vfd\");\n"
+          "static_assert(offsetof(struct host_epoll_event, revents) == 4, \"offset of revents\");\n\n");
+
+  emit_import(fp, "host_epoll", "create", "int32_t host_epoll_create(int32_t*)");
+  emit_import(fp, "host_epoll", "ctl", "int32_t host_epoll_ctl(int32_t, int32_t, int32_t, uint32_t, int32_t, int32_t*)");
+  emit_import(fp, "host_epoll", "wait", "int32_t host_epoll_wait(int32_t, struct host_epoll_event*, uint32_t, int32_t, int32_t*)");
+
+  emit_hend(fp);
+}
+
 int main(int argc, char **argv) {
   if (argc != 2) {
-    fprintf(stderr, "usage: %s < errno.h | errno.c | poll.h >\n", argv[0]);
+    fprintf(stderr, "usage: %s < errno.h | errno.c | poll.h | epoll.h >\n", argv[0]);
     exit(-1);
   }
 
   if (strcmp(argv[1], "errno.h") == 0) emit_errno_h(stdout, errno_items);
   if (strcmp(argv[1], "errno.c") == 0) emit_errno_c(stdout, errno_items);
   if (strcmp(argv[1], "poll.h") == 0) emit_poll_h(stdout);
+  if (strcmp(argv[1], "epoll.h") == 0) emit_epoll_h(stdout);
 
   return 0;
 }
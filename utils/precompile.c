@@ -0,0 +1,42 @@
+// Small utility to precompile modules ahead of time for the drivers.
+
+#include <host/driver/module_cache.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <wasm.h>
+#include <wasmtime.h>
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    printf("usage: %s <file.wasm>...\n", argv[0]);
+    exit(1);
+  }
+
+  wasm_engine_t *engine = wasm_engine_new_with_config(host_engine_config_new());
+  if (engine == NULL) {
+    fprintf(stderr, "error: failed to create engine\n");
+    exit(1);
+  }
+
+  int ans = 0;
+  for (int i = 1; i < argc; i++) {
+    // Compiles the module, unless an up-to-date artifact exists, and
+    // writes its artifact alongside it.
+    wasmtime_module_t *module = NULL;
+    wasmtime_error_t *error = host_module_load(engine, argv[i], true, &module);
+    if (error != NULL) {
+      wasm_byte_vec_t message;
+      wasmtime_error_message(error, &message);
+      fprintf(stderr, "error: %s: %.*s\n", argv[i], (int)message.size, message.data);
+      wasm_byte_vec_delete(&message);
+      wasmtime_error_delete(error);
+      ans = 1;
+      continue;
+    }
+    wasmtime_module_delete(module);
+  }
+
+  wasm_engine_delete(engine);
+  return ans;
+}